@@ -0,0 +1,536 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++20 Lockless Awaitable MPMC Queue type, for coroutine executors.
+ * Author: Primrose Taylor
+ */
+
+#ifndef ASYNC_MPMC_QUEUE_H
+#define ASYNC_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#if !defined(__cpp_impl_coroutine)
+    #error "async_mpmc_queue needs C++20 coroutines."
+#endif
+
+#include <coroutine>
+
+namespace mpmc_detail
+{
+    /**
+     * A suspended coroutine waiting on an async_mpmc_queue. It lives in the
+     * awaiter, so in the coroutine frame, & is linked into the queue's
+     * waiter list while the coroutine is suspended.
+     */
+    struct async_waiter
+    {
+        async_waiter* next = nullptr;
+        std::coroutine_handle<> handle;
+        // The element a waiting pop moves into, or a waiting push moves from.
+        void* element = nullptr;
+        // Where to resume the coroutine, nullptr to resume it inline.
+        void* executor = nullptr;
+        void (*post_function)(void*, std::coroutine_handle<>) = nullptr;
+        mpmc_result result = mpmc_result::ok;
+
+        void resume()
+        {
+            if (post_function != nullptr)
+            {
+                post_function(executor, handle);
+            }
+            else
+            {
+                handle.resume();
+            }
+        }
+    };
+
+    /**
+     * An intrusive lock-free list of waiters, served oldest first.
+     * Anyone may push onto its stack, but only one thread at a time serves
+     * it: whoever takes the wake count from 0, the others just leave their
+     * wake to it. The serving thread takes the whole stack at once with an
+     * exchange, which can't suffer ABA, & reverses it into arrival order.
+     */
+    struct alignas(CACHE_LINE_SIZE) async_waiter_list
+    {
+        // The newest waiter, linked to the ones before it.
+        std::atomic<async_waiter*> head{ nullptr };
+        // Waiters already taken off the stack, oldest first. Only the
+        // serving thread writes it, and they're all older than any on the stack.
+        std::atomic<async_waiter*> oldest{ nullptr };
+        std::atomic<uint32_t> wake_count{ 0 };
+
+        void push(async_waiter& waiter)
+        {
+            async_waiter* next = head.load(std::memory_order_relaxed);
+
+            do
+            {
+                waiter.next = next;
+            }
+            while (!head.compare_exchange_weak(next, &waiter, std::memory_order_seq_cst,
+                std::memory_order_relaxed));
+        }
+
+        /**
+         * Only ever called by the thread serving the waiters.
+         * @returns The oldest waiter, left in the list, or nullptr if there are none.
+         */
+        async_waiter* front()
+        {
+            async_waiter* waiter = oldest.load(std::memory_order_relaxed);
+
+            if (waiter == nullptr)
+            {
+                async_waiter* newest = head.exchange(nullptr, std::memory_order_acquire);
+
+                while (newest != nullptr)
+                {
+                    async_waiter* const next = newest->next;
+
+                    newest->next = waiter;
+                    waiter = newest;
+                    newest = next;
+                }
+
+                oldest.store(waiter, std::memory_order_seq_cst);
+            }
+
+            return waiter;
+        }
+
+        /**
+         * Unlink the waiter front() returned, once it's been served & before
+         * it's resumed. Only ever called by the thread serving the waiters.
+         */
+        void pop_front(const async_waiter& waiter)
+        {
+            oldest.store(waiter.next, std::memory_order_seq_cst);
+        }
+
+        /**
+         * @returns Whether there may be waiters to serve. A list that is
+         * being served counts, since its waiters are briefly in neither
+         * place while they're moved from the stack to the oldest.
+         */
+        bool has_waiters() const
+        {
+            return head.load(std::memory_order_seq_cst) != nullptr ||
+                oldest.load(std::memory_order_seq_cst) != nullptr ||
+                wake_count.load(std::memory_order_seq_cst) != 0;
+        }
+    };
+}
+
+/**
+ * A bounded_circular_mpmc_queue whose push & pop can be co_awaited.
+ *
+ * A coroutine that finds the ring empty (or full) links itself into a
+ * lock-free waiter list & suspends, instead of spinning or parking the
+ * thread on a futex. The next push (or pop) does the waiting operation on
+ * the waiter's behalf, then resumes it, so a resumed waiter already has its
+ * result & never has to suspend again. A waiter is resumed inline on the
+ * thread that served it, or posted to the executor it was awaited with.
+ *
+ * Every operation goes through this queue, so both its synchronous &
+ * async calls see each other's waiters. Waiters are served in the order they
+ * suspended, so none starves, and a suspended waiter must not be destroyed
+ * before it's resumed.
+ * close() resumes every waiter: pops drain what's left, then return closed.
+ */
+template <typename T, uint_least32_t queue_size,
+    typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class async_mpmc_queue final
+{
+    typedef bounded_circular_mpmc_queue<T, queue_size, backoff_policy, slot_layout,
+        concurrency_mode> queue_type;
+    typedef mpmc_detail::async_waiter async_waiter;
+    typedef mpmc_detail::async_waiter_list async_waiter_list;
+
+    typedef void (*post_function)(void*, std::coroutine_handle<>);
+
+    template <typename executor>
+    static void post_to(void* const target, const std::coroutine_handle<> handle)
+    {
+        static_cast<executor*>(target)->post(handle);
+    }
+
+    class awaiter_base
+    {
+    public:
+        /**
+         * @returns ok, or closed once the queue is closed (& drained, for a pop).
+         */
+        mpmc_result await_resume() const noexcept
+        {
+            return waiter_.result;
+        }
+
+    protected:
+        awaiter_base(async_mpmc_queue& queue, void* const executor,
+            const post_function in_post_function)
+            : owner_(queue)
+        {
+            waiter_.executor = executor;
+            waiter_.post_function = in_post_function;
+        }
+
+        async_mpmc_queue& owner_;
+        async_waiter waiter_;
+
+    private:
+        awaiter_base(const awaiter_base&) = delete;
+        awaiter_base& operator=(const awaiter_base&) = delete;
+    };
+
+public:
+    async_mpmc_queue() = default;
+
+    /**
+     * Awaitable returned by async_pop.
+     */
+    class pop_awaiter final : public awaiter_base
+    {
+        friend class async_mpmc_queue;
+
+    public:
+        bool await_ready() noexcept
+        {
+            this->waiter_.element = &out_data_;
+
+            return this->owner_.try_pop_for(this->waiter_);
+        }
+
+        bool await_suspend(const std::coroutine_handle<> handle) noexcept
+        {
+            this->waiter_.handle = handle;
+
+            return !this->owner_.suspend_consumer(this->waiter_);
+        }
+
+    private:
+        pop_awaiter(async_mpmc_queue& queue, T& out_data, void* const executor,
+            const post_function in_post_function)
+            : awaiter_base(queue, executor, in_post_function),
+            out_data_(out_data)
+        {
+        }
+
+        T& out_data_;
+    };
+
+    /**
+     * Awaitable returned by async_push. It holds the element until it's pushed.
+     */
+    class push_awaiter final : public awaiter_base
+    {
+        friend class async_mpmc_queue;
+
+    public:
+        bool await_ready() noexcept
+        {
+            this->waiter_.element = &in_data_;
+
+            return this->owner_.try_push_for(this->waiter_);
+        }
+
+        bool await_suspend(const std::coroutine_handle<> handle) noexcept
+        {
+            this->waiter_.handle = handle;
+
+            return !this->owner_.suspend_producer(this->waiter_);
+        }
+
+    private:
+        push_awaiter(async_mpmc_queue& queue, T&& in_data, void* const executor,
+            const post_function in_post_function)
+            : awaiter_base(queue, executor, in_post_function),
+            in_data_(std::move(in_data))
+        {
+        }
+
+        T in_data_;
+    };
+
+    /**
+     * Pop an element, suspending the calling coroutine while the ring is empty.
+     * Use as mpmc_result result = co_await queue.async_pop(item);
+     *
+     * @param out_data Reference to the variable that will store the popped
+     * element. It must outlive the co_await.
+     * @returns An awaitable that resolves to ok, or closed once the queue is
+     * closed & drained. The coroutine is resumed inline by whoever pushes.
+     */
+    pop_awaiter async_pop(T& out_data)
+    {
+        return pop_awaiter(*this, out_data, nullptr, nullptr);
+    }
+
+    /**
+     * async_pop, resumed by posting the coroutine to in_executor instead.
+     *
+     * @param in_executor Anything with a post(std::coroutine_handle<>) that
+     * resumes the handle later, on the executor's own threads.
+     */
+    template <typename executor>
+    pop_awaiter async_pop(T& out_data, executor& in_executor)
+    {
+        return pop_awaiter(*this, out_data, &in_executor, &post_to<executor>);
+    }
+
+    /**
+     * Push an element, suspending the calling coroutine while the ring is full.
+     * Use as mpmc_result result = co_await queue.async_push(std::move(item));
+     *
+     * @param in_data The element to push, held by the awaitable until it's pushed.
+     * @returns An awaitable that resolves to ok, or closed. The coroutine
+     * is resumed inline by whoever pops.
+     */
+    push_awaiter async_push(T in_data)
+    {
+        return push_awaiter(*this, std::move(in_data), nullptr, nullptr);
+    }
+
+    /**
+     * async_push, resumed by posting the coroutine to in_executor instead.
+     */
+    template <typename executor>
+    push_awaiter async_push(T in_data, executor& in_executor)
+    {
+        return push_awaiter(*this, std::move(in_data), &in_executor, &post_to<executor>);
+    }
+
+    /**
+     * Push an element without waiting, resuming a waiting consumer if there is one.
+     *
+     * @returns ok, full, or closed.
+     */
+    mpmc_result try_push(const T& in_data)
+    {
+        const mpmc_result result = queue_.try_push(in_data);
+
+        if (result == mpmc_result::ok)
+        {
+            wake_consumers();
+        }
+
+        return result;
+    }
+
+    mpmc_result try_push(T&& in_data)
+    {
+        const mpmc_result result = queue_.try_push(std::move(in_data));
+
+        if (result == mpmc_result::ok)
+        {
+            wake_consumers();
+        }
+
+        return result;
+    }
+
+    /**
+     * Pop an element without waiting, resuming a waiting producer if there is one.
+     *
+     * @returns ok, empty, or closed once the queue is closed & drained.
+     */
+    mpmc_result try_pop(T& out_data)
+    {
+        const mpmc_result result = queue_.try_pop(out_data);
+
+        if (result == mpmc_result::ok)
+        {
+            wake_producers();
+        }
+
+        return result;
+    }
+
+    /**
+     * Close the queue, see bounded_circular_mpmc_queue::close(). Every
+     * waiting producer is resumed with closed, and every waiting consumer
+     * with the next element left, or closed once there are none.
+     */
+    void close()
+    {
+        queue_.close();
+        wake_producers();
+        wake_consumers();
+    }
+
+    bool is_closed() const
+    {
+        return queue_.is_closed();
+    }
+
+    /**
+     * @note Calling this function will pull both ticket cache lines into this core!
+     */
+    uint_fast32_t size() const
+    {
+        return queue_.size();
+    }
+
+    bool empty() const
+    {
+        return queue_.empty();
+    }
+
+    uint_fast32_t capacity() const
+    {
+        return queue_.capacity();
+    }
+
+private:
+    /**
+     * Whether a waiting operation is done with the result of an attempt.
+     */
+    static bool is_final_result(const mpmc_result result)
+    {
+        return result == mpmc_result::ok || result == mpmc_result::closed;
+    }
+
+    /**
+     * The operations of a waiter, with the result kept for await_resume.
+     * @returns Whether the waiter is done.
+     */
+    bool try_pop_for(async_waiter& waiter)
+    {
+        waiter.result = queue_.try_pop(*static_cast<T*>(waiter.element));
+
+        if (waiter.result == mpmc_result::ok)
+        {
+            wake_producers();
+        }
+
+        return is_final_result(waiter.result);
+    }
+
+    bool try_push_for(async_waiter& waiter)
+    {
+        waiter.result = queue_.try_push(std::move(*static_cast<T*>(waiter.element)));
+
+        if (waiter.result == mpmc_result::ok)
+        {
+            wake_consumers();
+        }
+
+        return is_final_result(waiter.result);
+    }
+
+    /**
+     * Link a waiter in, then serve the list in case an element (or space)
+     * turned up in between trying & linking, which would have found no
+     * waiter to serve. Once linked, the waiter may be resumed by another
+     * thread at any time, so neither touches it again.
+     *
+     * @returns Whether the waiter got served itself, in which case it must
+     * not suspend.
+     */
+    bool suspend_consumer(async_waiter& waiter)
+    {
+        consumers_.push(waiter);
+        // Pairs with the fence in wake_consumers(): either the waker sees this
+        // waiter, or the serve below sees the waker's element.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return serve(consumers_, &waiter, &async_mpmc_queue::try_pop_for);
+    }
+
+    bool suspend_producer(async_waiter& waiter)
+    {
+        producers_.push(waiter);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return serve(producers_, &waiter, &async_mpmc_queue::try_push_for);
+    }
+
+    void wake_consumers()
+    {
+        // Pairs with the fence after linking a waiter: either this load sees
+        // the waiter, or the waiter's serve sees this element.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (consumers_.has_waiters())
+        {
+            serve(consumers_, nullptr, &async_mpmc_queue::try_pop_for);
+        }
+    }
+
+    void wake_producers()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (producers_.has_waiters())
+        {
+            serve(producers_, nullptr, &async_mpmc_queue::try_push_for);
+        }
+    }
+
+    /**
+     * Do the waiting operation for as many waiters as it succeeds for, &
+     * resume them. Only one thread serves a list at a time: the others bump
+     * the wake count, & the serving thread goes round again for them, so no
+     * wake is lost while it's busy.
+     *
+     * @param self The waiter the serving thread is linking in, if any. It's
+     * never resumed from here, since it hasn't suspended yet.
+     * @param try_operation Does the operation for a waiter, & wakes the
+     * other side if it succeeded.
+     * @returns Whether self was served.
+     */
+    bool serve(async_waiter_list& list, async_waiter* const self,
+        bool (async_mpmc_queue::*try_operation)(async_waiter&))
+    {
+        if (list.wake_count.fetch_add(1, std::memory_order_acq_rel) != 0)
+        {
+            return false;
+        }
+
+        uint32_t wake_count = 1;
+        bool is_self_served = false;
+
+        while(true)
+        {
+            async_waiter* waiter;
+
+            // A waiter whose operation fails stays at the front, so it's
+            // still the first served next time.
+            while ((waiter = list.front()) != nullptr && (this->*try_operation)(*waiter))
+            {
+                list.pop_front(*waiter);
+
+                if (waiter == self)
+                {
+                    is_self_served = true;
+                }
+                else
+                {
+                    waiter->resume();
+                }
+            }
+
+            const uint32_t remaining_count = list.wake_count.fetch_sub(wake_count,
+                std::memory_order_acq_rel) - wake_count;
+
+            if (remaining_count == 0)
+            {
+                return is_self_served;
+            }
+
+            wake_count = remaining_count;
+        }
+    }
+
+    queue_type queue_;
+    async_waiter_list consumers_;
+    async_waiter_list producers_;
+
+private:
+    async_mpmc_queue(const async_mpmc_queue&) = delete;
+    async_mpmc_queue& operator=(const async_mpmc_queue&) = delete;
+};
+
+#endif
@@ -0,0 +1,452 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Bounded Broadcast MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef BROADCAST_MPMC_QUEUE_H
+#define BROADCAST_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#include <initializer_list>
+
+/**
+ * A bounded multicast ring, as in the LMAX Disruptor. Every subscriber has
+ * its own sequence & sees every element, so one push fans out to all of them
+ * without copying the element into a queue per subscriber.
+ *
+ * Producers claim tickets with a CAS as in the ring queues, and publish a
+ * node by storing ticket + 1 into its sequence. Reading is not destructive:
+ * a subscriber reads the nodes in place & then moves its own sequence on.
+ * A producer may only overwrite a node once every subscriber has moved past
+ * the element from the previous lap, so producers are gated on the slowest
+ * subscriber.
+ *
+ * A subscriber can depend on other subscribers, and then only sees an
+ * element once they have all moved past it (e.g. a business logic stage that
+ * waits for the journaller & the replicator). Only the subscribers that
+ * nothing depends on gate the producers, since the rest are always ahead.
+ *
+ * Subscribe every consumer before the first push; subscribing isn't thread
+ * safe. Each subscriber must only be read from by one thread at a time.
+ * @cite https://lmax-exchange.github.io/disruptor/disruptor.html
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename allocator = mpmc_aligned_allocator>
+class broadcast_mpmc_queue final
+{
+    typedef mpmc_detail::circular_buffer_data<T, slot_layout, allocator> circular_buffer_data;
+    typedef typename circular_buffer_data::buffer_node buffer_node;
+    typedef mpmc_detail::ticket_type ticket_type;
+    typedef mpmc_detail::ticket_difference ticket_difference;
+
+    /**
+     * The state of one subscriber. The sequence is the next ticket it will
+     * read, and is read by the producers & by the subscribers that depend on
+     * this one. The dependency mask never changes once subscribed.
+     */
+    struct alignas(CACHE_LINE_SIZE) subscriber_slot
+    {
+        std::atomic<ticket_type> sequence;
+        uint64_t dependency_mask;
+    };
+
+public:
+    // Subscribers are tracked in 64 bit masks.
+    static constexpr uint_fast32_t max_subscriber_count = 64;
+
+    /**
+     * A handle to one subscriber of the queue. Handles are cheap to copy,
+     * the subscriber's state lives in the queue.
+     */
+    class subscriber
+    {
+    public:
+        /**
+         * Copy the next element out, and move past it.
+         *
+         * @param out_data Reference to the variable that will store the element.
+         * @returns Returns false if there is nothing new to read yet.
+         */
+        bool try_read(T& out_data) const
+        {
+            return poll([&out_data](const T& data)
+            {
+                out_data = data;
+            }, 1) == 1;
+        }
+
+        /**
+         * Hand every element that is ready to handler in place, up to
+         * max_count of them, then move past the whole run with a single store.
+         * Producers can't overwrite the run until handler returns.
+         *
+         * @param handler Called with a const T& for each element, in order.
+         * @param max_count The most elements to hand over.
+         * @returns The number of elements handed over.
+         */
+        template <typename handler_type>
+        size_t poll(handler_type&& handler, const size_t max_count = SIZE_MAX) const
+        {
+            return queue_->poll(index_, handler, max_count);
+        }
+
+        /**
+         * @returns How many published elements this subscriber hasn't read yet.
+         */
+        size_t backlog() const
+        {
+            return queue_->backlog(index_);
+        }
+
+    private:
+        friend class broadcast_mpmc_queue;
+
+        subscriber(broadcast_mpmc_queue* const queue, const uint_fast32_t index)
+            : queue_(queue),
+            index_(index)
+        {
+        }
+
+        broadcast_mpmc_queue* queue_;
+        uint_fast32_t index_;
+    };
+
+    /**
+     * @param requested_size The capacity, rounded up to the next power of two.
+     * Throws std::length_error above 2^31.
+     * @param in_allocator The allocator that provides the buffer.
+     */
+    explicit broadcast_mpmc_queue(const uint_least32_t requested_size,
+        const allocator& in_allocator = allocator())
+        : producer_ticket_(0),
+        cached_gate_ticket_(0),
+        subscriber_count_(0),
+        gating_mask_(0),
+        circular_buffer_data_(requested_size, in_allocator)
+    {
+    }
+
+    ~broadcast_mpmc_queue()
+    {
+        // Nothing can be in flight any more, so the last lap of the buffer
+        // holds constructed elements.
+        const ticket_type end_ticket = producer_ticket_.load(std::memory_order_acquire);
+        const ticket_type begin_ticket = end_ticket > capacity() ? end_ticket - capacity() : 0;
+
+        for (ticket_type ticket = begin_ticket; ticket != end_ticket; ++ticket)
+        {
+            get_node(ticket).data().~T();
+        }
+    }
+
+    /**
+     * Add a subscriber, which sees every element pushed from now on once all
+     * of its dependencies have moved past it.
+     * Throws std::length_error past max_subscriber_count subscribers, and
+     * std::invalid_argument if a dependency belongs to another queue.
+     *
+     * @param dependencies The subscribers this one waits for.
+     * @returns The handle to read through.
+     */
+    subscriber subscribe(const std::initializer_list<subscriber> dependencies = {})
+    {
+        if (subscriber_count_ == max_subscriber_count)
+        {
+            throw std::length_error("Can't have more than 64 subscribers!");
+        }
+
+        const uint_fast32_t index = subscriber_count_;
+        subscriber_slot& slot = subscribers_[index];
+        uint64_t dependency_mask = 0;
+
+        for (const subscriber& dependency : dependencies)
+        {
+            if (dependency.queue_ != this)
+            {
+                throw std::invalid_argument("A dependency must subscribe to the same queue!");
+            }
+
+            dependency_mask |= uint64_t{1} << dependency.index_;
+        }
+
+        slot.sequence.store(producer_ticket_.load(std::memory_order_acquire),
+            std::memory_order_relaxed);
+        slot.dependency_mask = dependency_mask;
+
+        // The dependencies are always ahead of this subscriber now, so only
+        // this one has to gate the producers.
+        gating_mask_.store((gating_mask_.load(std::memory_order_relaxed) & ~dependency_mask) |
+            (uint64_t{1} << index), std::memory_order_release);
+        ++subscriber_count_;
+
+        return subscriber(this, index);
+    }
+
+    /**
+     * Push an element to every subscriber.
+     *
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if the slowest subscriber is a lap behind.
+     */
+    bool push(const T& in_data)
+    {
+        return try_emplace(in_data);
+    }
+
+    /**
+     * Push an element to every subscriber by moving it into the node.
+     *
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if the slowest subscriber is a lap behind.
+     */
+    bool push(T&& in_data)
+    {
+        return try_emplace(std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place at the back of the queue.
+     * If constructing T from args could throw, the element is constructed
+     * before a ticket is claimed and then moved into the node, since a
+     * claimed ticket can't be given back.
+     *
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if the slowest subscriber is a lap behind.
+     */
+    template <typename... Args>
+    bool try_emplace(Args&&... args)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value,
+            "T must be nothrow move constructible!");
+
+        return emplace_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T, Args&&...>::value>{},
+            std::forward<Args>(args)...);
+    }
+
+    uint_fast32_t capacity() const
+    {
+        return circular_buffer_data_.index_mask + 1;
+    }
+
+private:
+    template <typename... Args>
+    bool emplace_with(std::true_type /* nothrow */, Args&&... args)
+    {
+        ticket_type ticket = 0;
+        buffer_node* const node = claim_producer_node(ticket);
+
+        if (node == nullptr)
+        {
+            return false;
+        }
+
+        node->set_data(std::forward<Args>(args)...);
+        node->sequence.store(ticket + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    template <typename... Args>
+    bool emplace_with(std::false_type /* nothrow */, Args&&... args)
+    {
+        T element(std::forward<Args>(args)...);
+
+        return emplace_with(std::true_type{}, std::move(element));
+    }
+
+    /**
+     * Claim the next ticket, once the gating subscribers have all moved
+     * past the element the node held on the previous lap, and destroy that
+     * element.
+     * @returns The node, or nullptr if the slowest subscriber is a lap behind.
+     */
+    buffer_node* claim_producer_node(ticket_type& out_ticket)
+    {
+        backoff_policy backoff;
+        ticket_type ticket = producer_ticket_.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            // The cached gate is stored & loaded with release/acquire, so a
+            // producer that trusts another's refresh still synchronizes with
+            // the subscribers that moved past the old elements.
+            if (static_cast<ticket_difference>(ticket -
+                cached_gate_ticket_.load(std::memory_order_acquire)) >=
+                static_cast<ticket_difference>(capacity()))
+            {
+                const ticket_type gate_ticket = get_gate_ticket(ticket);
+                cached_gate_ticket_.store(gate_ticket, std::memory_order_release);
+
+                if (static_cast<ticket_difference>(ticket - gate_ticket) >=
+                    static_cast<ticket_difference>(capacity()))
+                {
+                    return nullptr;
+                }
+            }
+
+            if (producer_ticket_.compare_exchange_weak(ticket, ticket + 1,
+                std::memory_order_relaxed, std::memory_order_relaxed))
+            {
+                break;
+            }
+
+            backoff();
+        }
+
+        buffer_node& node = get_node(ticket);
+
+        if (ticket >= capacity())
+        {
+            // The gate only covers subscribed elements. Without subscribers
+            // the producer of the previous lap might still be writing.
+            const ticket_type previous_sequence = ticket - capacity() + 1;
+
+            while (node.sequence.load(std::memory_order_acquire) != previous_sequence)
+            {
+                backoff();
+            }
+
+            node.data().~T();
+        }
+
+        out_ticket = ticket;
+        return &node;
+    }
+
+    /**
+     * @returns The sequence of the slowest gating subscriber, or ticket
+     * itself if nothing is subscribed.
+     */
+    ticket_type get_gate_ticket(const ticket_type ticket) const
+    {
+        uint64_t gating_mask = gating_mask_.load(std::memory_order_acquire);
+        ticket_type gate_ticket = ticket;
+
+        while (gating_mask != 0)
+        {
+            const uint_fast32_t index = lowest_bit(gating_mask);
+            const ticket_type sequence = subscribers_[index].sequence.load(
+                std::memory_order_acquire);
+
+            if (static_cast<ticket_difference>(sequence - gate_ticket) < 0)
+            {
+                gate_ticket = sequence;
+            }
+
+            gating_mask &= gating_mask - 1;
+        }
+
+        return gate_ticket;
+    }
+
+    /**
+     * Find the run of elements the subscriber may read, hand it over, then
+     * move the subscriber's sequence past it.
+     */
+    template <typename handler_type>
+    size_t poll(const uint_fast32_t index, handler_type& handler, const size_t max_count)
+    {
+        subscriber_slot& slot = subscribers_[index];
+        const ticket_type sequence = slot.sequence.load(std::memory_order_relaxed);
+        const size_t ready_count = get_ready_count(slot, sequence, max_count);
+
+        for (size_t i = 0; i < ready_count; ++i)
+        {
+            handler(static_cast<const T&>(get_node(sequence + i).data()));
+        }
+
+        if (ready_count > 0)
+        {
+            slot.sequence.store(sequence + ready_count, std::memory_order_release);
+        }
+
+        return ready_count;
+    }
+
+    /**
+     * A subscriber with dependencies may read up to the slowest of them,
+     * since they only move past published elements. Any other subscriber
+     * walks the node sequences, since producers publish out of order.
+     */
+    size_t get_ready_count(const subscriber_slot& slot, const ticket_type sequence,
+        const size_t max_count)
+    {
+        if (slot.dependency_mask != 0)
+        {
+            uint64_t dependency_mask = slot.dependency_mask;
+            size_t ready_count = max_count;
+
+            while (dependency_mask != 0)
+            {
+                const ticket_type dependency_sequence = subscribers_[
+                    lowest_bit(dependency_mask)].sequence.load(std::memory_order_acquire);
+                const size_t dependency_count = static_cast<size_t>(
+                    dependency_sequence - sequence);
+
+                ready_count = dependency_count < ready_count ? dependency_count : ready_count;
+                dependency_mask &= dependency_mask - 1;
+            }
+
+            return ready_count;
+        }
+
+        size_t ready_count = 0;
+
+        while (ready_count < max_count && get_node(sequence + ready_count).sequence.load(
+            std::memory_order_acquire) == sequence + ready_count + 1)
+        {
+            ++ready_count;
+        }
+
+        return ready_count;
+    }
+
+    size_t backlog(const uint_fast32_t index) const
+    {
+        const ticket_type sequence = subscribers_[index].sequence.load(std::memory_order_acquire);
+        const ticket_type producer_ticket = producer_ticket_.load(std::memory_order_acquire);
+
+        return static_cast<ticket_difference>(producer_ticket - sequence) > 0 ?
+            static_cast<size_t>(producer_ticket - sequence) : 0;
+    }
+
+    buffer_node& get_node(const ticket_type ticket)
+    {
+        return circular_buffer_data_.get_node(ticket);
+    }
+
+    static uint_fast32_t lowest_bit(const uint64_t mask)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<uint_fast32_t>(__builtin_ctzll(mask));
+#else
+        uint_fast32_t index = 0;
+
+        while ((mask & (uint64_t{1} << index)) == 0)
+        {
+            ++index;
+        }
+
+        return index;
+#endif
+    }
+
+    // The producer ticket & the cached gate are only touched by producers.
+    alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> producer_ticket_;
+    std::atomic<ticket_type> cached_gate_ticket_;
+    // Only written while subscribing, before the first push.
+    alignas(CACHE_LINE_SIZE) uint_fast32_t subscriber_count_;
+    std::atomic<uint64_t> gating_mask_;
+    subscriber_slot subscribers_[max_subscriber_count];
+    circular_buffer_data circular_buffer_data_;
+
+private:
+    broadcast_mpmc_queue(const broadcast_mpmc_queue&) = delete;
+    broadcast_mpmc_queue& operator=(const broadcast_mpmc_queue&) = delete;
+};
+
+#endif
@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Conflating (Keyed Last Value) MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef CONFLATING_MPMC_QUEUE_H
+#define CONFLATING_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#include <functional>
+
+/**
+ * A queue that keeps only the latest value per key, for market data & other
+ * snapshots where consumers only care about the newest update. A push for a
+ * key that is already waiting overwrites its value in place instead of
+ * queueing another element, so under a burst the consumers do work in the
+ * number of distinct keys rather than the number of updates.
+ *
+ * Keys live in a lock-free open addressing table of twice key_capacity
+ * entries, found by linear probing from the user's hash. Each entry holds
+ * its key's latest value under a seqlock, and a pending flag saying whether
+ * its index is queued in a ring of the same kind the queues use. A producer
+ * writes the value, then sets the flag, and queues the index only if the flag
+ * was clear. A consumer pops an index, clears the flag, then reads the value,
+ * so an update that lands after the read is always queued again, and the
+ * last update to every key is always popped.
+ *
+ * Keys are never removed, so key_capacity bounds the number of distinct keys
+ * ever pushed. Values are copied in & out as raw words, so T must be
+ * trivially copyable. Values for one key may be popped out of order by
+ * different consumers, and the same value may be popped twice.
+ */
+template <typename key_type, typename T, uint_least32_t key_capacity,
+    typename hash_type = std::hash<key_type>,
+    typename key_equal = std::equal_to<key_type>,
+    typename slot_layout = mpmc_cache_line_layout>
+class conflating_mpmc_queue final
+{
+    static_assert(key_capacity > 0, "Can't have a key capacity <= 0!");
+    static_assert(key_capacity <= 0x40000000U, "Can't have a key capacity above 2^30!");
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Values are copied under a seqlock, so T must be trivially copyable!");
+    static_assert(std::is_nothrow_copy_constructible<key_type>::value,
+        "The key type must be nothrow copy constructible!");
+
+    // Kept at most half full, so probes stay short.
+    static constexpr uint_least32_t table_size =
+        mpmc_remapped_layout::get_next_power_of_two(2 * key_capacity);
+    static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    enum key_state : uint32_t
+    {
+        empty,
+        // A producer is copying the key in.
+        inserting,
+        ready
+    };
+
+    struct entry_fields
+    {
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> pending;
+        std::atomic<uint64_t> version;
+        typename std::aligned_storage<sizeof(key_type), alignof(key_type)>::type key;
+        std::atomic<uint64_t> words[word_count];
+    };
+
+    typedef typename slot_layout::template node_rules<sizeof(entry_fields),
+        alignof(entry_fields)> entry_rules;
+
+    struct alignas(entry_rules::alignment) entry : entry_fields
+    {
+    };
+
+    // Every entry is queued at most once, so the ring never fills.
+    typedef bounded_circular_mpmc_queue<uint_least32_t, table_size> index_queue;
+
+public:
+    conflating_mpmc_queue()
+        : entries_(static_cast<entry*>(entry_allocator_.allocate(
+            table_size * sizeof(entry), alignof(entry)))),
+        key_count_(0)
+    {
+        for (uint_least32_t i = 0; i < table_size; ++i)
+        {
+            entry* const slot = new (&entries_[i]) entry;
+
+            slot->state.store(empty, std::memory_order_relaxed);
+            slot->pending.store(0, std::memory_order_relaxed);
+            slot->version.store(0, std::memory_order_relaxed);
+
+            for (std::atomic<uint64_t>& word : slot->words)
+            {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ~conflating_mpmc_queue()
+    {
+        for (uint_least32_t i = 0; i < table_size; ++i)
+        {
+            if (entries_[i].state.load(std::memory_order_relaxed) == ready)
+            {
+                get_key(entries_[i]).~key_type();
+            }
+        }
+
+        entry_allocator_.deallocate(entries_, table_size * sizeof(entry));
+    }
+
+    /**
+     * Set the latest value of a key, queueing the key only if it isn't
+     * already waiting to be popped.
+     *
+     * @param key The key, copied into the table the first time it's pushed.
+     * @param in_data The value, which replaces any value still waiting.
+     * @returns Returns false only if the key is new & the table already
+     * holds key_capacity keys, counting any other new keys being inserted.
+     */
+    bool push(const key_type& key, const T& in_data)
+    {
+        entry* const slot = find_or_insert(key);
+
+        if (slot == nullptr)
+        {
+            return false;
+        }
+
+        write_value(*slot, in_data);
+
+        // Pairs with the exchange in pop: if the flag was still set, the
+        // consumer that clears it reads this value.
+        if (slot->pending.exchange(1, std::memory_order_acq_rel) == 0)
+        {
+            const uint_least32_t index = static_cast<uint_least32_t>(slot - entries_);
+
+            // Can only fail while a consumer is still releasing the node it
+            // popped, since every index is queued at most once.
+            while (!pending_indices_.push(index))
+            {
+                HARDWARE_PAUSE();
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Pop the next key that has an update, along with its latest value.
+     *
+     * @param out_key Reference to the variable that will store the key.
+     * @param out_data Reference to the variable that will store the latest value.
+     * @returns Returns false if no key is waiting.
+     */
+    bool pop(key_type& out_key, T& out_data)
+    {
+        uint_least32_t index;
+
+        if (!pending_indices_.pop(index))
+        {
+            return false;
+        }
+
+        entry& slot = entries_[index];
+
+        // Cleared before the read, so any later update queues the key again.
+        slot.pending.exchange(0, std::memory_order_acq_rel);
+
+        out_key = get_key(slot);
+        read_value(slot, out_data);
+        return true;
+    }
+
+    /**
+     * @returns Roughly how many keys are waiting, read from the ticket hints.
+     */
+    size_t size_approx() const
+    {
+        return pending_indices_.size_approx();
+    }
+
+    constexpr uint_least32_t capacity() const
+    {
+        return key_capacity;
+    }
+
+private:
+    static key_type& get_key(entry& slot)
+    {
+        return *reinterpret_cast<key_type*>(&slot.key);
+    }
+
+    /**
+     * Find the entry of a key by linear probing, claiming an empty one if
+     * the key isn't there yet.
+     * @returns The entry, or nullptr if the key is new & the table is full.
+     */
+    entry* find_or_insert(const key_type& key)
+    {
+        const uint_least32_t first_index =
+            static_cast<uint_least32_t>(hash_type()(key)) & (table_size - 1);
+
+        for (uint_least32_t probe = 0; probe < table_size; ++probe)
+        {
+            entry& slot = entries_[(first_index + probe) & (table_size - 1)];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+
+            if (state == empty)
+            {
+                if (key_count_.fetch_add(1, std::memory_order_relaxed) >= key_capacity)
+                {
+                    key_count_.fetch_sub(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+
+                if (slot.state.compare_exchange_strong(state, inserting,
+                    std::memory_order_acquire, std::memory_order_acquire))
+                {
+                    new (&slot.key) key_type(key);
+                    slot.state.store(ready, std::memory_order_release);
+                    return &slot;
+                }
+
+                // Another producer took this entry first, maybe for this key.
+                key_count_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            while (state == inserting)
+            {
+                HARDWARE_PAUSE();
+                state = slot.state.load(std::memory_order_acquire);
+            }
+
+            if (key_equal()(get_key(slot), key))
+            {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Write a value under the entry's seqlock. Producers of the same key take
+     * turns, each holding the version odd for the length of one copy.
+     */
+    static void write_value(entry& slot, const T& in_data)
+    {
+        uint64_t version = slot.version.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            if ((version & 1) != 0)
+            {
+                HARDWARE_PAUSE();
+                version = slot.version.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (slot.version.compare_exchange_weak(version, version + 1,
+                std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        // Orders the odd version before the words, for the readers' recheck.
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint64_t words[word_count] = {};
+        std::memcpy(words, &in_data, sizeof(T));
+
+        for (size_t i = 0; i < word_count; ++i)
+        {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        slot.version.store(version + 2, std::memory_order_release);
+    }
+
+    /**
+     * Read a value under the entry's seqlock, retrying while a producer
+     * is writing it.
+     */
+    static void read_value(const entry& slot, T& out_data)
+    {
+        uint64_t words[word_count];
+
+        while(true)
+        {
+            const uint64_t version = slot.version.load(std::memory_order_acquire);
+
+            if ((version & 1) != 0)
+            {
+                HARDWARE_PAUSE();
+                continue;
+            }
+
+            for (size_t i = 0; i < word_count; ++i)
+            {
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (slot.version.load(std::memory_order_relaxed) == version)
+            {
+                break;
+            }
+        }
+
+        std::memcpy(&out_data, words, sizeof(T));
+    }
+
+    mpmc_aligned_allocator entry_allocator_;
+    entry* entries_;
+    // Only touched when a new key is inserted.
+    alignas(CACHE_LINE_SIZE) std::atomic<uint_least32_t> key_count_;
+    index_queue pending_indices_;
+
+private:
+    conflating_mpmc_queue(const conflating_mpmc_queue&) = delete;
+    conflating_mpmc_queue& operator=(const conflating_mpmc_queue&) = delete;
+};
+
+#endif
@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Lossy Overwriting MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef LOSSY_MPMC_QUEUE_H
+#define LOSSY_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+/**
+ * A ring that drops its oldest elements instead of failing when it's full,
+ * for telemetry & other streams where fresh data beats old data. A push
+ * never fails & never waits for the consumers.
+ *
+ * A producer takes a ticket with a fetch_add. If that ticket is a whole lap
+ * ahead of the consumers, it first moves the consumer ticket past the element
+ * it is about to overwrite, and counts the elements skipped that way. Each
+ * slot is written under a seqlock, its sequence holding 2 * ticket + 1 while
+ * the element is being written & 2 * ticket + 2 once it's done. A consumer
+ * copies the element out, then checks the sequence again, so it never
+ * returns an element torn by a producer that overwrote it mid-copy. It only
+ * keeps the element if it can then move the consumer ticket on from its
+ * ticket, so every ticket is either popped once or counted as overwritten.
+ *
+ * Elements are copied in & out as raw words, so T must be trivially copyable.
+ * The only wait is a producer finding the previous lap's producer still
+ * writing the same slot, which lasts as long as one copy of T.
+ */
+template <typename T, typename slot_layout = mpmc_cache_line_layout,
+    typename allocator = mpmc_aligned_allocator>
+class lossy_mpmc_queue final
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Elements are copied under a seqlock, so T must be trivially copyable!");
+
+    typedef mpmc_detail::ticket_type ticket_type;
+    typedef mpmc_detail::ticket_difference ticket_difference;
+
+    // The element is kept as atomic words, so a copy racing with an
+    // overwrite is torn but never undefined.
+    static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    typedef typename slot_layout::template node_rules<
+        sizeof(uint64_t) * (word_count + 1), alignof(uint64_t)> slot_rules;
+
+    struct alignas(slot_rules::alignment) slot
+    {
+        std::atomic<ticket_type> sequence;
+        std::atomic<uint64_t> words[word_count];
+    };
+
+public:
+    /**
+     * @param requested_size The capacity, rounded up to the next power of two.
+     * Throws std::length_error above 2^31.
+     * @param in_allocator The allocator that provides the slots.
+     */
+    explicit lossy_mpmc_queue(const uint_least32_t requested_size,
+        const allocator& in_allocator = allocator())
+        : producer_ticket_(0),
+        consumer_ticket_(0),
+        overwritten_count_(0),
+        index_mask_(get_next_power_of_two(requested_size) - 1),
+        slot_allocator_(in_allocator),
+        slots_(static_cast<slot*>(slot_allocator_.allocate(
+            capacity() * sizeof(slot), alignof(slot))))
+    {
+        for (uint_least32_t i = 0; i < capacity(); ++i)
+        {
+            new (&slots_[i]) slot;
+            slots_[i].sequence.store(0, std::memory_order_relaxed);
+
+            for (std::atomic<uint64_t>& word : slots_[i].words)
+            {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ~lossy_mpmc_queue()
+    {
+        slot_allocator_.deallocate(slots_, capacity() * sizeof(slot));
+    }
+
+    /**
+     * Push an element, overwriting the oldest unread one if the ring is full.
+     *
+     * @param in_data Reference to the variable containg the data to be pushed.
+     */
+    void push(const T& in_data)
+    {
+        const ticket_type ticket = producer_ticket_.fetch_add(1, std::memory_order_relaxed);
+
+        if (ticket >= capacity())
+        {
+            skip_to(ticket - index_mask_);
+        }
+
+        slot& node = slots_[ticket & index_mask_];
+        const ticket_type writing_sequence = 2 * ticket + 1;
+        ticket_type sequence = node.sequence.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            if (static_cast<ticket_difference>(sequence - writing_sequence) >= 0)
+            {
+                // A producer a lap ahead already took the slot, and moved
+                // the consumers past this ticket before doing so.
+                return;
+            }
+
+            if ((sequence & 1) != 0)
+            {
+                // The previous lap's producer is still writing.
+                HARDWARE_PAUSE();
+                sequence = node.sequence.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            // Releases the move of the consumer ticket, so a consumer that
+            // sees this slot taken also sees the ticket it has to move on to.
+            if (node.sequence.compare_exchange_weak(sequence, writing_sequence,
+                std::memory_order_release, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        // Orders the odd sequence before the words, for the consumers' recheck.
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint64_t words[word_count] = {};
+        std::memcpy(words, &in_data, sizeof(T));
+
+        for (size_t i = 0; i < word_count; ++i)
+        {
+            node.words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        node.sequence.store(writing_sequence + 1, std::memory_order_release);
+    }
+
+    /**
+     * Pop the oldest element that hasn't been overwritten.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false if nothing is ready, including when the oldest
+     * element's producer hasn't finished writing it yet.
+     */
+    bool pop(T& out_data)
+    {
+        ticket_type ticket;
+
+        return pop(out_data, ticket);
+    }
+
+    /**
+     * Pop the oldest element that hasn't been overwritten, along with its
+     * ticket. A lone consumer sees a gap in the tickets wherever elements
+     * were overwritten before it got to them.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @param out_ticket The position of the element in the stream.
+     * @returns Returns false if nothing is ready.
+     */
+    bool pop(T& out_data, ticket_type& out_ticket)
+    {
+        ticket_type ticket = consumer_ticket_.load(std::memory_order_acquire);
+
+        while(true)
+        {
+            const slot& node = slots_[ticket & index_mask_];
+            const ticket_type written_sequence = 2 * ticket + 2;
+            const ticket_type sequence = node.sequence.load(std::memory_order_acquire);
+
+            if (sequence != written_sequence)
+            {
+                if (static_cast<ticket_difference>(sequence - written_sequence) < 0)
+                {
+                    // Not written yet, or still being written.
+                    return false;
+                }
+
+                // Overwritten by a producer a lap ahead, which moved the
+                // consumer ticket on before taking the slot.
+                ticket = consumer_ticket_.load(std::memory_order_acquire);
+                continue;
+            }
+
+            uint64_t words[word_count];
+
+            for (size_t i = 0; i < word_count; ++i)
+            {
+                words[i] = node.words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (node.sequence.load(std::memory_order_relaxed) != written_sequence)
+            {
+                ticket = consumer_ticket_.load(std::memory_order_acquire);
+                continue;
+            }
+
+            // A producer about to overwrite this slot moves the consumer
+            // ticket first, so winning this means the copy is still current.
+            if (consumer_ticket_.compare_exchange_weak(ticket, ticket + 1,
+                std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                std::memcpy(&out_data, words, sizeof(T));
+                out_ticket = ticket;
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @returns How many elements were overwritten before being popped.
+     */
+    uint64_t overwritten_count() const
+    {
+        return overwritten_count_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @returns Roughly how many elements are waiting, at most the capacity.
+     */
+    size_t size_approx() const
+    {
+        const ticket_type consumer_ticket = consumer_ticket_.load(std::memory_order_relaxed);
+        const ticket_type producer_ticket = producer_ticket_.load(std::memory_order_relaxed);
+        const ticket_difference size = static_cast<ticket_difference>(
+            producer_ticket - consumer_ticket);
+
+        return size <= 0 ? 0 : size > static_cast<ticket_difference>(capacity()) ?
+            capacity() : static_cast<size_t>(size);
+    }
+
+    uint_least32_t capacity() const
+    {
+        return index_mask_ + 1;
+    }
+
+private:
+    /**
+     * Move the consumer ticket on to at least first_ticket, counting the
+     * elements it skips.
+     */
+    void skip_to(const ticket_type first_ticket)
+    {
+        ticket_type ticket = consumer_ticket_.load(std::memory_order_relaxed);
+
+        while (static_cast<ticket_difference>(first_ticket - ticket) > 0)
+        {
+            if (consumer_ticket_.compare_exchange_weak(ticket, first_ticket,
+                std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                overwritten_count_.fetch_add(first_ticket - ticket, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    static uint_least32_t get_next_power_of_two(const uint_least32_t requested_size)
+    {
+        if (requested_size > 0x80000000U)
+        {
+            throw std::length_error("Can't have a queue length above 2^31!");
+        }
+
+        uint_least32_t power = 1;
+
+        while (power < requested_size)
+        {
+            power <<= 1;
+        }
+
+        return power;
+    }
+
+    alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> producer_ticket_;
+    // Written by the consumers, and by producers only when the ring is full.
+    alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> consumer_ticket_;
+    std::atomic<uint64_t> overwritten_count_;
+    alignas(CACHE_LINE_SIZE) const uint_least32_t index_mask_;
+    allocator slot_allocator_;
+    slot* slots_;
+
+private:
+    lossy_mpmc_queue(const lossy_mpmc_queue&) = delete;
+    lossy_mpmc_queue& operator=(const lossy_mpmc_queue&) = delete;
+};
+
+#endif
@@ -1,6 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /**
- * C++14 32bit Lockless Bounded Circular MPMC Queue type.
+ * C++14 Lockless Bounded Circular MPMC Queue types, with 64 bit tickets.
  * Author: Primrose Taylor
  */
 
@@ -11,333 +11,3780 @@
 #include "stdlib.h"
 
 #include <atomic>
+#include <chrono>
+#include <cstring>
 #include <stdint.h>
-#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <thread>
 
+#if defined(_WIN32)
+    #include <malloc.h>
+    #include <windows.h>
+    #pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+    #include <linux/futex.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <time.h>
+    #include <unistd.h>
+#endif
+
 #define CACHE_LINE_SIZE     64U
 
-#if defined(_MSC_VER)
-    #define HARDWARE_PAUSE()                _mm_pause();
-    #define _ENABLE_ATOMIC_ALIGNMENT_FIX    1 // MSVC atomic alignment fix.
-    #define ATOMIC_ALIGNMENT                4
-#else
-    #define ATOMIC_ALIGNMENT                16
-    #if defined(__clang__) || defined(__GNUC__)
-        #define HARDWARE_PAUSE()            __builtin_ia32_pause();
-    #endif
-#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #if defined(_M_ARM64) || defined(_M_ARM)
+        #define HARDWARE_PAUSE()            __yield();
+    #else
+        #define HARDWARE_PAUSE()            _mm_pause();
+    #endif
+    #define _ENABLE_ATOMIC_ALIGNMENT_FIX    1 // MSVC atomic alignment fix.
+    #define ATOMIC_ALIGNMENT                4
+#else
+    #define ATOMIC_ALIGNMENT                16
+    #if defined(__x86_64__) || defined(__i386__)
+        #define HARDWARE_PAUSE()            __builtin_ia32_pause();
+    #elif defined(__aarch64__) || defined(__arm__)
+        // wfe would need a monitored load to be woken by, without one it can
+        // sleep until the next event stream tick, so yield is used instead.
+        #define HARDWARE_PAUSE()            __asm__ __volatile__("yield" ::: "memory");
+    #elif defined(__powerpc__) || defined(__powerpc64__)
+        #define HARDWARE_PAUSE()            __asm__ __volatile__("or 27,27,27" ::: "memory");
+    #else
+        #define HARDWARE_PAUSE()            std::atomic_signal_fence(std::memory_order_seq_cst);
+    #endif
+#endif
+
+// Hints that a node is about to be read or written, to pull its cache line in early.
+#if defined(_MSC_VER)
+    #if defined(_M_ARM64) || defined(_M_ARM)
+        #define PREFETCH_READ(address)      __prefetch(address);
+        #define PREFETCH_WRITE(address)     __prefetch(address);
+    #else
+        #define PREFETCH_READ(address)      _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0);
+        #define PREFETCH_WRITE(address)     _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0);
+    #endif
+#else
+    #define PREFETCH_READ(address)          __builtin_prefetch(address, 0, 3);
+    #define PREFETCH_WRITE(address)         __builtin_prefetch(address, 1, 3);
+#endif
+
+// Whether a 16 byte compare & swap is lock-free on this target: cmpxchg16b on
+// x86-64 (with -mcx16 on GCC & Clang), and casp or ldaxp/stlxp on AArch64.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    #define MPMC_HAS_DOUBLE_WIDTH_CAS       1
+#elif defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+    #define MPMC_HAS_DOUBLE_WIDTH_CAS       1
+#else
+    #define MPMC_HAS_DOUBLE_WIDTH_CAS       0
+#endif
+
+/**
+ * Slot layout policies for the queues.
+ * Each policy decides how a buffer node (an element & its sequence word) is
+ * aligned, and whether tickets are remapped onto the nodes. A policy exposes
+ * node_rules<natural size, natural alignment> with the node alignment to use
+ * and whether to remap indices.
+ */
+
+/**
+ * The sequence word sits right next to the data with no padding, so nodes
+ * are as small as possible. Neighbouring tickets may share a cache line.
+ */
+struct mpmc_packed_layout
+{
+    template <size_t natural_size, size_t natural_alignment>
+    struct node_rules
+    {
+        static constexpr size_t alignment = natural_alignment;
+        static constexpr bool remap_index = false;
+    };
+};
+
+/**
+ * Every node gets a cache line (or more) to itself, so no two tickets
+ * ever share a cache line.
+ */
+struct mpmc_cache_line_layout
+{
+    template <size_t natural_size, size_t natural_alignment>
+    struct node_rules
+    {
+        static constexpr size_t alignment = natural_alignment > CACHE_LINE_SIZE ?
+            natural_alignment : CACHE_LINE_SIZE;
+        static constexpr bool remap_index = false;
+    };
+};
+
+/**
+ * Nodes are rounded up to a power of two so a whole number of them fit in a
+ * cache line, and tickets are remapped so that consecutive tickets land on
+ * different cache lines. Tickets only share a cache line with the tickets a
+ * full stride of cache lines away, without padding every node to a cache line.
+ * @cite https://github.com/max0x7ba/atomic_queue
+ */
+struct mpmc_remapped_layout
+{
+    static constexpr size_t get_next_power_of_two(const size_t v)
+    {
+        size_t power = 1;
+
+        while (power < v)
+        {
+            power <<= 1;
+        }
+
+        return power;
+    }
+    
+    template <size_t natural_size, size_t natural_alignment>
+    struct node_rules
+    {
+        static constexpr size_t alignment = natural_size > CACHE_LINE_SIZE ?
+            natural_alignment : get_next_power_of_two(natural_size);
+        static constexpr bool remap_index = natural_size <= CACHE_LINE_SIZE / 2;
+    };
+};
+
+/**
+ * Picks a layout from the size of the packed node. Nodes that are already
+ * bigger than a cache line are packed, since padding them would only waste
+ * space. Smaller nodes are remapped, which falls back to one node per cache
+ * line once two nodes no longer fit in one.
+ */
+struct mpmc_auto_layout
+{
+    template <size_t natural_size, size_t natural_alignment>
+    struct node_rules : std::conditional<natural_size <= CACHE_LINE_SIZE,
+        mpmc_remapped_layout, mpmc_packed_layout>::type::template
+            node_rules<natural_size, natural_alignment>
+    {
+    };
+};
+
+/**
+ * Backoff policies for the queues.
+ * A backoff policy is default constructible, and is called once after every
+ * failed attempt to claim a ticket (a lost CAS, or a node that another
+ * thread got to first). A fresh policy object is made for every push/pop,
+ * so it can keep state across the retries of a single operation.
+ */
+
+/**
+ * Retry straight away, for when every thread has a core to itself and
+ * latency matters more than anything else.
+ */
+struct mpmc_busy_spin_backoff
+{
+    void operator()()
+    {
+    }
+};
+
+/**
+ * Pause the core once between retries, which frees up pipeline resources
+ * for a hyper-thread sibling. This is the default.
+ */
+struct mpmc_pause_backoff
+{
+    void operator()()
+    {
+        HARDWARE_PAUSE();
+    }
+};
+
+/**
+ * Yield to the scheduler between retries, for when there are more threads
+ * than cores.
+ */
+struct mpmc_yield_backoff
+{
+    void operator()()
+    {
+        std::this_thread::yield();
+    }
+};
+
+/**
+ * Pause for twice as long after every failed retry, up to max_pause_count
+ * pauses. Under heavy contention this spreads the CAS attempts out.
+ */
+template <uint_least32_t max_pause_count = 64>
+class mpmc_exponential_backoff
+{
+public:
+    mpmc_exponential_backoff()
+        : pause_count(1)
+    {
+    }
+    
+    void operator()()
+    {
+        for (uint_least32_t i = 0; i < pause_count; ++i)
+        {
+            HARDWARE_PAUSE();
+        }
+
+        if (pause_count < max_pause_count)
+        {
+            pause_count <<= 1;
+        }
+    }
+
+private:
+    uint_least32_t pause_count;
+};
+
+/**
+ * Pause for the first pause_attempts retries, then yield for the rest.
+ */
+template <uint_least32_t pause_attempts = 16>
+class mpmc_pause_then_yield_backoff
+{
+public:
+    mpmc_pause_then_yield_backoff()
+        : attempt_count(0)
+    {
+    }
+    
+    void operator()()
+    {
+        if (attempt_count < pause_attempts)
+        {
+            ++attempt_count;
+            HARDWARE_PAUSE();
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    uint_least32_t attempt_count;
+};
+
+/**
+ * Exponential backoff where each retry pauses for a random number of pauses
+ * up to the current limit. Threads that collided once then don't retry in
+ * lockstep, which breaks up CAS convoys.
+ * The random numbers come from a per-thread xorshift generator.
+ */
+template <uint_least32_t max_pause_count = 64>
+class mpmc_jittered_backoff
+{
+public:
+    mpmc_jittered_backoff()
+        : pause_limit(2)
+    {
+    }
+    
+    void operator()()
+    {
+        const uint_least32_t pause_count = 1 + next_random() % pause_limit;
+        
+        for (uint_least32_t i = 0; i < pause_count; ++i)
+        {
+            HARDWARE_PAUSE();
+        }
+
+        if (pause_limit < max_pause_count)
+        {
+            pause_limit <<= 1;
+        }
+    }
+
+private:
+    /**
+     * @cite https://en.wikipedia.org/wiki/Xorshift
+     */
+    static uint32_t next_random()
+    {
+        static thread_local uint32_t state = 0;
+
+        if (state == 0)
+        {
+            // Seed from the address of the state, which differs per thread.
+            state = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&state) >> 4) | 1U;
+        }
+        
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        
+        return state;
+    }
+    
+    uint_least32_t pause_limit;
+};
+
+/**
+ * Concurrency mode policies for the queues.
+ * A side with a single thread claims its tickets with plain loads & stores
+ * instead of a CAS. With a single producer and a single consumer, the node
+ * sequences aren't used at all: each side publishes through its own ticket,
+ * and keeps a cached copy of the opposite ticket.
+ * It's up to the user to make sure a single side really is only ever used
+ * by one thread at a time.
+ */
+template <bool has_multiple_producers, bool has_multiple_consumers>
+struct mpmc_concurrency_mode
+{
+    static constexpr bool multi_producer = has_multiple_producers;
+    static constexpr bool multi_consumer = has_multiple_consumers;
+};
+
+typedef mpmc_concurrency_mode<true, true> mpmc_mode_mpmc;
+typedef mpmc_concurrency_mode<true, false> mpmc_mode_mpsc;
+typedef mpmc_concurrency_mode<false, true> mpmc_mode_spmc;
+typedef mpmc_concurrency_mode<false, false> mpmc_mode_spsc;
+
+/**
+ * Wait policies for the queues, which decide whether a blocking push or pop
+ * may sleep once spinning & yielding hasn't helped.
+ * Without sleeping, there's nobody for the other side to wake, so the
+ * non-blocking pushes & pops skip checking for sleepers, and its seq_cst
+ * fence, entirely.
+ */
+
+/**
+ * Blocking pushes & pops never sleep, they keep yielding until they're done.
+ * This is the default, so pushes & pops pay nothing for the blocking ones.
+ */
+struct mpmc_no_wait
+{
+    static constexpr bool enabled = false;
+};
+
+/**
+ * Blocking pushes & pops sleep on a futex, so they don't burn a core while
+ * they wait. Every push & pop pays a seq_cst fence to check for sleepers.
+ */
+struct mpmc_sleep_wait
+{
+    static constexpr bool enabled = true;
+};
+
+/**
+ * The outcome of the try_ & blocking operations of the queues.
+ * full & empty only come from the non-blocking operations, and timeout only
+ * from the timed ones. closed means the queue was closed: pushes fail
+ * straight away, and pops only once every element has been drained.
+ */
+enum class mpmc_result
+{
+    ok,
+    empty,
+    full,
+    closed,
+    timeout
+};
+
+/**
+ * Buffer allocator policies for the queues.
+ * An allocator is a copyable object with
+ * void* allocate(size_t size, size_t alignment) and
+ * void deallocate(void* memory, size_t size). It returns zeroed or
+ * untouched memory aligned to at least the given alignment, and throws
+ * std::bad_alloc on failure.
+ */
+
+/**
+ * Plain heap allocation aligned to the node alignment.
+ * This replaces calloc, which only aligns to alignof(max_align_t).
+ */
+struct mpmc_aligned_allocator
+{
+    void* allocate(const size_t size, size_t alignment) const
+    {
+        void* memory = nullptr;
+
+        if (alignment < sizeof(void*))
+        {
+            alignment = sizeof(void*);
+        }
+        
+#if defined(_WIN32)
+        memory = _aligned_malloc(size, alignment);
+#else
+        if (posix_memalign(&memory, alignment, size) != 0)
+        {
+            memory = nullptr;
+        }
+#endif
+
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return memory;
+    }
+
+    void deallocate(void* memory, const size_t /* size */) const
+    {
+#if defined(_WIN32)
+        _aligned_free(memory);
+#else
+        free(memory);
+#endif
+    }
+};
+
+namespace mpmc_detail
+{
+
+/**
+ * Map anonymous memory for a buffer, optionally with huge pages and bound to
+ * a NUMA node. mbind is called through syscall so there's no dependency on
+ * libnuma. With huge pages, explicit ones (MAP_HUGETLB) are tried first, and
+ * normal pages with a transparent huge page hint (MADV_HUGEPAGE) are used
+ * when none are reserved. Binding is best effort, the memory is still usable
+ * if it fails, and it happens before the pages are first touched.
+ */
+inline void* map_pages(const size_t size, const bool use_huge_pages, const int numa_node)
+{
+#if defined(__linux__)
+    void* memory = MAP_FAILED;
+
+    if (use_huge_pages)
+    {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        
+    #if defined(MADV_HUGEPAGE)
+        if (use_huge_pages)
+        {
+            madvise(memory, size, MADV_HUGEPAGE);
+        }
+    #endif
+    }
+
+    #if defined(SYS_mbind)
+    if (numa_node >= 0 && numa_node < static_cast<int>(sizeof(unsigned long) * 8))
+    {
+        const unsigned long node_mask = 1UL << numa_node;
+        
+        syscall(SYS_mbind, memory, size, 2 /* MPOL_BIND */, &node_mask,
+            sizeof(node_mask) * 8, 1U << 1 /* MPOL_MF_MOVE */);
+    }
+    #endif
+
+    return memory;
+#else
+    (void)use_huge_pages;
+    (void)numa_node;
+    
+    return mpmc_aligned_allocator().allocate(size, CACHE_LINE_SIZE);
+#endif
+}
+
+inline void unmap_pages(void* memory, const size_t size)
+{
+#if defined(__linux__)
+    munmap(memory, size);
+#else
+    mpmc_aligned_allocator().deallocate(memory, size);
+#endif
+}
+
+/**
+ * Sleep until word no longer holds expected, a wake call is made on word, or
+ * the timeout passes. Spurious wake ups are allowed, so callers always
+ * recheck what they're waiting for.
+ * Uses futex on Linux, WaitOnAddress on Windows, and C++20 atomic::wait
+ * elsewhere when it is available. When none are, or a timed wait is asked
+ * for without futex/WaitOnAddress, it falls back to short sleeps.
+ * 
+ * @param timeout Relative timeout, negative to wait without one.
+ * @param is_process_shared Whether word sits in memory shared with other
+ * processes, which on Linux needs the slower non-private futex.
+ */
+inline void wait_on_address(std::atomic<uint32_t>& word, const uint32_t expected,
+    const std::chrono::nanoseconds timeout, const bool is_process_shared = false)
+{
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+        "Can't wait on the address of an atomic with a different size!");
+    
+#if defined(__linux__)
+    struct timespec relative_timeout;
+    struct timespec* relative_timeout_pointer = nullptr;
+
+    if (timeout.count() >= 0)
+    {
+        relative_timeout.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+        relative_timeout.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        relative_timeout_pointer = &relative_timeout;
+    }
+
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+        is_process_shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+        expected, relative_timeout_pointer, nullptr, 0);
+#elif defined(_WIN32)
+    (void)is_process_shared;
+
+    uint32_t compare_value = expected;
+    const DWORD timeout_milliseconds = timeout.count() < 0 ? INFINITE :
+        static_cast<DWORD>((timeout.count() + 999999) / 1000000);
+    
+    WaitOnAddress(reinterpret_cast<volatile uint32_t*>(&word), &compare_value,
+        sizeof(compare_value), timeout_milliseconds);
+#else
+    (void)is_process_shared;
+
+    #if defined(__cpp_lib_atomic_wait)
+    if (timeout.count() < 0)
+    {
+        word.wait(expected, std::memory_order_acquire);
+        return;
+    }
+    #endif
+
+    const std::chrono::nanoseconds poll_interval = std::chrono::microseconds(50);
+    
+    if (word.load(std::memory_order_acquire) == expected)
+    {
+        std::this_thread::sleep_for(timeout.count() >= 0 && timeout < poll_interval ?
+            timeout : poll_interval);
+    }
+#endif
+}
+
+/**
+ * Wake every thread sleeping in wait_on_address on word.
+ */
+inline void wake_all_on_address(std::atomic<uint32_t>& word, const bool is_process_shared = false)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+        is_process_shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+        0x7fffffff, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+    (void)is_process_shared;
+    WakeByAddressAll(reinterpret_cast<void*>(&word));
+#elif defined(__cpp_lib_atomic_wait)
+    (void)is_process_shared;
+    word.notify_all();
+#else
+    (void)word;
+    (void)is_process_shared;
+#endif
+}
+
+/**
+ * Two 64 bit words updated as one, e.g. a pointer & its tag.
+ */
+struct alignas(16) double_word
+{
+    uint64_t low;
+    uint64_t high;
+};
+
+/**
+ * A double_word behind a lock-free 16 byte compare & swap, for when two
+ * words must change together. std::atomic can't be relied on for this, as
+ * GCC routes 16 byte atomics through libatomic, which may take a lock.
+ * Instantiating it on a target without MPMC_HAS_DOUBLE_WIDTH_CAS fails to
+ * compile, rather than quietly falling back to a lock. It's a template only
+ * so that check fires where it's used, not on every include.
+ */
+template <typename tag_type = void>
+class basic_atomic_double_word
+{
+    // Depends on tag_type, so it's only checked once instantiated.
+    static_assert(MPMC_HAS_DOUBLE_WIDTH_CAS && sizeof(tag_type*) != 0,
+        "This target has no lock-free 16 byte CAS! On x86-64 build with -mcx16.");
+
+public:
+    explicit basic_atomic_double_word(const double_word in_value = double_word{ 0, 0 })
+        : value_(in_value)
+    {
+    }
+
+    /**
+     * Read both words at once. A 16 byte load isn't atomic everywhere, so
+     * this is a compare & swap that only ever writes back what it read.
+     */
+    double_word load() const
+    {
+        double_word expected{ 0, 0 };
+
+        const_cast<basic_atomic_double_word*>(this)->compare_exchange(expected, expected);
+        return expected;
+    }
+
+    /**
+     * Replace both words with desired if they still hold expected. Always
+     * acts as a full barrier.
+     *
+     * @param expected The words to compare with, set to the words found on
+     * failure.
+     * @returns Whether the words were replaced.
+     */
+    bool compare_exchange(double_word& expected, const double_word desired)
+    {
+#if defined(_MSC_VER)
+        return _InterlockedCompareExchange128(reinterpret_cast<volatile __int64*>(&value_),
+            static_cast<__int64>(desired.high), static_cast<__int64>(desired.low),
+            reinterpret_cast<__int64*>(&expected)) != 0;
+#elif MPMC_HAS_DOUBLE_WIDTH_CAS
+        __extension__ typedef unsigned __int128 packed_type;
+
+        packed_type packed_expected;
+        packed_type packed_desired;
+
+        std::memcpy(&packed_expected, &expected, sizeof(packed_type));
+        std::memcpy(&packed_desired, &desired, sizeof(packed_type));
+
+        const packed_type found = __sync_val_compare_and_swap(
+            reinterpret_cast<packed_type*>(&value_), packed_expected, packed_desired);
+
+        if (found == packed_expected)
+        {
+            return true;
+        }
+
+        std::memcpy(&expected, &found, sizeof(packed_type));
+        return false;
+#else
+        (void)expected;
+        (void)desired;
+        return false;
+#endif
+    }
+
+private:
+    double_word value_;
+};
+
+typedef basic_atomic_double_word<> atomic_double_word;
+
+/**
+ * A pointer with a tag that moves on with every successful swap, so a CAS
+ * that saw the pointer before it was popped, freed & pushed back still
+ * fails. The tag is 64 bits, so unlike the 16 bit tags packed into a
+ * pointer's unused bits it never wraps in practice.
+ */
+template <typename T>
+class atomic_tagged_pointer
+{
+public:
+    struct value_type
+    {
+        T* pointer;
+        uint64_t tag;
+    };
+
+    explicit atomic_tagged_pointer(T* const in_pointer = nullptr)
+        : words_(double_word{ reinterpret_cast<uintptr_t>(in_pointer), 0 })
+    {
+    }
+
+    value_type load() const
+    {
+        return unpack(words_.load());
+    }
+
+    /**
+     * Swap in desired if both the pointer & tag still match expected, and
+     * move the tag on.
+     *
+     * @param expected The pointer & tag to compare with, set to the ones
+     * found on failure.
+     * @returns Whether desired was swapped in.
+     */
+    bool compare_exchange(value_type& expected, T* const desired)
+    {
+        double_word expected_words{ reinterpret_cast<uintptr_t>(expected.pointer),
+            expected.tag };
+
+        if (words_.compare_exchange(expected_words,
+            double_word{ reinterpret_cast<uintptr_t>(desired), expected.tag + 1 }))
+        {
+            return true;
+        }
+
+        expected = unpack(expected_words);
+        return false;
+    }
+
+private:
+    static value_type unpack(const double_word words)
+    {
+        return value_type{ reinterpret_cast<T*>(static_cast<uintptr_t>(words.low)), words.high };
+    }
+
+    // Dependent on T, so it's only checked once a tagged pointer is used.
+    basic_atomic_double_word<T> words_;
+};
+
+} // namespace mpmc_detail
+
+/**
+ * Maps the buffer with huge pages, so large rings need far fewer TLB
+ * entries. The mapping is rounded up to a whole number of 2MB pages.
+ * Optionally binds the pages to a NUMA node.
+ * Outside of Linux this is the same as mpmc_aligned_allocator.
+ */
+class mpmc_huge_page_allocator
+{
+public:
+    static constexpr size_t huge_page_size = 2U * 1024U * 1024U;
+    
+    /**
+     * @param in_numa_node NUMA node to bind the buffer to, or -1 to leave it
+     * to the kernel's default policy.
+     */
+    explicit mpmc_huge_page_allocator(const int in_numa_node = -1)
+        : numa_node(in_numa_node)
+    {
+    }
+
+    void* allocate(const size_t size, const size_t /* alignment */) const
+    {
+        return mpmc_detail::map_pages(get_mapped_size(size), true, numa_node);
+    }
+
+    void deallocate(void* memory, const size_t size) const
+    {
+        mpmc_detail::unmap_pages(memory, get_mapped_size(size));
+    }
+
+    int get_numa_node() const
+    {
+        return numa_node;
+    }
+
+private:
+    static size_t get_mapped_size(const size_t size)
+    {
+        return (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+
+    int numa_node;
+};
+
+/**
+ * Normal pages bound to a NUMA node, so every page of the buffer is first
+ * touched on the chosen node no matter which thread constructs the queue.
+ * Outside of Linux this is the same as mpmc_aligned_allocator.
+ */
+class mpmc_numa_allocator
+{
+public:
+    explicit mpmc_numa_allocator(const int in_numa_node)
+        : numa_node(in_numa_node)
+    {
+    }
+
+    void* allocate(const size_t size, const size_t /* alignment */) const
+    {
+        return mpmc_detail::map_pages(size, false, numa_node);
+    }
+
+    void deallocate(void* memory, const size_t size) const
+    {
+        mpmc_detail::unmap_pages(memory, size);
+    }
+
+    int get_numa_node() const
+    {
+        return numa_node;
+    }
+
+private:
+    int numa_node;
+};
+
+namespace mpmc_detail
+{
+
+/**
+ * @returns A small index unique to the calling thread, handed out in the
+ * order threads first ask for one.
+ */
+inline uint_fast32_t thread_index()
+{
+    static std::atomic<uint_fast32_t> next_index(0);
+    static thread_local const uint_fast32_t index =
+        next_index.fetch_add(1, std::memory_order_relaxed);
+
+    return index;
+}
+
+/**
+ * Read the CPU's timestamp counter, rdtsc on x86 & cntvct on aarch64.
+ * Anything else falls back to the steady clock in nanoseconds.
+ * The ticks are only meant to be compared with each other on one machine.
+ */
+inline uint64_t read_tsc()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+} // namespace mpmc_detail
+
+/**
+ * Statistics policies for the queues.
+ * A stats policy is told about every push & pop, every lost race for a
+ * ticket, every rejection and every sleep, and aggregates them into a
+ * mpmc_stats_snapshot on request. The queue only reads the timestamp
+ * counter and its own occupancy for the policy when its enabled member
+ * is true, so mpmc_no_stats costs nothing at all.
+ */
+
+/**
+ * The aggregated statistics of a queue, as returned by snapshot().
+ * Every count is since the queue was constructed.
+ */
+struct mpmc_stats_snapshot
+{
+    /**
+     * Latencies are bucketed by log2 of the timestamp counter ticks an
+     * operation took: bucket i counts operations of [2^i, 2^(i+1)) ticks,
+     * bucket 0 also counts 0 ticks, and the last bucket counts everything
+     * from 2^31 ticks up.
+     */
+    static constexpr size_t latency_bucket_count = 32;
+
+    /**
+     * Sojourn times are bucketed more finely, HDR histogram style: each
+     * power of two of ticks is split into 4 linear sub-buckets, so a bucket
+     * is never more than 25% wide. Buckets 0 to 3 count 0 to 3 ticks, and
+     * the last bucket counts everything from 2^32 * 1.75 ticks up.
+     */
+    static constexpr size_t sojourn_sub_bucket_bits = 2;
+    static constexpr size_t sojourn_bucket_count = 128;
+
+    mpmc_stats_snapshot()
+        : push_count(0),
+        pop_count(0),
+        push_cas_failures(0),
+        pop_cas_failures(0),
+        push_retries(0),
+        pop_retries(0),
+        full_rejections(0),
+        empty_rejections(0),
+        push_sleeps(0),
+        pop_sleeps(0),
+        high_water_mark(0)
+    {
+        for (size_t i = 0; i < latency_bucket_count; ++i)
+        {
+            push_latency[i] = 0;
+            pop_latency[i] = 0;
+        }
+
+        for (size_t i = 0; i < sojourn_bucket_count; ++i)
+        {
+            sojourn_latency[i] = 0;
+        }
+    }
+
+    /**
+     * @returns The sojourn bucket that counts a time of ticks.
+     */
+    static size_t get_sojourn_bucket(const uint64_t ticks)
+    {
+        const uint64_t sub_bucket_count = uint64_t{1} << sojourn_sub_bucket_bits;
+
+        if (ticks < sub_bucket_count)
+        {
+            return static_cast<size_t>(ticks);
+        }
+
+        size_t exponent = 0;
+
+        for (uint64_t remaining = ticks; remaining > 1; remaining >>= 1)
+        {
+            ++exponent;
+        }
+
+        const size_t sub_bucket = static_cast<size_t>(
+            (ticks >> (exponent - sojourn_sub_bucket_bits)) & (sub_bucket_count - 1));
+        const size_t bucket = ((exponent - sojourn_sub_bucket_bits + 1) <<
+            sojourn_sub_bucket_bits) + sub_bucket;
+
+        return bucket < sojourn_bucket_count ? bucket : sojourn_bucket_count - 1;
+    }
+
+    /**
+     * @returns The fewest ticks counted by a sojourn bucket.
+     */
+    static uint64_t get_sojourn_bucket_ticks(const size_t bucket)
+    {
+        const size_t sub_bucket_count = size_t{1} << sojourn_sub_bucket_bits;
+
+        if (bucket < sub_bucket_count)
+        {
+            return bucket;
+        }
+
+        const size_t exponent = (bucket >> sojourn_sub_bucket_bits) + sojourn_sub_bucket_bits - 1;
+        const uint64_t sub_bucket = bucket & (sub_bucket_count - 1);
+
+        return (sub_bucket_count + sub_bucket) << (exponent - sojourn_sub_bucket_bits);
+    }
+
+    /**
+     * @param percentile From 0 to 100.
+     * @returns The fewest ticks of the bucket the percentile of the sampled
+     * sojourn times falls into, 0 if nothing was sampled.
+     */
+    uint64_t get_sojourn_percentile(const double percentile) const
+    {
+        uint64_t sample_count = 0;
+
+        for (size_t i = 0; i < sojourn_bucket_count; ++i)
+        {
+            sample_count += sojourn_latency[i];
+        }
+
+        const double rank = sample_count * (percentile / 100.0);
+        uint64_t seen_count = 0;
+
+        for (size_t i = 0; i < sojourn_bucket_count; ++i)
+        {
+            seen_count += sojourn_latency[i];
+
+            if (sojourn_latency[i] != 0 && static_cast<double>(seen_count) >= rank)
+            {
+                return get_sojourn_bucket_ticks(i);
+            }
+        }
+
+        return 0;
+    }
+
+    // Elements pushed & popped.
+    uint64_t push_count;
+    uint64_t pop_count;
+    // CAS operations on a ticket that lost to another thread.
+    uint64_t push_cas_failures;
+    uint64_t pop_cas_failures;
+    // Every retry of a claim, whether from a lost CAS or a stale ticket.
+    // This is also how many times the backoff policy was called.
+    uint64_t push_retries;
+    uint64_t pop_retries;
+    // Pushes that found the buffer full, and pops that found it empty.
+    uint64_t full_rejections;
+    uint64_t empty_rejections;
+    // How many times a blocking push/pop went to sleep on its futex.
+    uint64_t push_sleeps;
+    uint64_t pop_sleeps;
+    // The most elements seen in the buffer right after a push.
+    uint64_t high_water_mark;
+    // Latencies of the pushes & pops that succeeded, bulk ones included.
+    uint64_t push_latency[latency_bucket_count];
+    uint64_t pop_latency[latency_bucket_count];
+    // How long the sampled elements sat in the buffer, from the push that
+    // published each one to the pop that released its node. Only kept by
+    // policies that trace sojourn times.
+    uint64_t sojourn_latency[sojourn_bucket_count];
+};
+
+/**
+ * Don't keep any statistics, snapshot() is always zeroed.
+ */
+struct mpmc_no_stats
+{
+    static constexpr bool enabled = false;
+
+    void record_push(size_t /* count */, uint64_t /* occupancy */, uint64_t /* ticks */) {}
+    void record_pop(size_t /* count */, uint64_t /* ticks */) {}
+    void record_push_cas_failure() {}
+    void record_pop_cas_failure() {}
+    void record_push_retry() {}
+    void record_pop_retry() {}
+    void record_full() {}
+    void record_empty() {}
+    void record_push_sleep() {}
+    void record_pop_sleep() {}
+
+    mpmc_stats_snapshot snapshot() const
+    {
+        return mpmc_stats_snapshot();
+    }
+
+    mpmc_stats_snapshot thread_snapshot() const
+    {
+        return mpmc_stats_snapshot();
+    }
+};
+
+/**
+ * Keep statistics in per-thread stripes, so recording never contends on a
+ * shared cache line. Each thread writes the stripe picked by its
+ * mpmc_detail::thread_index(). With more than stripe_count threads some
+ * stripes are shared, which only costs contention since the counters are
+ * all atomic. snapshot() sums the stripes without stopping the writers, so
+ * it may be a little behind when taken under load.
+ *
+ * With a sample_rate above 0, every sample_rate-th ticket is also traced:
+ * the push that publishes it stores a timestamp for its node, & the pop
+ * that releases the node records how long the element sat in the buffer.
+ * The pop's stripe holds the histogram, so thread_snapshot() on a consumer
+ * thread gives that consumer's own sojourn times.
+ */
+template <size_t stripe_count = 64, size_t sample_rate = 0>
+class mpmc_striped_stats
+{
+    static_assert(stripe_count > 0, "Can't have a stripe count <= 0!");
+    static_assert((sample_rate & (sample_rate - 1)) == 0,
+        "The sample rate must be 0 or a power of two!");
+
+    // Without tracing, the stripes keep a single unused sojourn bucket.
+    static constexpr size_t sojourn_bucket_count = sample_rate != 0 ?
+        mpmc_stats_snapshot::sojourn_bucket_count : 1;
+
+public:
+    static constexpr bool enabled = true;
+    static constexpr size_t sojourn_sample_rate = sample_rate;
+
+    void record_push(const size_t count, const uint64_t occupancy, const uint64_t ticks)
+    {
+        stripe& local = local_stripe();
+
+        add(local.counters[push_count_index], count);
+        add(local.push_latency[latency_bucket(ticks)], 1);
+
+        if (occupancy > local.high_water_mark.load(std::memory_order_relaxed))
+        {
+            update_maximum(local.high_water_mark, occupancy);
+        }
+    }
+
+    void record_pop(const size_t count, const uint64_t ticks)
+    {
+        stripe& local = local_stripe();
+
+        add(local.counters[pop_count_index], count);
+        add(local.pop_latency[latency_bucket(ticks)], 1);
+    }
+
+    void record_push_cas_failure() { add(local_stripe().counters[push_cas_failures_index], 1); }
+    void record_pop_cas_failure() { add(local_stripe().counters[pop_cas_failures_index], 1); }
+    void record_push_retry() { add(local_stripe().counters[push_retries_index], 1); }
+    void record_pop_retry() { add(local_stripe().counters[pop_retries_index], 1); }
+    void record_full() { add(local_stripe().counters[full_rejections_index], 1); }
+    void record_empty() { add(local_stripe().counters[empty_rejections_index], 1); }
+    void record_push_sleep() { add(local_stripe().counters[push_sleeps_index], 1); }
+    void record_pop_sleep() { add(local_stripe().counters[pop_sleeps_index], 1); }
+
+    void record_sojourn(const uint64_t ticks)
+    {
+        add(local_stripe().sojourn_latency[mpmc_stats_snapshot::get_sojourn_bucket(ticks)], 1);
+    }
+
+    mpmc_stats_snapshot snapshot() const
+    {
+        mpmc_stats_snapshot result;
+
+        for (const stripe& current : stripes)
+        {
+            add_stripe(result, current);
+        }
+
+        return result;
+    }
+
+    /**
+     * @returns The statistics of the calling thread's stripe alone, which
+     * other threads share once there are more than stripe_count of them.
+     */
+    mpmc_stats_snapshot thread_snapshot() const
+    {
+        mpmc_stats_snapshot result;
+        add_stripe(result, stripes[mpmc_detail::thread_index() % stripe_count]);
+        return result;
+    }
+
+private:
+    struct stripe;
+
+    static void add_stripe(mpmc_stats_snapshot& result, const stripe& current)
+    {
+        result.push_count += load(current.counters[push_count_index]);
+        result.pop_count += load(current.counters[pop_count_index]);
+        result.push_cas_failures += load(current.counters[push_cas_failures_index]);
+        result.pop_cas_failures += load(current.counters[pop_cas_failures_index]);
+        result.push_retries += load(current.counters[push_retries_index]);
+        result.pop_retries += load(current.counters[pop_retries_index]);
+        result.full_rejections += load(current.counters[full_rejections_index]);
+        result.empty_rejections += load(current.counters[empty_rejections_index]);
+        result.push_sleeps += load(current.counters[push_sleeps_index]);
+        result.pop_sleeps += load(current.counters[pop_sleeps_index]);
+
+        const uint64_t high_water_mark = load(current.high_water_mark);
+
+        if (high_water_mark > result.high_water_mark)
+        {
+            result.high_water_mark = high_water_mark;
+        }
+
+        for (size_t i = 0; i < mpmc_stats_snapshot::latency_bucket_count; ++i)
+        {
+            result.push_latency[i] += load(current.push_latency[i]);
+            result.pop_latency[i] += load(current.pop_latency[i]);
+        }
+
+        if (sample_rate != 0)
+        {
+            for (size_t i = 0; i < sojourn_bucket_count; ++i)
+            {
+                result.sojourn_latency[i] += load(current.sojourn_latency[i]);
+            }
+        }
+    }
+
+    enum counter_index
+    {
+        push_count_index,
+        pop_count_index,
+        push_cas_failures_index,
+        pop_cas_failures_index,
+        push_retries_index,
+        pop_retries_index,
+        full_rejections_index,
+        empty_rejections_index,
+        push_sleeps_index,
+        pop_sleeps_index,
+        counter_count
+    };
+
+    struct alignas(CACHE_LINE_SIZE) stripe
+    {
+        stripe()
+            : high_water_mark(0)
+        {
+            for (size_t i = 0; i < counter_count; ++i)
+            {
+                counters[i].store(0, std::memory_order_relaxed);
+            }
+
+            for (size_t i = 0; i < mpmc_stats_snapshot::latency_bucket_count; ++i)
+            {
+                push_latency[i].store(0, std::memory_order_relaxed);
+                pop_latency[i].store(0, std::memory_order_relaxed);
+            }
+
+            for (size_t i = 0; i < sojourn_bucket_count; ++i)
+            {
+                sojourn_latency[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint64_t> counters[counter_count];
+        std::atomic<uint64_t> high_water_mark;
+        std::atomic<uint64_t> push_latency[mpmc_stats_snapshot::latency_bucket_count];
+        std::atomic<uint64_t> pop_latency[mpmc_stats_snapshot::latency_bucket_count];
+        std::atomic<uint64_t> sojourn_latency[sojourn_bucket_count];
+    };
+
+    stripe& local_stripe()
+    {
+        return stripes[mpmc_detail::thread_index() % stripe_count];
+    }
+
+    static void add(std::atomic<uint64_t>& counter, const uint64_t amount)
+    {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    static uint64_t load(const std::atomic<uint64_t>& counter)
+    {
+        return counter.load(std::memory_order_relaxed);
+    }
+
+    static void update_maximum(std::atomic<uint64_t>& maximum, const uint64_t value)
+    {
+        uint64_t current = maximum.load(std::memory_order_relaxed);
+
+        while (value > current &&
+            !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    static size_t latency_bucket(uint64_t ticks)
+    {
+        const size_t last_bucket = mpmc_stats_snapshot::latency_bucket_count - 1;
+        
+#if defined(__GNUC__) || defined(__clang__)
+        const size_t bucket = ticks < 2 ? 0 : 63 - __builtin_clzll(ticks);
+#else
+        size_t bucket = 0;
+
+        for (; ticks > 1; ticks >>= 1)
+        {
+            ++bucket;
+        }
+#endif
+
+        return bucket < last_bucket ? bucket : last_bucket;
+    }
+
+    stripe stripes[stripe_count];
+};
+
+/**
+ * mpmc_striped_stats that also traces the sojourn time of every
+ * sample_rate-th element, e.g. mpmc_sojourn_stats<64> for 1 in 64.
+ */
+template <size_t sample_rate = 1, size_t stripe_count = 64>
+using mpmc_sojourn_stats = mpmc_striped_stats<stripe_count, sample_rate>;
+
+namespace mpmc_detail
+{
+    template <typename...>
+    struct make_void
+    {
+        typedef void type;
+    };
+
+    /**
+     * The sojourn_sample_rate of a stats policy, or 0 for the policies
+     * that don't declare one & so don't trace.
+     */
+    template <typename stats_policy, typename = void>
+    struct sojourn_sample_rate : std::integral_constant<size_t, 0>
+    {
+    };
+
+    template <typename stats_policy>
+    struct sojourn_sample_rate<stats_policy,
+        typename make_void<decltype(stats_policy::sojourn_sample_rate)>::type>
+        : std::integral_constant<size_t, stats_policy::sojourn_sample_rate>
+    {
+    };
+}
+
+namespace mpmc_detail
+{
+
+/**
+ * Tickets & node sequences are 64 bit, so they never wrap in practice:
+ * at a billion operations a second wrapping takes over 500 years.
+ * They're still compared wrap-safe through ticket_difference.
+ */
+typedef uint64_t ticket_type;
+typedef int64_t ticket_difference;
+
+/**
+ * Strucutre that contains the index mask, the remapping shifts, and the
+ * circular buffer. They are all accessed at the same time, so they are
+ * not seperated by padding.
+ * The nodes are laid out by the slot_layout policy & the buffer comes from
+ * the allocator policy. Both the ring engine & the segments of
+ * segmented_mpmc_queue are built on it.
+ */
+template <typename T, typename slot_layout, typename allocator>
+struct alignas(CACHE_LINE_SIZE) circular_buffer_data
+{
+    /**
+     * The smallest possible node, used to work out the node rules of the layout.
+     */
+    struct packed_node_shape
+    {
+        std::atomic<ticket_type> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    typedef typename slot_layout::template node_rules<sizeof(packed_node_shape),
+        alignof(packed_node_shape)> node_rules;
+
+    /**
+     * Structure that represents each node in the circular buffer.
+     * Ownership of a node is handed between producers and consumers through
+     * its sequence number (Dmitry Vyukov's bounded MPMC scheme). A node whose
+     * sequence equals a producer's ticket is free to be written, and a node
+     * whose sequence equals a consumer's ticket + 1 holds published data.
+     * The release store of the sequence is what publishes the data, so no
+     * lock is needed around the data itself. The sequence sits next to the
+     * data, so an uncontended push or pop only touches one cache line.
+     * @cite https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+     */
+    struct alignas(node_rules::alignment) buffer_node
+    {
+        std::atomic<ticket_type> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        /**
+         * The storage is left uninitialized, an element only lives in it
+         * between a producer constructing it and a consumer destroying it.
+         */
+        buffer_node(const ticket_type in_sequence = 0)
+            : sequence(in_sequence)
+        {
+        }
+
+        T& data()
+        {
+            return *reinterpret_cast<T*>(&storage);
+        }
+
+        /**
+         * Move the published element out to a consumer, and destroy it.
+         * The node still has to be released afterwards.
+         */
+        void get_data(T& out_data)
+        {
+            get_data(std::integral_constant<bool, std::is_trivially_copyable<T>::value>{},
+                out_data);
+        }
+
+        /**
+         * Construct the element for a producer in place.
+         * The node still has to be published afterwards.
+         */
+        template <typename... Args>
+        void set_data(Args&&... args)
+        {
+            new (&storage) T(std::forward<Args>(args)...);
+        }
+
+        /**
+         * Copy an element in, which the bulk & single pushes of an existing
+         * element both end up in.
+         */
+        void set_data(const T& in_data)
+        {
+            set_data(std::integral_constant<bool, std::is_trivially_copyable<T>::value>{},
+                in_data);
+        }
+
+    private:
+        /**
+         * Trivially copyable elements are copied as sizeof(T) raw bytes. A
+         * memcpy of a constant size compiles down to the widest loads &
+         * stores the target has (SSE, AVX2, AVX-512 or NEON), whatever
+         * copy assignment T declares, and there's no destructor to run.
+         */
+        void get_data(std::true_type /* trivially copyable */, T& out_data)
+        {
+            std::memcpy(&out_data, &storage, sizeof(T));
+        }
+
+        void get_data(std::false_type /* trivially copyable */, T& out_data)
+        {
+            out_data = std::move(data());
+            data().~T();
+        }
+
+        void set_data(std::true_type /* trivially copyable */, const T& in_data)
+        {
+            std::memcpy(&storage, &in_data, sizeof(T));
+        }
+
+        void set_data(std::false_type /* trivially copyable */, const T& in_data)
+        {
+            new (&storage) T(in_data);
+        }
+    };
+
+    // The most tickets a side of the ring claims between publishing its ticket hint.
+    static constexpr uint_fast32_t max_hint_interval = 64;
+
+    const uint_fast32_t index_mask;
+    uint_fast32_t line_mask;
+    uint_fast32_t line_shift;
+    // The ring engine publishes its ticket hints every hint_mask + 1 tickets.
+    uint_fast32_t hint_mask;
+    buffer_node* circular_buffer;
+    allocator buffer_allocator;
+    // False for a view of nodes that live in someone else's memory.
+    bool owns_buffer;
+
+    circular_buffer_data(const uint_least32_t requested_size,
+        const allocator& in_allocator)
+        : index_mask(get_next_power_of_two(requested_size) - 1),
+        line_mask(0),
+        line_shift(0),
+        hint_mask(0),
+        circular_buffer(nullptr),
+        buffer_allocator(in_allocator),
+        owns_buffer(true)
+    {
+        /** Contigiously allocate the buffer.
+          * The allocator is asked for the node alignment explicitly,
+          * since calloc only guarantees alignof(max_align_t).
+         */
+        circular_buffer = static_cast<buffer_node*>(buffer_allocator.allocate(
+            (index_mask + 1) * sizeof(buffer_node), alignof(buffer_node)));
+
+        initialize_masks();
+        construct_nodes();
+    }
+
+    /**
+     * View nodes that live in memory owned by someone else, such as a shared
+     * memory region. The view neither destroys nor frees the nodes.
+     * 
+     * @param external_nodes Room for get_buffer_size(requested_size) bytes,
+     * aligned to alignof(buffer_node).
+     * @param should_construct_nodes Whether the nodes still have to be
+     * constructed, or were already by whoever set the memory up.
+     */
+    circular_buffer_data(const uint_least32_t requested_size, void* const external_nodes,
+        const bool should_construct_nodes)
+        : index_mask(get_next_power_of_two(requested_size) - 1),
+        line_mask(0),
+        line_shift(0),
+        hint_mask(0),
+        circular_buffer(static_cast<buffer_node*>(external_nodes)),
+        buffer_allocator(),
+        owns_buffer(false)
+    {
+        initialize_masks();
+
+        if (should_construct_nodes)
+        {
+            construct_nodes();
+        }
+    }
+
+    ~circular_buffer_data()
+    {
+        if(circular_buffer != nullptr && owns_buffer)
+        {
+            for (uint_fast32_t i = 0; i <= index_mask; ++i)
+            {
+                circular_buffer[i].~buffer_node();
+            }
+            
+            buffer_allocator.deallocate(circular_buffer,
+                (index_mask + 1) * sizeof(buffer_node));
+        }
+    }
+
+    /**
+     * @returns How many bytes of nodes a buffer of requested_size needs.
+     */
+    static size_t get_buffer_size(const uint_least32_t requested_size)
+    {
+        return static_cast<size_t>(get_next_power_of_two(requested_size)) * sizeof(buffer_node);
+    }
+    
+    buffer_node& get_node(const ticket_type ticket)
+    {
+        const uint_fast32_t index = static_cast<uint_fast32_t>(ticket & index_mask);
+
+        if (node_rules::remap_index)
+        {
+            // Tickets that are next to each other go to the same column of
+            // neighbouring lines: the low bits pick the line, the high bits
+            // pick the position within it.
+            return circular_buffer[
+                ((index & line_mask) * (CACHE_LINE_SIZE / sizeof(buffer_node))) +
+                (index >> line_shift)];
+        }
+
+        return circular_buffer[index];
+    }
+    
+private:
+    void initialize_masks()
+    {
+        // An eighth of the capacity, capped at max_hint_interval, so the
+        // approximate occupancy is never off by more than that.
+        const uint_fast32_t hint_interval = (index_mask + 1) / 8;
+        
+        if (hint_interval > 1)
+        {
+            hint_mask = (hint_interval < max_hint_interval ?
+                hint_interval : max_hint_interval) - 1;
+        }
+
+        // With remapping, the buffer is viewed as rows of nodes_per_line
+        // nodes, and consecutive tickets walk down the columns.
+        const uint_fast32_t nodes_per_line = CACHE_LINE_SIZE / sizeof(buffer_node);
+        
+        if (node_rules::remap_index && index_mask + 1 > nodes_per_line)
+        {
+            line_mask = (index_mask + 1) / nodes_per_line - 1;
+            
+            while ((uint_fast32_t{1} << line_shift) <= line_mask)
+            {
+                ++line_shift;
+            }
+        }
+    }
+
+    void construct_nodes()
+    {
+        // Each node starts out owned by the producer whose ticket
+        // maps onto it during the first lap around the buffer.
+        for (uint_fast32_t i = 0; i <= index_mask; ++i)
+        {
+            new (&get_node(i)) buffer_node(i);
+        }
+    }
+
+    /**
+     * The sequence scheme needs at least two nodes, otherwise a node
+     * released by a consumer would look free to the very next producer.
+     * @cite https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
+     */
+    static uint_least32_t get_next_power_of_two(const uint_least32_t requested_size)
+    {
+        if (requested_size > 0x80000000U)
+        {
+            throw std::length_error("Can't have a queue length above 2^31!");
+        }
+        
+        uint_least32_t v = requested_size < 2 ? 2 : requested_size;
+
+        v--;
+        v |= v >> 1;
+        v |= v >> 2;
+        v |= v >> 4;
+        v |= v >> 8;
+        v |= v >> 16;
+        v++;
+        
+        return v;
+    }
+};
+
+/**
+ * What a blocking push/pop sleeps on. The epoch is bumped every time a
+ * waiter needs waking, and sleepers wait for it to change. The waiter count
+ * lets the other side skip the wake syscall when nobody is asleep.
+ * Both are read by every push or pop, but only written while waiting,
+ * so they get their own cache line.
+ */
+struct alignas(CACHE_LINE_SIZE) ring_wait_state
+{
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> waiter_count;
+
+    ring_wait_state()
+        : epoch(0),
+        waiter_count(0)
+    {
+    }
+};
+
+/**
+ * A copy of one side's ticket, on its own cache line, for the
+ * approximate occupancy queries to read instead of the real ticket.
+ */
+struct alignas(CACHE_LINE_SIZE) ring_ticket_hint
+{
+    std::atomic<ticket_type> ticket;
+
+    ring_ticket_hint()
+        : ticket(0)
+    {
+    }
+};
+
+/**
+ * Everything the ring engine's producers & consumers write besides the
+ * nodes. It only holds fixed width atomics, never pointers, so it can also
+ * live in a region shared between processes.
+ */
+struct ring_cursors
+{
+    ring_cursors()
+        : producer_ticket(0),
+        cached_consumer_ticket(0),
+        consumer_ticket(0),
+        cached_producer_ticket(0)
+    {
+    }
+
+    // The tickets live on their own cache lines so producers and consumers
+    // never contend with each other, only amongst themselves. The cached
+    // copies of the opposite ticket are only used with a single producer &
+    // consumer, and share the line of the ticket that owns them.
+    alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> producer_ticket;
+    ticket_type cached_consumer_ticket;
+    alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> consumer_ticket;
+    ticket_type cached_producer_ticket;
+    // Consumers sleep on not_empty, producers sleep on not_full.
+    ring_wait_state not_empty;
+    ring_wait_state not_full;
+    // Only read by the approximate occupancy queries.
+    ring_ticket_hint producer_hint;
+    ring_ticket_hint consumer_hint;
+};
+
+/**
+ * Keeps the ring's cursors inside the queue object. This is the default.
+ */
+class inline_ring_cursors
+{
+public:
+    static constexpr bool is_process_shared = false;
+
+    ring_cursors& get()
+    {
+        return cursors_;
+    }
+
+    const ring_cursors& get() const
+    {
+        return cursors_;
+    }
+
+private:
+    ring_cursors cursors_;
+};
+
+/**
+ * Points the ring at cursors that live in a region shared between
+ * processes, whose sleepers need process-shared futexes.
+ */
+class shared_ring_cursors
+{
+public:
+    static constexpr bool is_process_shared = true;
+
+    explicit shared_ring_cursors(ring_cursors* const cursors)
+        : cursors_(cursors)
+    {
+    }
+
+    ring_cursors& get()
+    {
+        return *cursors_;
+    }
+
+    const ring_cursors& get() const
+    {
+        return *cursors_;
+    }
+
+private:
+    ring_cursors* cursors_;
+};
+
+/**
+ * Lockless, Multi-Producer, Multi-Consumer, Circular Queue engine.
+ * The type is intended to be light weight & portable.
+ * The tickets are padded to fit within their own cache lines, and the layout
+ * of the buffer nodes is picked by the slot_layout policy.
+ * The capacity is only known at runtime here, bounded_circular_mpmc_queue
+ * and dynamic_mpmc_queue decide where it comes from.
+ * The stats policy is a private base, so mpmc_no_stats takes up no space.
+ * The wait policy decides whether blocking operations may sleep.
+ * The cursor storage decides where the tickets live, inline_ring_cursors
+ * in the queue itself, or shared_ring_cursors in a shared memory region.
+ */
+template <typename T, typename backoff_policy, typename slot_layout,
+    typename allocator, typename concurrency_mode, typename stats_policy,
+    typename wait_policy, typename cursor_storage = inline_ring_cursors>
+class basic_circular_mpmc_queue : private stats_policy
+{
+    typedef mpmc_detail::circular_buffer_data<T, slot_layout, allocator> circular_buffer_data;
+    typedef typename circular_buffer_data::buffer_node buffer_node;
+    typedef ring_wait_state wait_state;
+    typedef ring_ticket_hint ticket_hint;
+
+    // How many attempts a blocking push/pop spins, then yields, for before sleeping.
+    static constexpr uint_fast32_t wait_spin_count = 64;
+    static constexpr uint_fast32_t wait_yield_count = 16;
+
+    // Set in the producer ticket by close(). Tickets never get near it, and
+    // since every claim reads or CASes the producer ticket, no push can
+    // claim a ticket once it's set.
+    static constexpr ticket_type closed_bit = ticket_type{1} << 63;
+
+    // How many nodes ahead the bulk operations prefetch, within their claimed run.
+    static constexpr size_t bulk_prefetch_distance = 4;
+
+    // Every sojourn_sample_rate-th ticket gets timestamped, 0 for none.
+    static constexpr size_t sojourn_sample_rate =
+        mpmc_detail::sojourn_sample_rate<stats_policy>::value;
+
+    /**
+     * Whether the tickets & node sequences are lock-free atomics on this target.
+     * std::atomic<T>::is_always_lock_free is C++17, so C++14 builds fall back
+     * to the ATOMIC_*_LOCK_FREE macros for the matching integer width.
+     */
+    static constexpr bool is_ticket_lock_free()
+    {
+#if defined(__cpp_lib_atomic_is_always_lock_free)
+        return std::atomic<ticket_type>::is_always_lock_free;
+#else
+        return sizeof(ticket_type) == sizeof(long long) ? ATOMIC_LLONG_LOCK_FREE == 2 :
+            sizeof(ticket_type) == sizeof(long) ? ATOMIC_LONG_LOCK_FREE == 2 :
+            ATOMIC_INT_LOCK_FREE == 2;
+#endif
+    }
+
+    static_assert(is_ticket_lock_free(),
+        "The queue tickets must be lock-free atomics on this target!");
+
+protected:
+    basic_circular_mpmc_queue(const uint_least32_t requested_size,
+        const allocator& in_allocator)
+        : circular_buffer_data_(requested_size, in_allocator),
+        enqueue_ticks_(nullptr)
+    {
+        if (sojourn_sample_rate != 0)
+        {
+            // Timestamps are kept apart from the nodes, so tracing doesn't
+            // change the node layout, or cost anything when it's off.
+            enqueue_ticks_ = static_cast<uint64_t*>(circular_buffer_data_.buffer_allocator.allocate(
+                capacity() * sizeof(uint64_t), CACHE_LINE_SIZE));
+        }
+    }
+
+    /**
+     * Run the ring over cursors & nodes that live in memory owned by
+     * someone else, such as a shared memory region.
+     *
+     * @param external_nodes Room for the nodes, see circular_buffer_data.
+     * @param should_construct_nodes Whether the nodes still have to be
+     * constructed, or were already by whoever set the memory up.
+     */
+    basic_circular_mpmc_queue(const cursor_storage& cursors,
+        const uint_least32_t requested_size, void* const external_nodes,
+        const bool should_construct_nodes)
+        : cursor_storage_(cursors),
+        circular_buffer_data_(requested_size, external_nodes, should_construct_nodes),
+        enqueue_ticks_(nullptr)
+    {
+        static_assert(sojourn_sample_rate == 0,
+            "Sojourn timestamps are kept per process, so can't trace external nodes!");
+    }
+
+    ~basic_circular_mpmc_queue()
+    {
+        if (enqueue_ticks_ != nullptr)
+        {
+            circular_buffer_data_.buffer_allocator.deallocate(enqueue_ticks_,
+                capacity() * sizeof(uint64_t));
+        }
+
+        // Nothing can be in flight any more, so every ticket between the two
+        // cursors holds a constructed element that was never popped.
+        const ticket_type producer_ticket = load_producer_ticket(std::memory_order_acquire);
+        
+        for (ticket_type ticket = cursors().consumer_ticket.load(std::memory_order_acquire);
+            ticket != producer_ticket; ++ticket)
+        {
+            get_node(ticket).data().~T();
+        }
+    }
+
+public:
+    /**
+     * Push an element into the queue.
+     * Producers only contend with other producers, on the producer ticket.
+     * 
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if the buffer is full, or the queue is closed.
+     */
+    bool push(const T& in_data)
+    {
+        return try_emplace(in_data);
+    }
+
+    /**
+     * Push an element into the queue by moving it into the node.
+     * 
+     * @param in_data The element to be moved into the queue. It is left
+     * untouched if the buffer is full.
+     * @returns Returns false only if the buffer is full, or the queue is closed.
+     */
+    bool push(T&& in_data)
+    {
+        return try_emplace(std::move(in_data));
+    }
+
+    /**
+     * Push an element into the queue.
+     * 
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns ok, full, or closed.
+     */
+    mpmc_result try_push(const T& in_data)
+    {
+        return try_emplace_result(in_data);
+    }
+
+    /**
+     * Push an element into the queue by moving it into the node.
+     * 
+     * @param in_data The element to be moved into the queue. It is left
+     * untouched unless ok is returned.
+     * @returns ok, full, or closed.
+     */
+    mpmc_result try_push(T&& in_data)
+    {
+        return try_emplace_result(std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place at the back of the queue.
+     * If constructing T from args could throw, the element is constructed
+     * before a ticket is claimed and then moved into the node, since a
+     * claimed ticket can't be given back.
+     * 
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if the buffer is full or the queue is
+     * closed, in which case nothing is constructed.
+     */
+    template <typename... Args>
+    bool try_emplace(Args&&... args)
+    {
+        return try_emplace_result(std::forward<Args>(args)...) == mpmc_result::ok;
+    }
+
+    /**
+     * try_emplace, with the reason it failed.
+     * 
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns ok, full, or closed.
+     */
+    template <typename... Args>
+    mpmc_result try_emplace_result(Args&&... args)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value,
+            "T must be nothrow move constructible!");
+        
+        return emplace_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T, Args&&...>::value>{},
+            std::forward<Args>(args)...);
+    }
+
+    /**
+     * Pop an element from the queue.
+     * The element is moved out of its node and destroyed in place.
+     * Consumers only contend with other consumers, on the consumer ticket.
+     * 
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if the buffer is empty.
+     */
+    bool pop(T& out_data)
+    {
+        return try_pop(out_data) == mpmc_result::ok;
+    }
+
+    /**
+     * Pop an element from the queue.
+     * 
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns ok, empty, or closed once the queue is closed & drained.
+     */
+    mpmc_result try_pop(T& out_data)
+    {
+        static_assert(std::is_nothrow_move_assignable<T>::value,
+            "T must be nothrow move assignable!");
+        
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket;
+        buffer_node* const node = claim_consumer_node(ticket);
+
+        if (node == nullptr)
+        {
+            return reject_pop();
+        }
+
+        // get the data, then hand the node back to the producer of the next lap.
+        node->get_data(out_data);
+        release_node(*node, ticket);
+        finish_pop(ticket, 1, start_ticks);
+        
+        return mpmc_result::ok;
+    }
+
+    /**
+     * Close the queue. Every push fails from then on, pops drain what's
+     * left & then return closed, and every sleeping producer & consumer is
+     * woken. Pushes that had already claimed a ticket still complete.
+     */
+    void close()
+    {
+        cursors().producer_ticket.fetch_or(closed_bit, std::memory_order_seq_cst);
+        notify_waiters(cursors().not_empty);
+        notify_waiters(cursors().not_full);
+    }
+
+    bool is_closed() const
+    {
+        return (cursors().producer_ticket.load(std::memory_order_acquire) & closed_bit) != 0;
+    }
+    
+    /**
+     * Push an element into the queue, waiting for space if the buffer is full.
+     * Waiting spins with HARDWARE_PAUSE, then yields, then with mpmc_sleep_wait
+     * sleeps on a futex until a consumer frees a node.
+     * 
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns ok, or closed if the queue is closed first.
+     */
+    mpmc_result push_wait(const T& in_data)
+    {
+        return push_wait_until(in_data, std::chrono::steady_clock::time_point::max());
+    }
+
+    /**
+     * Move an element into the queue, waiting for space if the buffer is full.
+     * 
+     * @param in_data The element to be moved into the queue.
+     * @returns ok, or closed if the queue is closed first.
+     */
+    mpmc_result push_wait(T&& in_data)
+    {
+        return push_wait_until(std::move(in_data), std::chrono::steady_clock::time_point::max());
+    }
+
+    /**
+     * Push an element into the queue, waiting at most timeout for space.
+     * 
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @param timeout The longest time to wait for.
+     * @returns ok, closed, or timeout if the buffer stayed full for the whole timeout.
+     */
+    template <typename Rep, typename Period>
+    mpmc_result push_wait_for(const T& in_data, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return push_wait_until(in_data, std::chrono::steady_clock::now() + timeout);
+    }
+
+    /**
+     * Push an element into the queue, waiting until deadline at most for space.
+     * 
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @param deadline The latest time to wait until.
+     * @returns ok, closed, or timeout if the buffer stayed full until the deadline.
+     */
+    template <typename Clock, typename Duration>
+    mpmc_result push_wait_until(const T& in_data,
+        const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return wait_until(cursors().not_full, deadline, [&]() { return try_push(in_data); });
+    }
+
+    /**
+     * Move an element into the queue, waiting until deadline at most for space.
+     * 
+     * @param in_data The element to be moved into the queue. It is left
+     * untouched unless ok is returned.
+     * @param deadline The latest time to wait until.
+     * @returns ok, closed, or timeout if the buffer stayed full until the deadline.
+     */
+    template <typename Clock, typename Duration>
+    mpmc_result push_wait_until(T&& in_data,
+        const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return wait_until(cursors().not_full, deadline, [&]() { return try_push(std::move(in_data)); });
+    }
+
+    /**
+     * Pop an element from the queue, waiting for one if the buffer is empty.
+     * Waiting spins with HARDWARE_PAUSE, then yields, then with mpmc_sleep_wait
+     * sleeps on a futex until a producer publishes a node.
+     * 
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns ok, or closed once the queue is closed & drained.
+     */
+    mpmc_result pop_wait(T& out_data)
+    {
+        return pop_wait_until(out_data, std::chrono::steady_clock::time_point::max());
+    }
+
+    /**
+     * Pop an element from the queue, waiting at most timeout for one.
+     * 
+     * @param out_data Reference to the variable that will store the popped element.
+     * @param timeout The longest time to wait for.
+     * @returns ok, closed once the queue is closed & drained, or timeout if
+     * the buffer stayed empty for the whole timeout.
+     */
+    template <typename Rep, typename Period>
+    mpmc_result pop_wait_for(T& out_data, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return pop_wait_until(out_data, std::chrono::steady_clock::now() + timeout);
+    }
+
+    /**
+     * Pop an element from the queue, waiting until deadline at most for one.
+     * 
+     * @param out_data Reference to the variable that will store the popped element.
+     * @param deadline The latest time to wait until.
+     * @returns ok, closed once the queue is closed & drained, or timeout if
+     * the buffer stayed empty until the deadline.
+     */
+    template <typename Clock, typename Duration>
+    mpmc_result pop_wait_until(T& out_data,
+        const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return wait_until(cursors().not_empty, deadline, [&]() { return try_pop(out_data); });
+    }
+    
+    /**
+     * Push a run of elements into the queue, claiming as many consecutive
+     * tickets as are free with a single CAS on the producer ticket.
+     * 
+     * @param first Pointer to the first element to be copied into the queue.
+     * @param count How many elements to push.
+     * @returns How many elements were pushed, the first that many elements
+     * of the run. Returns 0 only if the buffer is full or the queue is closed.
+     */
+    size_t push_bulk(const T* first, const size_t count)
+    {
+        return push_bulk(first, first + count);
+    }
+
+    /**
+     * Iterator-range variant of push_bulk.
+     * If constructing T from *first could throw, the elements are pushed
+     * one at a time instead, since claimed tickets can't be given back.
+     * 
+     * @param first Iterator to the first element to be copied into the queue.
+     * @param last Iterator past the last element to be copied into the queue.
+     * @returns How many elements were pushed, starting from first.
+     */
+    template <typename ForwardIterator>
+    size_t push_bulk(ForwardIterator first, ForwardIterator last)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value,
+            "T must be nothrow move constructible!");
+        
+        return push_bulk_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T,
+                typename std::iterator_traits<ForwardIterator>::reference>::value>{},
+            first, last);
+    }
+
+    /**
+     * Pop a run of elements from the queue, claiming as many consecutive
+     * published tickets as are available with a single CAS on the consumer ticket.
+     * 
+     * @param out_first Pointer to the first of max_count elements that the
+     * popped elements will be moved into.
+     * @param max_count The most elements to pop.
+     * @returns How many elements were popped. Returns 0 only if the buffer is empty.
+     */
+    size_t pop_bulk(T* out_first, const size_t max_count)
+    {
+        return pop_bulk<T*>(out_first, max_count);
+    }
+
+    /**
+     * Output-iterator variant of pop_bulk.
+     * 
+     * @param out_first Iterator that the popped elements will be assigned through.
+     * @param max_count The most elements to pop.
+     * @returns How many elements were popped. Returns 0 only if the buffer is empty.
+     */
+    template <typename OutputIterator>
+    size_t pop_bulk(OutputIterator out_first, const size_t max_count)
+    {
+        static_assert(std::is_nothrow_move_assignable<T>::value,
+            "T must be nothrow move assignable!");
+        
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket;
+        const size_t claimed_count = claim_consumer_run(ticket, max_count);
+
+        for (size_t i = 0; i < claimed_count; ++i, ++out_first)
+        {
+            buffer_node& node = get_node(ticket + i);
+
+            // Every node of the run is already published, so pulling the
+            // later ones in early can't steal a line from a producer.
+            if (i + bulk_prefetch_distance < claimed_count)
+            {
+                PREFETCH_READ(&get_node(ticket + i + bulk_prefetch_distance));
+            }
+            
+            move_out(node, out_first);
+            release_node(node, ticket + i);
+        }
+
+        if (claimed_count > 0)
+        {
+            finish_pop(ticket, claimed_count, start_ticks);
+        }
+        else if (max_count > 0)
+        {
+            reject_pop();
+        }
+
+        return claimed_count;
+    }
+
+    /**
+     * A node claimed by try_claim, holding an element the producer fills in
+     * place. The element is only published by commit(), or by the destructor
+     * if it wasn't committed by then, since a claimed ticket can't be given back.
+     */
+    class producer_claim
+    {
+    public:
+        producer_claim(producer_claim&& other) noexcept
+            : queue_(other.queue_),
+            node_(other.node_),
+            ticket_(other.ticket_),
+            start_ticks_(other.start_ticks_)
+        {
+            other.node_ = nullptr;
+        }
+
+        ~producer_claim()
+        {
+            commit();
+        }
+
+        /**
+         * @returns Whether a node was claimed, false if the buffer was full.
+         */
+        explicit operator bool() const
+        {
+            return node_ != nullptr;
+        }
+
+        T& operator*() const
+        {
+            return node_->data();
+        }
+
+        T* operator->() const
+        {
+            return &node_->data();
+        }
+
+        /**
+         * Publish the element to the consumers.
+         * Does nothing if it has already been committed, or nothing was claimed.
+         */
+        void commit()
+        {
+            if (node_ != nullptr)
+            {
+                queue_->publish_node(*node_, ticket_);
+                queue_->finish_push(ticket_, 1, start_ticks_);
+                node_ = nullptr;
+            }
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        producer_claim(basic_circular_mpmc_queue* const queue, buffer_node* const node,
+            const ticket_type ticket, const uint64_t start_ticks)
+            : queue_(queue),
+            node_(node),
+            ticket_(ticket),
+            start_ticks_(start_ticks)
+        {
+        }
+
+        producer_claim(const producer_claim&) = delete;
+        producer_claim& operator=(const producer_claim&) = delete;
+        producer_claim& operator=(producer_claim&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        buffer_node* node_;
+        ticket_type ticket_;
+        uint64_t start_ticks_;
+    };
+
+    /**
+     * A node claimed by try_peek, holding a published element the consumer
+     * reads in place. The element is destroyed & its node handed back by
+     * release(), or by the destructor if it wasn't released by then.
+     */
+    class consumer_claim
+    {
+    public:
+        consumer_claim(consumer_claim&& other) noexcept
+            : queue_(other.queue_),
+            node_(other.node_),
+            ticket_(other.ticket_),
+            start_ticks_(other.start_ticks_)
+        {
+            other.node_ = nullptr;
+        }
+
+        ~consumer_claim()
+        {
+            release();
+        }
+
+        /**
+         * @returns Whether a node was claimed, false if the buffer was empty.
+         */
+        explicit operator bool() const
+        {
+            return node_ != nullptr;
+        }
+
+        T& operator*() const
+        {
+            return node_->data();
+        }
+
+        T* operator->() const
+        {
+            return &node_->data();
+        }
+
+        /**
+         * Destroy the element, and hand the node back to the producers.
+         * Does nothing if it has already been released, or nothing was claimed.
+         */
+        void release()
+        {
+            if (node_ != nullptr)
+            {
+                node_->data().~T();
+                queue_->release_node(*node_, ticket_);
+                queue_->finish_pop(ticket_, 1, start_ticks_);
+                node_ = nullptr;
+            }
+        }
+
+        /**
+         * Give the node up without releasing it, so the element stays in it
+         * until release_detached is called with the returned ticket, from
+         * any thread. Until then, the producer of the next lap can't reuse it.
+         * @note Needs multiple producers or consumers, since a single
+         * producer & consumer release nodes strictly in ticket order.
+         * @returns The ticket of the node, for release_detached.
+         */
+        ticket_type detach()
+        {
+            static_assert(concurrency_mode::multi_producer || concurrency_mode::multi_consumer,
+                "A single producer & consumer can't release nodes out of order!");
+
+            node_ = nullptr;
+            return ticket_;
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        consumer_claim(basic_circular_mpmc_queue* const queue, buffer_node* const node,
+            const ticket_type ticket, const uint64_t start_ticks)
+            : queue_(queue),
+            node_(node),
+            ticket_(ticket),
+            start_ticks_(start_ticks)
+        {
+        }
+
+        consumer_claim(const consumer_claim&) = delete;
+        consumer_claim& operator=(const consumer_claim&) = delete;
+        consumer_claim& operator=(consumer_claim&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        buffer_node* node_;
+        ticket_type ticket_;
+        uint64_t start_ticks_;
+    };
+
+    /**
+     * Destroy the element of a node detached from a consumer_claim, and hand
+     * the node back to the producers.
+     * 
+     * @param ticket The ticket returned by consumer_claim::detach().
+     */
+    void release_detached(const ticket_type ticket)
+    {
+        buffer_node& node = get_node(ticket);
+
+        node.data().~T();
+        release_node(node, ticket);
+        finish_pop(ticket, 1, stats_policy::enabled ? read_tsc() : 0);
+    }
+
+    /**
+     * A run of consecutive nodes claimed by try_claim_bulk, each holding a
+     * default constructed element the producer fills in place. The whole run
+     * is published by commit(), or by the destructor.
+     */
+    class producer_batch
+    {
+    public:
+        producer_batch(producer_batch&& other) noexcept
+            : queue_(other.queue_),
+            ticket_(other.ticket_),
+            count_(other.count_),
+            start_ticks_(other.start_ticks_)
+        {
+            other.count_ = 0;
+        }
+
+        ~producer_batch()
+        {
+            commit();
+        }
+
+        /**
+         * @returns How many nodes were claimed, 0 if the buffer was full.
+         */
+        size_t size() const
+        {
+            return count_;
+        }
+
+        bool empty() const
+        {
+            return count_ == 0;
+        }
+
+        /**
+         * @param index Which node of the run, from 0 to size() - 1.
+         */
+        T& operator[](const size_t index) const
+        {
+            return queue_->get_node(ticket_ + index).data();
+        }
+
+        /**
+         * Publish the whole run to the consumers, in ticket order.
+         * Does nothing if it has already been committed.
+         */
+        void commit()
+        {
+            if (count_ != 0)
+            {
+                for (size_t i = 0; i < count_; ++i)
+                {
+                    queue_->publish_node(queue_->get_node(ticket_ + i), ticket_ + i);
+                }
+
+                queue_->finish_push(ticket_, count_, start_ticks_);
+                count_ = 0;
+            }
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        producer_batch(basic_circular_mpmc_queue* const queue, const ticket_type ticket,
+            const size_t count, const uint64_t start_ticks)
+            : queue_(queue),
+            ticket_(ticket),
+            count_(count),
+            start_ticks_(start_ticks)
+        {
+        }
+
+        producer_batch(const producer_batch&) = delete;
+        producer_batch& operator=(const producer_batch&) = delete;
+        producer_batch& operator=(producer_batch&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        ticket_type ticket_;
+        size_t count_;
+        uint64_t start_ticks_;
+    };
+
+    /**
+     * A run of consecutive published nodes claimed by try_peek_bulk, read in
+     * place by the consumer. The whole run is destroyed & handed back by
+     * release(), or by the destructor.
+     */
+    class consumer_batch
+    {
+    public:
+        consumer_batch(consumer_batch&& other) noexcept
+            : queue_(other.queue_),
+            ticket_(other.ticket_),
+            count_(other.count_),
+            start_ticks_(other.start_ticks_)
+        {
+            other.count_ = 0;
+        }
+
+        ~consumer_batch()
+        {
+            release();
+        }
+
+        /**
+         * @returns How many nodes were claimed, 0 if the buffer was empty.
+         */
+        size_t size() const
+        {
+            return count_;
+        }
+
+        bool empty() const
+        {
+            return count_ == 0;
+        }
+
+        /**
+         * @param index Which node of the run, from 0 to size() - 1.
+         */
+        T& operator[](const size_t index) const
+        {
+            return queue_->get_node(ticket_ + index).data();
+        }
+
+        /**
+         * Destroy every element of the run, and hand the nodes back to the
+         * producers. Does nothing if it has already been released.
+         */
+        void release()
+        {
+            if (count_ != 0)
+            {
+                for (size_t i = 0; i < count_; ++i)
+                {
+                    buffer_node& node = queue_->get_node(ticket_ + i);
+
+                    node.data().~T();
+                    queue_->release_node(node, ticket_ + i);
+                }
+
+                queue_->finish_pop(ticket_, count_, start_ticks_);
+                count_ = 0;
+            }
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        consumer_batch(basic_circular_mpmc_queue* const queue, const ticket_type ticket,
+            const size_t count, const uint64_t start_ticks)
+            : queue_(queue),
+            ticket_(ticket),
+            count_(count),
+            start_ticks_(start_ticks)
+        {
+        }
+
+        consumer_batch(const consumer_batch&) = delete;
+        consumer_batch& operator=(const consumer_batch&) = delete;
+        consumer_batch& operator=(consumer_batch&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        ticket_type ticket_;
+        size_t count_;
+        uint64_t start_ticks_;
+    };
+
+    /**
+     * Claim the next node & construct an element in it, for the producer to
+     * fill in place before committing it (as in the LMAX Disruptor).
+     * This saves copying large elements into the queue.
+     * @note With a single producer & consumer, commit each claim before
+     * claiming the next, since the claim only moves the ticket on commit.
+     * 
+     * @param args Arguments forwarded to the constructor of T, which must
+     * not throw since a claimed ticket can't be given back.
+     * @returns The claim, which converts to false if the buffer is full.
+     */
+    template <typename... Args>
+    producer_claim try_claim(Args&&... args)
+    {
+        static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
+            "T must be nothrow constructible from the claim arguments!");
+        
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket = 0;
+        buffer_node* const node = claim_producer_node(ticket);
+
+        if (node == nullptr)
+        {
+            stats().record_full();
+        }
+        else
+        {
+            node->set_data(std::forward<Args>(args)...);
+        }
+
+        return producer_claim(this, node, ticket, start_ticks);
+    }
+
+    /**
+     * Claim the node at the front of the queue, for the consumer to read in
+     * place before releasing it. This saves copying large elements out.
+     * @note With a single producer & consumer, release each claim before
+     * peeking at the next, since the claim only moves the ticket on release.
+     * 
+     * @returns The claim, which converts to false if the buffer is empty.
+     */
+    consumer_claim try_peek()
+    {
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket = 0;
+        buffer_node* const node = claim_consumer_node(ticket);
+
+        if (node == nullptr)
+        {
+            stats().record_empty();
+        }
+
+        return consumer_claim(this, node, ticket, start_ticks);
+    }
+
+    /**
+     * Claim a run of up to max_count free nodes with a single CAS, and
+     * default construct an element in each of them.
+     * 
+     * @param max_count The most nodes to claim.
+     * @returns The batch, which is empty if the buffer is full.
+     */
+    producer_batch try_claim_bulk(const size_t max_count)
+    {
+        static_assert(std::is_nothrow_default_constructible<T>::value,
+            "T must be nothrow default constructible!");
+        
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket = 0;
+        const size_t claimed_count = claim_producer_run(ticket, max_count);
+
+        for (size_t i = 0; i < claimed_count; ++i)
+        {
+            get_node(ticket + i).set_data();
+        }
+
+        if (claimed_count == 0 && max_count > 0)
+        {
+            stats().record_full();
+        }
+
+        return producer_batch(this, ticket, claimed_count, start_ticks);
+    }
+
+    /**
+     * Claim a run of up to max_count published nodes with a single CAS.
+     * 
+     * @param max_count The most nodes to claim.
+     * @returns The batch, which is empty if the buffer is empty.
+     */
+    consumer_batch try_peek_bulk(const size_t max_count)
+    {
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket = 0;
+        const size_t claimed_count = claim_consumer_run(ticket, max_count);
+
+        if (claimed_count == 0 && max_count > 0)
+        {
+            stats().record_empty();
+        }
+
+        return consumer_batch(this, ticket, claimed_count, start_ticks);
+    }
+    
+    /**
+     * A producer's write-combining buffer. push only copies the element into
+     * the handle, and the buffered elements are pushed with a single
+     * push_bulk once batch_size of them have built up, the oldest one has
+     * waited max_delay, or flush() is called. Many producers pushing single
+     * small elements then contend on the producer ticket once per batch.
+     * A handle belongs to one thread, and consumers only see its elements
+     * once they're flushed. The destructor flushes, waiting for space if
+     * it has to.
+     */
+    template <size_t batch_size>
+    class producer_handle
+    {
+        static_assert(batch_size > 0, "Can't have a batch size <= 0!");
+        static_assert(std::is_nothrow_default_constructible<T>::value,
+            "T must be nothrow default constructible!");
+
+    public:
+        producer_handle(producer_handle&& other) noexcept
+            : queue_(other.queue_),
+            max_delay_(other.max_delay_),
+            oldest_time_(other.oldest_time_),
+            count_(other.count_)
+        {
+            std::move(other.buffer_, other.buffer_ + other.count_, buffer_);
+            other.count_ = 0;
+        }
+
+        ~producer_handle()
+        {
+            flush_wait();
+        }
+
+        /**
+         * Buffer an element, flushing the buffer first if it's full.
+         * 
+         * @param in_data Reference to the variable containg the data to be pushed.
+         * @returns Returns false only if the buffer was full & flushing it
+         * made no room, because the ring is full or closed.
+         */
+        bool push(const T& in_data)
+        {
+            return push_buffered(T(in_data));
+        }
+
+        bool push(T&& in_data)
+        {
+            return push_buffered(std::move(in_data));
+        }
+
+        /**
+         * Push every buffered element that fits into the ring, with one
+         * reservation. Whatever didn't fit stays buffered, in order.
+         * 
+         * @returns How many elements were pushed.
+         */
+        size_t flush()
+        {
+            const size_t pushed_count = count_ == 0 ? 0 : queue_->push_bulk(
+                std::make_move_iterator(buffer_), std::make_move_iterator(buffer_ + count_));
+
+            // Keep the rest at the front, so it goes out first next time.
+            std::move(buffer_ + pushed_count, buffer_ + count_, buffer_);
+            count_ -= pushed_count;
+
+            if (count_ > 0 && pushed_count > 0 && max_delay_.count() > 0)
+            {
+                oldest_time_ = std::chrono::steady_clock::now();
+            }
+
+            return pushed_count;
+        }
+
+        /**
+         * Flush every buffered element, waiting for space as push_wait does.
+         * 
+         * @returns ok, or closed if the queue was closed first, in which case
+         * the elements left over are dropped.
+         */
+        mpmc_result flush_wait()
+        {
+            flush();
+
+            for (size_t i = 0; i < count_; ++i)
+            {
+                if (queue_->push_wait(std::move(buffer_[i])) == mpmc_result::closed)
+                {
+                    count_ = 0;
+                    return mpmc_result::closed;
+                }
+            }
+
+            count_ = 0;
+            return mpmc_result::ok;
+        }
+
+        /**
+         * @returns How many elements are buffered, not yet visible to consumers.
+         */
+        size_t size() const
+        {
+            return count_;
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        producer_handle(basic_circular_mpmc_queue* const queue,
+            const std::chrono::nanoseconds max_delay)
+            : queue_(queue),
+            max_delay_(max_delay),
+            oldest_time_(),
+            count_(0)
+        {
+        }
+
+        bool push_buffered(T&& in_data)
+        {
+            if (count_ == batch_size && flush() == 0)
+            {
+                return false;
+            }
+
+            // The clock is only read when a delay was asked for.
+            if (max_delay_.count() > 0 && count_ == 0)
+            {
+                oldest_time_ = std::chrono::steady_clock::now();
+            }
+
+            buffer_[count_++] = std::move(in_data);
+
+            if (count_ == batch_size || (max_delay_.count() > 0 &&
+                std::chrono::steady_clock::now() - oldest_time_ >= max_delay_))
+            {
+                flush();
+            }
+
+            return true;
+        }
+
+        producer_handle(const producer_handle&) = delete;
+        producer_handle& operator=(const producer_handle&) = delete;
+        producer_handle& operator=(producer_handle&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        std::chrono::nanoseconds max_delay_;
+        std::chrono::steady_clock::time_point oldest_time_;
+        size_t count_;
+        T buffer_[batch_size];
+    };
+
+    /**
+     * A consumer's read-ahead cache. When it runs dry, pop refills it with
+     * a single pop_bulk of up to batch_size elements, which also prefetches
+     * the nodes of the run, and then hands them out one at a time.
+     * A handle belongs to one thread. Elements it has cached are out of the
+     * ring, so other consumers can't get them, and they're destroyed with
+     * the handle: pop until it returns false before letting it go.
+     */
+    template <size_t batch_size>
+    class consumer_handle
+    {
+        static_assert(batch_size > 0, "Can't have a batch size <= 0!");
+        static_assert(std::is_nothrow_default_constructible<T>::value,
+            "T must be nothrow default constructible!");
+
+    public:
+        consumer_handle(consumer_handle&& other) noexcept
+            : queue_(other.queue_),
+            head_(0),
+            count_(other.count_ - other.head_)
+        {
+            std::move(other.buffer_ + other.head_, other.buffer_ + other.count_, buffer_);
+            other.head_ = 0;
+            other.count_ = 0;
+        }
+
+        /**
+         * Pop the next cached element, refilling the cache if it's empty.
+         * 
+         * @param out_data Reference to the variable that will store the popped element.
+         * @returns Returns false only if the cache & the ring are both empty.
+         */
+        bool pop(T& out_data)
+        {
+            if (head_ == count_)
+            {
+                head_ = 0;
+                count_ = queue_->pop_bulk(buffer_, batch_size);
+
+                if (count_ == 0)
+                {
+                    return false;
+                }
+            }
+
+            out_data = std::move(buffer_[head_++]);
+            return true;
+        }
+
+        /**
+         * @returns How many elements are cached, already taken from the ring.
+         */
+        size_t size() const
+        {
+            return count_ - head_;
+        }
+
+    private:
+        friend class basic_circular_mpmc_queue;
+
+        explicit consumer_handle(basic_circular_mpmc_queue* const queue)
+            : queue_(queue),
+            head_(0),
+            count_(0)
+        {
+        }
+
+        consumer_handle(const consumer_handle&) = delete;
+        consumer_handle& operator=(const consumer_handle&) = delete;
+        consumer_handle& operator=(consumer_handle&&) = delete;
+
+        basic_circular_mpmc_queue* queue_;
+        size_t head_;
+        size_t count_;
+        T buffer_[batch_size];
+    };
+
+    /**
+     * Get a write-combining handle for the calling producer thread.
+     * 
+     * @param max_delay The longest an element may sit in the handle before
+     * a push flushes it, 0 to only flush on a full batch. Checking it reads
+     * the steady clock on every push.
+     */
+    template <size_t batch_size = 16>
+    producer_handle<batch_size> make_producer_handle(
+        const std::chrono::nanoseconds max_delay = std::chrono::nanoseconds::zero())
+    {
+        return producer_handle<batch_size>(this, max_delay);
+    }
+
+    /**
+     * Get a read-ahead handle for the calling consumer thread.
+     */
+    template <size_t batch_size = 16>
+    consumer_handle<batch_size> make_consumer_handle()
+    {
+        return consumer_handle<batch_size>(this);
+    }
+
+    /**
+     * The consumer ticket is read first, so the result can't underflow even if
+     * both tickets move while they are being read.
+     * @note Calling this function will pull both ticket cache lines into this core!
+     * @returns How many elements are currently in the buffer.
+     */
+    uint_fast32_t size() const
+    {
+        const ticket_type consumer_ticket = cursors().consumer_ticket.load(std::memory_order_acquire);
+        const ticket_type producer_ticket = load_producer_ticket(std::memory_order_acquire);
+        const ticket_type count = producer_ticket - consumer_ticket;
+
+        return count > capacity() ? capacity() : static_cast<uint_fast32_t>(count);
+    }
+
+    /**
+     * @note Calling this function will pull both ticket cache lines into this core!
+     * @returns Whether or not the buffer is empty.
+     * @see empty_approx
+     */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /**
+     * @note Calling this function will pull both ticket cache lines into this core!
+     * @returns Whether or not the buffer is full.
+     * @see full_approx
+     */
+    bool full() const
+    {
+        return size() == capacity();
+    }
+
+    /**
+     * An eventually consistent size(), meant for monitoring threads that poll.
+     * It never reads the tickets, only the ticket hints, which each side
+     * republishes on their own cache lines every eighth of the capacity
+     * (every 64 tickets at most). Polling it therefore doesn't pull the
+     * ticket lines away from the producers & consumers.
+     * Each hint trails its ticket by fewer than that many tickets, plus
+     * whatever the thread due to publish it hasn't got to yet, e.g. because
+     * it was preempted. Once both sides are idle & their publishers have
+     * finished, the result is exact to within one hint interval.
+     * @returns Roughly how many elements are in the buffer, clamped to capacity().
+     */
+    uint_fast32_t size_approx() const
+    {
+        const ticket_type consumer_ticket =
+            cursors().consumer_hint.ticket.load(std::memory_order_relaxed);
+        const ticket_type producer_ticket =
+            cursors().producer_hint.ticket.load(std::memory_order_relaxed);
+        const ticket_difference difference =
+            static_cast<ticket_difference>(producer_ticket - consumer_ticket);
+
+        if (difference < 0)
+        {
+            return 0;
+        }
+
+        return static_cast<ticket_type>(difference) > capacity() ? capacity() :
+            static_cast<uint_fast32_t>(difference);
+    }
+
+    /**
+     * @returns Whether or not the buffer looks empty, with the staleness of
+     * size_approx.
+     */
+    bool empty_approx() const
+    {
+        return size_approx() == 0;
+    }
+
+    /**
+     * @returns Whether or not the buffer looks full, with the staleness of
+     * size_approx.
+     */
+    bool full_approx() const
+    {
+        return size_approx() == capacity();
+    }
+
+    /**
+     * @returns How many elements the buffer can hold, the requested size
+     * rounded up to the next power of two.
+     */
+    uint_fast32_t capacity() const
+    {
+        return circular_buffer_data_.index_mask + 1;
+    }
+
+    /**
+     * @returns The statistics kept by the stats policy, aggregated over
+     * every thread. Always zeroed with mpmc_no_stats.
+     */
+    mpmc_stats_snapshot snapshot() const
+    {
+        return stats().snapshot();
+    }
+
+    /**
+     * @returns The statistics the calling thread recorded, if the stats
+     * policy keeps them per thread, such as a consumer's own sojourn times.
+     */
+    mpmc_stats_snapshot thread_snapshot() const
+    {
+        return stats().thread_snapshot();
+    }
+    
+private:
+    stats_policy& stats()
+    {
+        return *this;
+    }
+
+    const stats_policy& stats() const
+    {
+        return *this;
+    }
+
+    /**
+     * @returns How many elements were in the buffer once the producer
+     * ticket reached end_ticket, as seen from the current consumer ticket.
+     */
+    uint64_t occupancy_at(const ticket_type end_ticket) const
+    {
+        const ticket_difference difference = static_cast<ticket_difference>(
+            end_ticket - cursors().consumer_ticket.load(std::memory_order_relaxed));
+
+        return difference < 0 ? 0 : static_cast<uint64_t>(difference);
+    }
+
+    buffer_node& get_node(const ticket_type ticket)
+    {
+        return circular_buffer_data_.get_node(ticket);
+    }
+
+    template <typename... Args>
+    mpmc_result emplace_with(std::true_type /* nothrow constructible */, Args&&... args)
+    {
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        ticket_type ticket;
+        buffer_node* const node = claim_producer_node(ticket);
+
+        if (node == nullptr)
+        {
+            return reject_push();
+        }
+
+        // Set the data, then hand the node over to the consumer of this ticket.
+        node->set_data(std::forward<Args>(args)...);
+        publish_node(*node, ticket);
+        finish_push(ticket, 1, start_ticks);
+        
+        return mpmc_result::ok;
+    }
+
+    template <typename... Args>
+    mpmc_result emplace_with(std::false_type /* nothrow constructible */, Args&&... args)
+    {
+        if (is_closed())
+        {
+            return mpmc_result::closed;
+        }
+
+        T element(std::forward<Args>(args)...);
+        
+        return emplace_with(std::true_type{}, std::move(element));
+    }
+
+    template <typename ForwardIterator>
+    size_t push_bulk_with(std::true_type /* nothrow constructible */,
+        ForwardIterator first, ForwardIterator last)
+    {
+        const uint64_t start_ticks = stats_policy::enabled ? read_tsc() : 0;
+        const size_t count = static_cast<size_t>(std::distance(first, last));
+        ticket_type ticket;
+        const size_t claimed_count = claim_producer_run(ticket, count);
+
+        // Each node is published as soon as it's written, so consumers can
+        // start draining the front of the run while the rest is filled.
+        for (size_t i = 0; i < claimed_count; ++i, ++first)
+        {
+            buffer_node& node = get_node(ticket + i);
+
+            if (i + bulk_prefetch_distance < claimed_count)
+            {
+                PREFETCH_WRITE(&get_node(ticket + i + bulk_prefetch_distance));
+            }
+            
+            node.set_data(*first);
+            publish_node(node, ticket + i);
+        }
+
+        if (claimed_count > 0)
+        {
+            finish_push(ticket, claimed_count, start_ticks);
+        }
+        else if (count > 0)
+        {
+            reject_push();
+        }
+
+        return claimed_count;
+    }
+
+    template <typename ForwardIterator>
+    size_t push_bulk_with(std::false_type /* nothrow constructible */,
+        ForwardIterator first, ForwardIterator last)
+    {
+        size_t pushed_count = 0;
+
+        for (; first != last && try_emplace(*first); ++first)
+        {
+            ++pushed_count;
+        }
+
+        return pushed_count;
+    }
+
+    /**
+     * Claim the next producer ticket, if the node it maps to is free.
+     * 
+     * @param out_ticket Set to the claimed ticket.
+     * @returns The node to construct the element in, or nullptr if the buffer is full.
+     */
+    buffer_node* claim_producer_node(ticket_type& out_ticket)
+    {
+        if (!concurrency_mode::multi_producer)
+        {
+            return claim_single_producer_run(out_ticket, 1) ? &get_node(out_ticket) : nullptr;
+        }
+        
+        ticket_type ticket = cursors().producer_ticket.load(std::memory_order_relaxed);
+        backoff_policy backoff;
+
+        // An infinite while-loop is used instead of a do-while, to avoid
+        // the yield/pause happening before the CAS operation.
+        while(true)
+        {
+            if ((ticket & closed_bit) != 0)
+            {
+                return nullptr;
+            }
+
+            buffer_node& node = get_node(ticket);
+            const ticket_difference difference = static_cast<ticket_difference>(
+                node.sequence.load(std::memory_order_acquire) - ticket);
+
+            if (difference == 0)
+            {
+                // The node is free for this ticket, so try to claim the ticket.
+                // On failure the CAS reloads the ticket for the next attempt.
+                if (cursors().producer_ticket.compare_exchange_weak(ticket, ticket + 1,
+                    std::memory_order_relaxed, std::memory_order_relaxed))
+                {
+                    out_ticket = ticket;
+                    return &node;
+                }
+
+                stats().record_push_cas_failure();
+            }
+            else if (difference < 0)
+            {
+                // The node still holds the element from the previous lap,
+                // so the buffer is full.
+                return nullptr;
+            }
+            else
+            {
+                // Another producer claimed this ticket before we got to it.
+                ticket = cursors().producer_ticket.load(std::memory_order_relaxed);
+            }
+
+            stats().record_push_retry();
+            backoff();
+        }
+    }
+
+    /**
+     * Claim the next consumer ticket, if the node it maps to has been published.
+     * 
+     * @param out_ticket Set to the claimed ticket.
+     * @returns The node holding the element, or nullptr if the buffer is empty.
+     */
+    buffer_node* claim_consumer_node(ticket_type& out_ticket)
+    {
+        if (!concurrency_mode::multi_consumer)
+        {
+            return claim_single_consumer_run(out_ticket, 1) ? &get_node(out_ticket) : nullptr;
+        }
+        
+        ticket_type ticket = cursors().consumer_ticket.load(std::memory_order_relaxed);
+        backoff_policy backoff;
+
+        while(true)
+        {
+            buffer_node& node = get_node(ticket);
+            const ticket_difference difference = static_cast<ticket_difference>(
+                node.sequence.load(std::memory_order_acquire) - (ticket + 1));
+
+            if (difference == 0)
+            {
+                if (cursors().consumer_ticket.compare_exchange_weak(ticket, ticket + 1,
+                    std::memory_order_relaxed, std::memory_order_relaxed))
+                {
+                    out_ticket = ticket;
+                    return &node;
+                }
+
+                stats().record_pop_cas_failure();
+            }
+            else if (difference < 0)
+            {
+                // empty check, nothing has been published for this ticket yet.
+                return nullptr;
+            }
+            else
+            {
+                ticket = cursors().consumer_ticket.load(std::memory_order_relaxed);
+            }
+            
+            stats().record_pop_retry();
+            backoff();
+        }
+    }
+
+    /**
+     * Claim a run of consecutive producer tickets whose nodes are all free.
+     * The run stops at the first node that isn't free, so it may be shorter
+     * than max_count.
+     * 
+     * @param out_ticket Set to the first claimed ticket.
+     * @param max_count The most tickets to claim.
+     * @returns How many tickets were claimed, or 0 if the buffer is full.
+     */
+    size_t claim_producer_run(ticket_type& out_ticket, size_t max_count)
+    {
+        if (max_count > capacity())
+        {
+            max_count = capacity();
+        }
+
+        if (!concurrency_mode::multi_producer)
+        {
+            return claim_single_producer_run(out_ticket, max_count);
+        }
+        
+        ticket_type ticket = cursors().producer_ticket.load(std::memory_order_relaxed);
+        backoff_policy backoff;
+
+        while(max_count > 0 && (ticket & closed_bit) == 0)
+        {
+            const ticket_difference difference = static_cast<ticket_difference>(
+                get_node(ticket).sequence.load(std::memory_order_acquire) - ticket);
+
+            if (difference == 0)
+            {
+                size_t run_count = 1;
+
+                while (run_count < max_count &&
+                    get_node(ticket + run_count).sequence.load(std::memory_order_acquire)
+                        == ticket + run_count)
+                {
+                    ++run_count;
+                }
+
+                if (cursors().producer_ticket.compare_exchange_weak(ticket, ticket + run_count,
+                    std::memory_order_relaxed, std::memory_order_relaxed))
+                {
+                    out_ticket = ticket;
+                    return run_count;
+                }
+
+                stats().record_push_cas_failure();
+            }
+            else if (difference < 0)
+            {
+                return 0;
+            }
+            else
+            {
+                ticket = cursors().producer_ticket.load(std::memory_order_relaxed);
+            }
+
+            stats().record_push_retry();
+            backoff();
+        }
+
+        return 0;
+    }
 
-/**
- * Lockless, Multi-Producer, Multi-Consumer, Bounded Circular Queue type.
- * The type is intended to be light weight & portable.
- * The sub-types are all padded to fit within cache lines. Padding may be put
- * inbetween member variables if the variables are accessed seperatley.
- */
-template <typename T, uint_least32_t queue_size, bool should_yield_not_pause = false>
-class bounded_circular_mpmc_queue final
-{
     /**
-     * Simple, efficient spin-lock implementation.
-     * A function that takes a void lambda function can be used to
-     * conveiniently do something which will be protected by the lock.
-     * @cite Credit to Erik Rigtorp https://rigtorp.se/spinlock/
+     * Claim a run of consecutive consumer tickets whose nodes have all been
+     * published. The run stops at the first node that isn't published yet,
+     * so it may be shorter than max_count.
+     * 
+     * @param out_ticket Set to the first claimed ticket.
+     * @param max_count The most tickets to claim.
+     * @returns How many tickets were claimed, or 0 if the buffer is empty.
      */
-    class spin_lock
+    size_t claim_consumer_run(ticket_type& out_ticket, size_t max_count)
     {
-        std::atomic<bool> lock_flag;
-        
-    public:
-        spin_lock()
-            : lock_flag{false}
+        if (max_count > capacity())
         {
+            max_count = capacity();
         }
 
-        void do_work_through_lock(const std::function<void()> functor)
+        if (!concurrency_mode::multi_consumer)
         {
-            lock();
-            functor();
-            unlock();
+            return claim_single_consumer_run(out_ticket, max_count);
         }
         
-        void lock()
+        ticket_type ticket = cursors().consumer_ticket.load(std::memory_order_relaxed);
+        backoff_policy backoff;
+
+        while(max_count > 0)
         {
-            while (true)
+            const ticket_difference difference = static_cast<ticket_difference>(
+                get_node(ticket).sequence.load(std::memory_order_acquire) - (ticket + 1));
+
+            if (difference == 0)
             {
-                if (!lock_flag.exchange(true, std::memory_order_acquire))
+                size_t run_count = 1;
+
+                while (run_count < max_count &&
+                    get_node(ticket + run_count).sequence.load(std::memory_order_acquire)
+                        == ticket + run_count + 1)
                 {
-                    break;
+                    ++run_count;
                 }
 
-                while (lock_flag.load(std::memory_order_relaxed))
+                if (cursors().consumer_ticket.compare_exchange_weak(ticket, ticket + run_count,
+                    std::memory_order_relaxed, std::memory_order_relaxed))
                 {
-                    should_yield_not_pause ? std::this_thread::yield() : HARDWARE_PAUSE();
+                    out_ticket = ticket;
+                    return run_count;
                 }
+
+                stats().record_pop_cas_failure();
+            }
+            else if (difference < 0)
+            {
+                return 0;
             }
+            else
+            {
+                ticket = cursors().consumer_ticket.load(std::memory_order_relaxed);
+            }
+
+            stats().record_pop_retry();
+            backoff();
+        }
+
+        return 0;
+    }
+
+    /**
+     * Claim a run of producer tickets without a CAS, for when this thread is
+     * the only producer. With a single consumer as well, only the cached copy
+     * of the consumer ticket is checked, and the consumer ticket is only
+     * reloaded once the cached copy says the buffer is full (as in folly's
+     * ProducerConsumerQueue). Otherwise the node sequences are checked as usual.
+     */
+    size_t claim_single_producer_run(ticket_type& out_ticket, const size_t max_count)
+    {
+        const ticket_type ticket = cursors().producer_ticket.load(std::memory_order_relaxed);
+        size_t run_count = 0;
+
+        if ((ticket & closed_bit) != 0)
+        {
+            return 0;
         }
+        
+        if (!concurrency_mode::multi_consumer)
+        {
+            if (capacity() - (ticket - cursors().cached_consumer_ticket) < max_count)
+            {
+                cursors().cached_consumer_ticket = cursors().consumer_ticket.load(std::memory_order_acquire);
+            }
 
-        void unlock()
+            const size_t free_count = static_cast<size_t>(
+                capacity() - (ticket - cursors().cached_consumer_ticket));
+            run_count = free_count < max_count ? free_count : max_count;
+        }
+        else
         {
-            lock_flag.store(false, std::memory_order_release);
+            while (run_count < max_count &&
+                get_node(ticket + run_count).sequence.load(std::memory_order_acquire)
+                    == ticket + run_count)
+            {
+                ++run_count;
+            }
+
+            // Nobody else moves the ticket, but close() may set the closed
+            // bit at any time, and a plain store would clear it again.
+            if (run_count > 0)
+            {
+                cursors().producer_ticket.fetch_add(run_count, std::memory_order_relaxed);
+            }
         }
-    };
+
+        out_ticket = ticket;
+        return run_count;
+    }
 
     /**
-     * Structure that holds the two cursors.
-     * The cursors are held together because we'll only ever be accessing
-     * them both at the same time.
-     * We don't directly align the struct because we need to use it as an
-     * atomic variable, so we must align the atomic variable instead.
+     * Claim a run of consumer tickets without a CAS, for when this thread is
+     * the only consumer. The mirror image of claim_single_producer_run.
      */
-    struct cursor_data
+    size_t claim_single_consumer_run(ticket_type& out_ticket, const size_t max_count)
     {
-        uint_fast32_t producer_cursor;
-        uint_fast32_t consumer_cursor;
-        uint8_t padding_bytes[CACHE_LINE_SIZE -
-            sizeof(uint_fast32_t) -
-            sizeof(uint_fast32_t)
-            % CACHE_LINE_SIZE];
+        const ticket_type ticket = cursors().consumer_ticket.load(std::memory_order_relaxed);
+        size_t run_count = 0;
+        
+        if (!concurrency_mode::multi_producer)
+        {
+            if (cursors().cached_producer_ticket - ticket < max_count)
+            {
+                cursors().cached_producer_ticket = load_producer_ticket(std::memory_order_acquire);
+            }
 
-        cursor_data(const uint_fast32_t in_producer_cursor = 0,
-            const uint_fast32_t in_consumer_cursor = 0)
-            : producer_cursor(in_producer_cursor),
-            consumer_cursor(in_consumer_cursor),
-            padding_bytes{0}
+            const size_t published_count = static_cast<size_t>(cursors().cached_producer_ticket - ticket);
+            run_count = published_count < max_count ? published_count : max_count;
+        }
+        else
         {
+            while (run_count < max_count &&
+                get_node(ticket + run_count).sequence.load(std::memory_order_acquire)
+                    == ticket + run_count + 1)
+            {
+                ++run_count;
+            }
+
+            cursors().consumer_ticket.store(ticket + run_count, std::memory_order_relaxed);
         }
-    };
+
+        out_ticket = ticket;
+        return run_count;
+    }
 
     /**
-     * Structure that represents each node in the circular buffer.
-     * Access to the data is protected by a spin lock.
-     * Contention on the spin lock should be minimal, as it's only there
-     * to prevent the case where a producer/consumer may try work with an element before
-     * someone else has finished working with it. The data and the spin lock are seperated by
-     * padding to put them in differnet cache lines, since they are not accessed
-     * together in the case mentioned previously. The problem with this is
-     * that in low contention cases, they will be accessed together, and thus
-     * should be in the same cache line.
+     * Hand a constructed node over to the consumer of its ticket.
+     * With a single producer & consumer the producer ticket itself is the
+     * publication, otherwise the node's sequence is.
      */
-    struct buffer_node
+    void publish_node(buffer_node& node, const ticket_type ticket)
     {
-        T data;
-        uint8_t padding_bytes_0[CACHE_LINE_SIZE -
-            sizeof(T) % CACHE_LINE_SIZE];
-        spin_lock spin_lock_;
-        uint8_t padding_bytes_1[CACHE_LINE_SIZE -
-            sizeof(spin_lock)
-            % CACHE_LINE_SIZE];
+        if (is_sojourn_traced(ticket))
+        {
+            enqueue_ticks_[ticket & circular_buffer_data_.index_mask] = read_tsc();
+        }
 
-        buffer_node()
-            : spin_lock_(),
-            padding_bytes_0{0},
-            padding_bytes_1{0}
+        if (!concurrency_mode::multi_producer && !concurrency_mode::multi_consumer)
+        {
+            // An add rather than a store, so a concurrent close() is kept.
+            cursors().producer_ticket.fetch_add(1, std::memory_order_release);
+        }
+        else
         {
+            node.sequence.store(ticket + 1, std::memory_order_release);
         }
+    }
 
-        void get_data(T& out_data) const
+    /**
+     * Hand an emptied node back to the producer of the next lap.
+     */
+    void release_node(buffer_node& node, const ticket_type ticket)
+    {
+        if (is_sojourn_traced(ticket))
         {
-            spin_lock_.do_work_through_lock([&]()
-            {
-                out_data = data;
-            });
+            record_sojourn(std::integral_constant<bool, sojourn_sample_rate != 0>{},
+                read_tsc() - enqueue_ticks_[ticket & circular_buffer_data_.index_mask]);
         }
 
-        void set_data(const T& in_data)
+        if (!concurrency_mode::multi_producer && !concurrency_mode::multi_consumer)
         {
-            spin_lock_.do_work_through_lock([&]()
-            {
-               data = in_data; 
-            });
+            cursors().consumer_ticket.store(ticket + 1, std::memory_order_release);
         }
-    };
+        else
+        {
+            node.sequence.store(ticket + capacity(), std::memory_order_release);
+        }
+    }
 
     /**
-     * Strucutre that contains the index mask, and the circular buffer.
-     * Both are accessed at the same time, so they are not seperated by padding.
+     * The timestamp of a traced ticket is written before its node is
+     * published & read before it's released, so the node's own handover
+     * orders them, & the timestamps need no atomics.
      */
-    struct alignas(CACHE_LINE_SIZE) circular_buffer_data
+    static bool is_sojourn_traced(const ticket_type ticket)
     {
-        const uint_fast32_t index_mask;
-        buffer_node* circular_buffer;
-        uint8_t padding_bytes[CACHE_LINE_SIZE -
-            sizeof(const uint_fast32_t) -
-            sizeof(buffer_node*)
-            % CACHE_LINE_SIZE];
+        return sojourn_sample_rate != 0 && (ticket & (sojourn_sample_rate - 1)) == 0;
+    }
 
-        circular_buffer_data()
-            : index_mask(get_next_power_of_two()),
-            padding_bytes{0}
-        {
-            static_assert(queue_size > 0, "Can't have a queue size <= 0!");
-            static_assert(queue_size <= 0xffffffffU,
-                "Can't have a queue length above 32bits!");
+    void record_sojourn(std::true_type /* traced */, const uint64_t ticks)
+    {
+        stats().record_sojourn(ticks);
+    }
 
-            /** Contigiously allocate the buffer.
-              * The theory behind using calloc and not aligned_alloc
-              * or equivelant, is that the memory should still be aligned,
-              * since calloc will align by the type size, which in this case
-              * is a multiple of the cache line size.
-             */
-            circular_buffer = (buffer_node*)calloc(
-                index_mask + 1, sizeof(buffer_node));
+    void record_sojourn(std::false_type /* traced */, uint64_t /* ticks */)
+    {
+    }
+
+    /**
+     * Move the element of a claimed node out through a pop_bulk iterator.
+     * Plain pointers go through get_data, so trivially copyable elements
+     * get its raw copy.
+     */
+    static void move_out(buffer_node& node, T* const out_data)
+    {
+        node.get_data(*out_data);
+    }
+
+    template <typename OutputIterator>
+    static void move_out(buffer_node& node, OutputIterator& out_data)
+    {
+        *out_data = std::move(node.data());
+        node.data().~T();
+    }
+
+    /**
+     * @returns The producer ticket, without the closed bit.
+     */
+    ticket_type load_producer_ticket(const std::memory_order order) const
+    {
+        return cursors().producer_ticket.load(order) & ~closed_bit;
+    }
+
+    /**
+     * Work out why a push claimed nothing.
+     */
+    mpmc_result reject_push()
+    {
+        if (is_closed())
+        {
+            return mpmc_result::closed;
         }
 
-        ~circular_buffer_data()
+        stats().record_full();
+        return mpmc_result::full;
+    }
+
+    /**
+     * Work out why a pop claimed nothing. The queue only counts as closed
+     * once no claimed ticket is left, so pushes that were in flight when it
+     * was closed still get drained.
+     */
+    mpmc_result reject_pop()
+    {
+        const ticket_type producer_ticket = cursors().producer_ticket.load(std::memory_order_acquire);
+
+        if ((producer_ticket & closed_bit) != 0 && (producer_ticket & ~closed_bit) ==
+            cursors().consumer_ticket.load(std::memory_order_acquire))
         {
-            if(circular_buffer != nullptr)
-            {
-                free(circular_buffer);
-            }
+            return mpmc_result::closed;
         }
-        
-    private:
-        /**
-         * @cite https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-         */
-        uint_least32_t get_next_power_of_two()
+
+        stats().record_empty();
+        return mpmc_result::empty;
+    }
+
+    /**
+     * Everything a push does once its run of nodes has been published:
+     * wake sleeping consumers, publish the ticket hint & record the stats.
+     */
+    void finish_push(const ticket_type ticket, const size_t count, const uint64_t start_ticks)
+    {
+        notify_waiters(cursors().not_empty);
+        publish_hint(cursors().producer_hint, ticket, count);
+
+        if (stats_policy::enabled)
         {
-            uint_least32_t v = queue_size;
+            stats().record_push(count, occupancy_at(ticket + count), read_tsc() - start_ticks);
+        }
+    }
 
-            v--;
-            v |= v >> 1;
-            v |= v >> 2;
-            v |= v >> 4;
-            v |= v >> 8;
-            v |= v >> 16;
-            v++;
-            
-            return v;
+    /**
+     * Everything a pop does once its run of nodes has been released.
+     */
+    void finish_pop(const ticket_type ticket, const size_t count, const uint64_t start_ticks)
+    {
+        notify_waiters(cursors().not_full);
+        publish_hint(cursors().consumer_hint, ticket, count);
+
+        if (stats_policy::enabled)
+        {
+            stats().record_pop(count, read_tsc() - start_ticks);
         }
-    };
-    
-public:
-    bounded_circular_mpmc_queue()
-        : cursor_data_(cursor_data{}),
-        circular_buffer_data_()
+    }
+
+    /**
+     * Publish the end of a claimed run of tickets to the side's hint, if the
+     * run crossed a hint interval boundary. Only moves the hint forwards, in
+     * case the publisher of an earlier boundary was preempted.
+     */
+    void publish_hint(ticket_hint& hint, const ticket_type ticket, const size_t count)
     {
+        const ticket_type end_ticket = ticket + count;
+        const ticket_type boundary_mask = ~static_cast<ticket_type>(circular_buffer_data_.hint_mask);
+
+        if ((ticket & boundary_mask) == (end_ticket & boundary_mask))
+        {
+            return;
+        }
+
+        ticket_type current = hint.ticket.load(std::memory_order_relaxed);
+
+        while (static_cast<ticket_difference>(end_ticket - current) > 0 &&
+            !hint.ticket.compare_exchange_weak(current, end_ticket,
+                std::memory_order_relaxed, std::memory_order_relaxed))
+        {
+        }
     }
 
     /**
-     * Push an element into the queue.
-     * 
-     * @param in_data Reference to the variable containg the data to be pushed.
-     * @returns Returns false only if the buffer is full.
+     * Wake the threads sleeping on state, if there are any.
+     * The fence pairs with the one in sleep_until: either the waiter sees the
+     * node that was just published/released, or we see the waiter.
+     * Nobody ever sleeps without mpmc_sleep_wait, so this compiles away.
      */
-    bool push(const T& in_data)
+    void notify_waiters(wait_state& state)
     {
-        cursor_data current_cursor_data;
+        if (!wait_policy::enabled)
+        {
+            return;
+        }
 
-        // An infinite while-loop is used instead of a do-while, to avoid
-        // the yield/pause happening before the CAS operation.
-        while(true)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        
+        if (state.waiter_count.load(std::memory_order_relaxed) != 0)
         {
-            current_cursor_data = cursor_data_.load(std::memory_order_acquire);
+            state.epoch.fetch_add(1, std::memory_order_release);
+            wake_all_on_address(state.epoch, cursor_storage::is_process_shared);
+        }
+    }
+
+    /**
+     * Whether a blocking operation is done with the result of an attempt.
+     */
+    static bool is_final_result(const mpmc_result result)
+    {
+        return result == mpmc_result::ok || result == mpmc_result::closed;
+    }
+
+    /**
+     * Retry try_operation until it returns ok or closed, or the deadline passes.
+     * The wait escalates from spinning, to yielding, to sleeping on the
+     * epoch of state if the wait policy allows it.
+     */
+    template <typename Clock, typename Duration, typename try_function>
+    mpmc_result wait_until(wait_state& state,
+        const std::chrono::time_point<Clock, Duration>& deadline, try_function&& try_operation)
+    {
+        mpmc_result result;
 
-            // Check if the buffer is full..
-            if (current_cursor_data.producer_cursor + 1 == current_cursor_data.consumer_cursor)
+        for (uint_fast32_t i = 0; i < wait_spin_count; ++i)
+        {
+            if (is_final_result(result = try_operation()))
             {
-                return false;
+                return result;
             }
 
-            // CAS operation used to make sure the cursors have not been incremented
-            // by another producer/consumer before we got to this point, and to then increment
-            // the cursor by 1 if it hasn't been changed.
-            if (cursor_data_.compare_exchange_weak(current_cursor_data,
-            {current_cursor_data.producer_cursor + 1,
-                current_cursor_data.consumer_cursor},
-            std::memory_order_release, std::memory_order_relaxed))
+            HARDWARE_PAUSE();
+        }
+
+        for (uint_fast32_t i = 0; i < wait_yield_count; ++i)
+        {
+            if (is_final_result(result = try_operation()))
             {
-                break;
+                return result;
             }
 
-            should_yield_not_pause ? std::this_thread::yield() : HARDWARE_PAUSE();
+            std::this_thread::yield();
         }
 
-        // Set the data
-        circular_buffer_data_.circular_buffer[
-            current_cursor_data.producer_cursor & circular_buffer_data_.index_mask
-            ].set_data(in_data);
-        
-        return true;
+        return sleep_until(state, deadline, try_operation,
+            std::integral_constant<bool, wait_policy::enabled>{});
     }
 
     /**
-     * Pop an element from the queue.
-     * 
-     * @param out_data Reference to the variable that will store the popped element.
-     * @returns Returns false only if the buffer is empty.
+     * Without sleeping, keep yielding between attempts until the deadline.
      */
-    bool pop(T& out_data)
+    template <typename Clock, typename Duration, typename try_function>
+    mpmc_result sleep_until(wait_state& /* state */,
+        const std::chrono::time_point<Clock, Duration>& deadline, try_function& try_operation,
+        std::false_type /* can sleep */)
     {
-        cursor_data current_cursor_data;
-
         while(true)
         {
-            current_cursor_data = cursor_data_.load(std::memory_order_acquire);
+            const mpmc_result result = try_operation();
 
-            // empty check 
-            if (current_cursor_data.consumer_cursor == current_cursor_data.producer_cursor)
+            if (is_final_result(result))
             {
-                return false;
+                return result;
             }
 
-            if (cursor_data_.compare_exchange_weak(current_cursor_data,
-            {current_cursor_data.producer_cursor,
-                current_cursor_data.consumer_cursor + 1},
-                std::memory_order_release, std::memory_order_relaxed))
+            if (deadline != std::chrono::time_point<Clock, Duration>::max() &&
+                Clock::now() >= deadline)
             {
-                break;
+                return mpmc_result::timeout;
             }
-            
-            should_yield_not_pause ? std::this_thread::yield() : HARDWARE_PAUSE();
-        }
 
-        // get the data
-        circular_buffer_data_.circular_buffer[
-            current_cursor_data.consumer_cursor & circular_buffer_data_.index_mask
-            ].get_data(out_data);
-        
-        return true;
+            std::this_thread::yield();
+        }
     }
-    
+
     /**
-     * @note Calling this function will increase contention on the cursor data!
-     * @returns How many elements are currently in the buffer.
+     * Sleep on the epoch of state between attempts. A sleeper registers
+     * itself in the waiter count first, so the other side only makes a wake
+     * syscall when someone is asleep. close() wakes every sleeper, which
+     * then sees closed on its next attempt.
      */
-    uint_fast32_t size() const
+    template <typename Clock, typename Duration, typename try_function>
+    mpmc_result sleep_until(wait_state& state,
+        const std::chrono::time_point<Clock, Duration>& deadline, try_function& try_operation,
+        std::true_type /* can sleep */)
     {
-        const cursor_data cursors = cursor_data_.load(std::memory_order_acquire);
-        return cursors.producer_cursor - cursors.consumer_cursor;
+        mpmc_result result;
+
+        while(true)
+        {
+            state.waiter_count.fetch_add(1, std::memory_order_seq_cst);
+            const uint32_t epoch = state.epoch.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (is_final_result(result = try_operation()))
+            {
+                state.waiter_count.fetch_sub(1, std::memory_order_relaxed);
+                return result;
+            }
+
+            std::chrono::nanoseconds timeout(-1);
+
+            if (deadline != std::chrono::time_point<Clock, Duration>::max())
+            {
+                const typename Clock::time_point now = Clock::now();
+                
+                if (now >= deadline)
+                {
+                    state.waiter_count.fetch_sub(1, std::memory_order_relaxed);
+                    return mpmc_result::timeout;
+                }
+
+                timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+            }
+
+            if (&state == &cursors().not_full)
+            {
+                stats().record_push_sleep();
+            }
+            else
+            {
+                stats().record_pop_sleep();
+            }
+
+            wait_on_address(state.epoch, epoch, timeout, cursor_storage::is_process_shared);
+            state.waiter_count.fetch_sub(1, std::memory_order_relaxed);
+        }
     }
 
-    /**
-     * @note Calling this function will increase contention on the cursor data!
-     * @returns Whether or not the buffer is empty.
-     */
-    bool empty() const
+private:
+    ring_cursors& cursors()
     {
-        return size() == 0;
+        return cursor_storage_.get();
     }
 
-    /**
-     * @note Calling this function will increase contention on the cursor data!
-     * @returns Whether or not the buffer is full.
-     */
-    bool full() const
+    const ring_cursors& cursors() const
     {
-        return size() == circular_buffer_data_.index_mask + 1;
+        return cursor_storage_.get();
     }
-    
-private:
-    alignas(CACHE_LINE_SIZE) std::atomic<cursor_data> cursor_data_;
+
+    cursor_storage cursor_storage_;
     circular_buffer_data circular_buffer_data_;
+    // When each traced ticket was published, indexed like the nodes.
+    // Only allocated when the stats policy traces sojourn times.
+    uint64_t* enqueue_ticks_;
     
 private:
-    bounded_circular_mpmc_queue(
-        const bounded_circular_mpmc_queue&) = delete;
-    bounded_circular_mpmc_queue& operator=(
-        const bounded_circular_mpmc_queue&) = delete;
+    basic_circular_mpmc_queue(
+        const basic_circular_mpmc_queue&) = delete;
+    basic_circular_mpmc_queue& operator=(
+        const basic_circular_mpmc_queue&) = delete;
+};
+
+} // namespace mpmc_detail
+
+/**
+ * Lockless, Multi-Producer, Multi-Consumer, Bounded Circular Queue type.
+ * The capacity is fixed at compile time, queue_size rounded up to the next
+ * power of two.
+ */
+template <typename T, uint_least32_t queue_size, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout, typename concurrency_mode = mpmc_mode_mpmc,
+    typename stats_policy = mpmc_no_stats, typename wait_policy = mpmc_no_wait>
+class bounded_circular_mpmc_queue final
+    : public mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy,
+        slot_layout, mpmc_aligned_allocator, concurrency_mode, stats_policy, wait_policy>
+{
+    static_assert(queue_size > 0, "Can't have a queue size <= 0!");
+    static_assert(queue_size <= 0x80000000U,
+        "Can't have a queue length above 2^31!");
+    
+public:
+    bounded_circular_mpmc_queue()
+        : mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy,
+            slot_layout, mpmc_aligned_allocator, concurrency_mode, stats_policy, wait_policy>(
+                queue_size, mpmc_aligned_allocator())
+    {
+    }
+};
+
+/**
+ * Lockless, Multi-Producer, Multi-Consumer, Bounded Circular Queue type,
+ * whose capacity is picked at runtime. The buffer comes from the allocator
+ * policy, e.g. mpmc_huge_page_allocator or mpmc_numa_allocator.
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename allocator = mpmc_aligned_allocator,
+    typename concurrency_mode = mpmc_mode_mpmc,
+    typename stats_policy = mpmc_no_stats,
+    typename wait_policy = mpmc_no_wait>
+class dynamic_mpmc_queue final
+    : public mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy,
+        slot_layout, allocator, concurrency_mode, stats_policy, wait_policy>
+{
+public:
+    /**
+     * @param requested_size The desired capacity, rounded up to the next
+     * power of two. Throws std::length_error above 2^31.
+     * @param in_allocator The allocator that provides the buffer.
+     */
+    explicit dynamic_mpmc_queue(const uint_least32_t requested_size,
+        const allocator& in_allocator = allocator())
+        : mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy,
+            slot_layout, allocator, concurrency_mode, stats_policy, wait_policy>(
+                requested_size, in_allocator)
+    {
+    }
 };
 
 #endif
@@ -0,0 +1,555 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless NUMA Aware Hierarchical MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef NUMA_MPMC_QUEUE_H
+#define NUMA_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
+
+namespace mpmc_detail
+{
+
+/**
+ * The NUMA nodes of the machine, which CPUs belong to each, and how far
+ * apart they are. Read once from /sys/devices/system/node, so there's no
+ * dependency on libnuma or hwloc. Where that can't be read, including
+ * outside of Linux, the whole machine is one node that isn't bound to.
+ * A topology can also be laid out by hand, e.g. to run a layout of several
+ * nodes on a machine that only has one.
+ */
+class numa_topology final
+{
+public:
+    /**
+     * Lay a topology out by hand. Throws std::invalid_argument unless there
+     * is at least one node, and every table has an entry for every node.
+     *
+     * @param node_ids The id the OS gives each node, or -1 for a node whose
+     * memory isn't bound to any node.
+     * @param distances The distance from each node to every node, by node
+     * index, as in nodeN/distance.
+     * @param cpu_node_indices The node index of every CPU, indexed by CPU
+     * number. CPUs past its end are on node 0.
+     */
+    numa_topology(std::vector<int> node_ids, const std::vector<std::vector<int>>& distances,
+        std::vector<uint_least16_t> cpu_node_indices = std::vector<uint_least16_t>())
+        : node_ids_(std::move(node_ids))
+        , cpu_node_indices_(std::move(cpu_node_indices))
+    {
+        const size_t node_count = node_ids_.size();
+
+        if (node_count == 0 || node_count > UINT_LEAST16_MAX || distances.size() != node_count)
+        {
+            throw std::invalid_argument("Need a row of distances for every node!");
+        }
+
+        for (const std::vector<int>& row : distances)
+        {
+            if (row.size() != node_count)
+            {
+                throw std::invalid_argument("Need a distance to every node!");
+            }
+        }
+
+        for (const uint_least16_t index : cpu_node_indices_)
+        {
+            if (index >= node_count)
+            {
+                throw std::invalid_argument("A CPU can only be on one of the nodes!");
+            }
+        }
+
+        nodes_by_distance_.resize(node_count);
+
+        for (size_t index = 0; index < node_count; ++index)
+        {
+            order_by_distance(index, distances[index]);
+        }
+    }
+
+    /**
+     * @returns The topology of this machine, read on first use.
+     */
+    static const numa_topology& get()
+    {
+        static const numa_topology topology;
+        return topology;
+    }
+
+    size_t get_node_count() const
+    {
+        return node_ids_.size();
+    }
+
+    /**
+     * @returns The id the OS gives node index, e.g. for mpmc_numa_allocator,
+     * or -1 if the topology couldn't be read.
+     */
+    int get_node_id(const size_t index) const
+    {
+        return node_ids_[index];
+    }
+
+    /**
+     * @returns Every node index, nearest to node index first, starting
+     * with node index itself.
+     */
+    const std::vector<uint_least16_t>& get_nodes_by_distance(const size_t index) const
+    {
+        return nodes_by_distance_[index];
+    }
+
+    /**
+     * @returns The index of the node the calling thread is running on, or 0
+     * if the CPU can't be read.
+     */
+    size_t get_current_node_index() const
+    {
+#if defined(__linux__)
+        const int cpu = sched_getcpu();
+
+        if (cpu >= 0 && static_cast<size_t>(cpu) < cpu_node_indices_.size())
+        {
+            return cpu_node_indices_[cpu];
+        }
+#endif
+
+        return 0;
+    }
+
+private:
+    numa_topology()
+    {
+#if defined(__linux__)
+        char text[4096];
+
+        if (read_file("/sys/devices/system/node/online", text, sizeof(text)))
+        {
+            parse_list(text, [this](const int node_id)
+            {
+                node_ids_.push_back(node_id);
+            });
+        }
+
+        for (size_t index = 0; index < node_ids_.size(); ++index)
+        {
+            char path[64];
+
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                node_ids_[index]);
+
+            if (read_file(path, text, sizeof(text)))
+            {
+                parse_list(text, [this, index](const int cpu)
+                {
+                    if (static_cast<size_t>(cpu) >= cpu_node_indices_.size())
+                    {
+                        cpu_node_indices_.resize(cpu + 1, 0);
+                    }
+
+                    cpu_node_indices_[cpu] = static_cast<uint_least16_t>(index);
+                });
+            }
+        }
+#endif
+
+        if (node_ids_.empty())
+        {
+            node_ids_.push_back(-1);
+        }
+
+        read_distances();
+    }
+
+    /**
+     * Order every node's neighbours by the distances in nodeN/distance, which
+     * hold one distance for every online node, in the order of online.
+     * Without them, the nodes are taken in index order from each node on.
+     */
+    void read_distances()
+    {
+        const size_t node_count = node_ids_.size();
+
+        nodes_by_distance_.resize(node_count);
+
+        for (size_t index = 0; index < node_count; ++index)
+        {
+            std::vector<int> distances;
+
+#if defined(__linux__)
+            char path[64];
+            char text[4096];
+
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance",
+                node_ids_[index]);
+
+            if (node_ids_[index] >= 0 && read_file(path, text, sizeof(text)))
+            {
+                for (const char* cursor = text; *cursor != '\0';)
+                {
+                    char* end;
+                    const long distance = strtol(cursor, &end, 10);
+
+                    if (end == cursor)
+                    {
+                        break;
+                    }
+
+                    distances.push_back(static_cast<int>(distance));
+                    cursor = end;
+                }
+            }
+#endif
+
+            order_by_distance(index, distances);
+        }
+    }
+
+    /**
+     * Fill in the neighbours of node index, nearest first by distances,
+     * which hold one distance for every node, or in index order from node
+     * index on if they don't.
+     */
+    void order_by_distance(const size_t index, const std::vector<int>& distances)
+    {
+        const size_t node_count = node_ids_.size();
+        std::vector<uint_least16_t>& order = nodes_by_distance_[index];
+
+        for (size_t i = 0; i < node_count; ++i)
+        {
+            order.push_back(static_cast<uint_least16_t>((index + i) % node_count));
+        }
+
+        if (distances.size() == node_count)
+        {
+            std::stable_sort(order.begin() + 1, order.end(),
+                [&distances](const uint_least16_t a, const uint_least16_t b)
+            {
+                return distances[a] < distances[b];
+            });
+        }
+    }
+
+#if defined(__linux__)
+    static bool read_file(const char* const path, char* const text, const size_t size)
+    {
+        FILE* const file = fopen(path, "r");
+
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        const size_t length = fread(text, 1, size - 1, file);
+        fclose(file);
+
+        text[length] = '\0';
+        return length > 0;
+    }
+
+    /**
+     * Call callback with every number in a sysfs list, such as "0-3,8,10-11".
+     */
+    template <typename callback_type>
+    static void parse_list(const char* cursor, callback_type&& callback)
+    {
+        while (*cursor >= '0' && *cursor <= '9')
+        {
+            char* end;
+            const long first = strtol(cursor, &end, 10);
+            long last = first;
+
+            if (*end == '-')
+            {
+                last = strtol(end + 1, &end, 10);
+            }
+
+            for (long value = first; value <= last; ++value)
+            {
+                callback(static_cast<int>(value));
+            }
+
+            cursor = *end == ',' ? end + 1 : end;
+        }
+    }
+#endif
+
+    std::vector<int> node_ids_;
+    // The node index of every CPU, indexed by CPU number.
+    std::vector<uint_least16_t> cpu_node_indices_;
+    std::vector<std::vector<uint_least16_t>> nodes_by_distance_;
+
+private:
+    numa_topology(const numa_topology&) = delete;
+    numa_topology& operator=(const numa_topology&) = delete;
+};
+
+} // namespace mpmc_detail
+
+/**
+ * One ring per NUMA node, so threads on different sockets never share a
+ * cursor's cache line. Each ring, its cursors included, lives in pages
+ * bound to its own node.
+ *
+ * push & pop go to the ring of the node the calling thread is running on.
+ * A push that finds it full spills over into the other nodes' rings, and a
+ * pop that finds it empty steals from them, nearest node first, by the
+ * distances the OS reports. Elements are only FIFO per ring, & a thread may
+ * move between nodes at any time, so for a FIFO order per node, push &
+ * pop through push_to & pop_from with the same node index, which neither
+ * spill nor steal.
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class numa_mpmc_queue final
+{
+    static_assert(concurrency_mode::multi_producer && concurrency_mode::multi_consumer,
+        "Every thread on a node shares its ring, so it needs multiple producers & consumers!");
+
+    typedef dynamic_mpmc_queue<T, backoff_policy, slot_layout, mpmc_numa_allocator,
+        concurrency_mode> ring_type;
+
+public:
+    /**
+     * @param requested_node_size The capacity of each node's ring, rounded
+     * up to the next power of two. Throws std::length_error above 2^31.
+     * @param topology The nodes to make rings for, which must outlive the queue.
+     */
+    explicit numa_mpmc_queue(const uint_least32_t requested_node_size,
+        const mpmc_detail::numa_topology& topology = mpmc_detail::numa_topology::get())
+        : topology_(topology)
+    {
+        rings_.reserve(topology_.get_node_count());
+
+        try
+        {
+            for (size_t index = 0; index < topology_.get_node_count(); ++index)
+            {
+                const mpmc_numa_allocator node_allocator(topology_.get_node_id(index));
+                void* const memory = node_allocator.allocate(sizeof(ring_type), alignof(ring_type));
+
+                try
+                {
+                    rings_.push_back(new (memory) ring_type(requested_node_size, node_allocator));
+                }
+                catch (...)
+                {
+                    node_allocator.deallocate(memory, sizeof(ring_type));
+                    throw;
+                }
+            }
+        }
+        catch (...)
+        {
+            destroy_rings();
+            throw;
+        }
+    }
+
+    ~numa_mpmc_queue()
+    {
+        destroy_rings();
+    }
+
+    /**
+     * Push an element into the ring of the calling thread's node, or into
+     * the nearest node's ring with space if that one is full.
+     *
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if every ring is full.
+     */
+    bool push(const T& in_data)
+    {
+        return try_emplace(in_data);
+    }
+
+    /**
+     * push, moving the element into the ring.
+     *
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if every ring is full.
+     */
+    bool push(T&& in_data)
+    {
+        return try_emplace(std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place in the ring of the calling thread's
+     * node, or in the nearest node's ring with space if that one is full.
+     *
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if every ring is full.
+     */
+    template <typename... Args>
+    bool try_emplace(Args&&... args)
+    {
+        return emplace_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T, Args&&...>::value>{},
+            std::forward<Args>(args)...);
+    }
+
+    /**
+     * Pop an element from the ring of the calling thread's node, or steal
+     * one from the nearest node's ring that isn't empty.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if every ring is empty.
+     */
+    bool pop(T& out_data)
+    {
+        for (const uint_least16_t index :
+            topology_.get_nodes_by_distance(topology_.get_current_node_index()))
+        {
+            if (rings_[index]->pop(out_data))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Push an element into one node's ring only, keeping it FIFO with the
+     * other elements pushed there.
+     *
+     * @param node_index The node, must be below get_node_count().
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if that ring is full.
+     */
+    bool push_to(const size_t node_index, const T& in_data)
+    {
+        return rings_[node_index]->push(in_data);
+    }
+
+    /**
+     * push_to, moving the element into the ring.
+     *
+     * @param node_index The node, must be below get_node_count().
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if that ring is full.
+     */
+    bool push_to(const size_t node_index, T&& in_data)
+    {
+        return rings_[node_index]->push(std::move(in_data));
+    }
+
+    /**
+     * Pop an element from one node's ring only, in FIFO order.
+     *
+     * @param node_index The node, must be below get_node_count().
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if that ring is empty.
+     */
+    bool pop_from(const size_t node_index, T& out_data)
+    {
+        return rings_[node_index]->pop(out_data);
+    }
+
+    /**
+     * Direct access to one node's ring, e.g. for its bulk or blocking operations.
+     *
+     * @param node_index The node, must be below get_node_count().
+     */
+    ring_type& get_ring(const size_t node_index)
+    {
+        return *rings_[node_index];
+    }
+
+    /**
+     * @returns The index of the node the calling thread is running on.
+     */
+    size_t get_current_node_index() const
+    {
+        return topology_.get_current_node_index();
+    }
+
+    size_t get_node_count() const
+    {
+        return rings_.size();
+    }
+
+    /**
+     * @returns The approximate number of elements over every ring, read
+     * from the ticket hints so polling it doesn't slow the rings down.
+     */
+    size_t size_approx() const
+    {
+        size_t size = 0;
+
+        for (const ring_type* const ring : rings_)
+        {
+            size += ring->size_approx();
+        }
+
+        return size;
+    }
+
+    size_t capacity() const
+    {
+        return rings_.empty() ? 0 : rings_[0]->capacity() * rings_.size();
+    }
+
+private:
+    template <typename... Args>
+    bool emplace_with(std::true_type /* nothrow constructible */, Args&&... args)
+    {
+        for (const uint_least16_t index :
+            topology_.get_nodes_by_distance(topology_.get_current_node_index()))
+        {
+            // A full ring constructs nothing, so args are still whole for the next.
+            if (rings_[index]->try_emplace(std::forward<Args>(args)...))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template <typename... Args>
+    bool emplace_with(std::false_type /* nothrow constructible */, Args&&... args)
+    {
+        // A ring would construct it before finding out it's full, which
+        // would use up args, so it's constructed once up front instead.
+        T element(std::forward<Args>(args)...);
+
+        return emplace_with(std::true_type{}, std::move(element));
+    }
+
+    void destroy_rings()
+    {
+        while (!rings_.empty())
+        {
+            ring_type* const ring = rings_.back();
+            const mpmc_numa_allocator node_allocator(
+                topology_.get_node_id(rings_.size() - 1));
+
+            rings_.pop_back();
+            ring->~ring_type();
+            node_allocator.deallocate(ring, sizeof(ring_type));
+        }
+    }
+
+    const mpmc_detail::numa_topology& topology_;
+    std::vector<ring_type*> rings_;
+
+private:
+    numa_mpmc_queue(const numa_mpmc_queue&) = delete;
+    numa_mpmc_queue& operator=(const numa_mpmc_queue&) = delete;
+};
+
+#endif
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Bounded MPMC Object Pool type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef MPMC_OBJECT_POOL_H
+#define MPMC_OBJECT_POOL_H
+
+#include "LocklessMPMCQueue.h"
+
+#include <memory>
+
+/**
+ * pool_size objects preallocated in one arena, handed out by acquire() &
+ * taken back by release() from any thread, without ever touching the
+ * system allocator after construction. The free objects are tracked as
+ * indices in a ring of the same kind the queues use, so acquiring &
+ * releasing cost one pop & one push on it. Paired with a queue of T*, this
+ * passes messages with no allocation at all.
+ *
+ * The object layout policy pads each object the way it pads a node, so the
+ * default mpmc_cache_line_layout keeps objects used by different threads off
+ * each other's cache lines, and mpmc_packed_layout packs them tightly.
+ * Freed objects are reused in FIFO order, and every object must be
+ * released before the pool is destroyed.
+ */
+template <typename T, uint_least32_t pool_size,
+    typename backoff_policy = mpmc_pause_backoff,
+    typename object_layout = mpmc_cache_line_layout,
+    typename allocator = mpmc_aligned_allocator>
+class mpmc_object_pool final
+{
+    static_assert(pool_size > 0, "Can't have a pool size <= 0!");
+    static_assert(pool_size <= 0x80000000U, "Can't have a pool size above 2^31!");
+
+    typedef typename object_layout::template node_rules<sizeof(T), alignof(T)> object_rules;
+
+    /**
+     * The storage of one object, padded by the object layout.
+     */
+    struct alignas(object_rules::alignment) object_slot
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    typedef bounded_circular_mpmc_queue<uint_least32_t, pool_size, backoff_policy,
+        mpmc_auto_layout> index_queue;
+
+public:
+    /**
+     * Hands an object back to its pool, for std::unique_ptr.
+     */
+    class deleter
+    {
+    public:
+        explicit deleter(mpmc_object_pool* const in_pool = nullptr)
+            : pool_(in_pool)
+        {
+        }
+
+        void operator()(T* const object) const
+        {
+            pool_->release(object);
+        }
+
+    private:
+        mpmc_object_pool* pool_;
+    };
+
+    typedef std::unique_ptr<T, deleter> unique_ptr;
+
+    /**
+     * @param in_allocator The allocator that provides the arena.
+     */
+    explicit mpmc_object_pool(const allocator& in_allocator = allocator())
+        : arena_allocator_(in_allocator),
+        arena_(static_cast<object_slot*>(arena_allocator_.allocate(
+            pool_size * sizeof(object_slot), alignof(object_slot))))
+    {
+        uint_least32_t indices[64];
+
+        for (uint_least32_t first = 0; first < pool_size; first += 64)
+        {
+            const uint_least32_t count = pool_size - first < 64 ? pool_size - first : 64;
+
+            for (uint_least32_t i = 0; i < count; ++i)
+            {
+                indices[i] = first + i;
+            }
+
+            free_indices_.push_bulk(indices, count);
+        }
+    }
+
+    ~mpmc_object_pool()
+    {
+        arena_allocator_.deallocate(arena_, pool_size * sizeof(object_slot));
+    }
+
+    /**
+     * Take a free object, & construct it in place.
+     *
+     * @param args Arguments forwarded to the constructor of T. If it throws,
+     * the object goes back to the pool & the exception is rethrown.
+     * @returns The object, or nullptr only if every object is in use.
+     */
+    template <typename... Args>
+    T* acquire(Args&&... args)
+    {
+        uint_least32_t index;
+
+        if (!free_indices_.pop(index))
+        {
+            return nullptr;
+        }
+
+        try
+        {
+            return new (&arena_[index].storage) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            free_indices_.push(index);
+            throw;
+        }
+    }
+
+    /**
+     * acquire, with the object owned by a std::unique_ptr that releases it.
+     *
+     * @returns The object, or an empty pointer only if every object is in use.
+     */
+    template <typename... Args>
+    unique_ptr acquire_unique(Args&&... args)
+    {
+        return unique_ptr(acquire(std::forward<Args>(args)...), deleter(this));
+    }
+
+    /**
+     * Destroy an object & hand it back to the pool. Any thread may release
+     * an object, not just the one that acquired it.
+     *
+     * @param object An object acquired from this pool, or nullptr.
+     */
+    void release(T* const object)
+    {
+        if (object == nullptr)
+        {
+            return;
+        }
+
+        object->~T();
+
+        // The ring holds at least pool_size indices, so this always fits.
+        free_indices_.push(get_index(object));
+    }
+
+    /**
+     * @returns Whether object lives in this pool's arena.
+     */
+    bool owns(const T* const object) const
+    {
+        const char* const address = reinterpret_cast<const char*>(object);
+        const char* const first = reinterpret_cast<const char*>(arena_);
+
+        return address >= first && address < first + pool_size * sizeof(object_slot);
+    }
+
+    /**
+     * @returns Roughly how many objects are free, read from the ticket hints.
+     */
+    size_t available_approx() const
+    {
+        return free_indices_.size_approx();
+    }
+
+    constexpr uint_least32_t capacity() const
+    {
+        return pool_size;
+    }
+
+private:
+    uint_least32_t get_index(const T* const object) const
+    {
+        return static_cast<uint_least32_t>(
+            (reinterpret_cast<const char*>(object) - reinterpret_cast<const char*>(arena_)) /
+            sizeof(object_slot));
+    }
+
+    allocator arena_allocator_;
+    object_slot* arena_;
+    index_queue free_indices_;
+
+private:
+    mpmc_object_pool(const mpmc_object_pool&) = delete;
+    mpmc_object_pool& operator=(const mpmc_object_pool&) = delete;
+};
+
+#endif
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Multi-Priority MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef PRIORITY_MPMC_QUEUE_H
+#define PRIORITY_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#include <cassert>
+
+/**
+ * Priority policies for multi_priority_mpmc_queue, which is privately
+ * derived from its policy, so a policy without state takes up no space.
+ * Each one picks the lane a pop starts looking from. The pop then takes
+ * the first non-empty lane from there on, or the highest non-empty lane if
+ * there is none, so the policy alone never makes a pop fail.
+ */
+
+/**
+ * Always pop from the highest priority non-empty lane. Lower lanes starve
+ * for as long as higher ones are kept busy. This is the default.
+ */
+struct mpmc_strict_priority
+{
+    template <size_t lane_count>
+    uint_fast32_t get_first_lane()
+    {
+        return 0;
+    }
+};
+
+/**
+ * Weighted round robin between the lanes, so no lane starves. Out of every
+ * sum(weights) pops a consumer starts weights[i] of them from lane i, one
+ * weight per lane, highest priority first. Each queue keeps every thread's
+ * place in its schedule in the stripe picked by mpmc_detail::thread_index(),
+ * so it costs no shared writes. With more than stripe_count threads some
+ * stripes are shared, which only blurs the schedules of those threads.
+ */
+template <uint_least32_t... weights>
+class mpmc_weighted_priority
+{
+public:
+    static constexpr size_t stripe_count = 64;
+
+    template <size_t lane_count>
+    uint_fast32_t get_first_lane()
+    {
+        static_assert(sizeof...(weights) == lane_count, "There must be one weight per lane!");
+
+        static constexpr uint_least32_t lane_weights[] = { weights... };
+        static_assert(get_min_weight(lane_weights, lane_count) >= 1,
+            "Every weight must be at least 1, or its lane would never be picked!");
+
+        // Only a thread sharing the stripe writes it too, so a plain load &
+        // store will do: losing a count only shifts one place in the schedule.
+        std::atomic<uint_fast64_t>& pop_count =
+            stripes_[mpmc_detail::thread_index() % stripe_count].pop_count;
+        const uint_fast64_t count = pop_count.load(std::memory_order_relaxed);
+
+        pop_count.store(count + 1, std::memory_order_relaxed);
+
+        uint_fast64_t position = count % get_total_weight(lane_weights, lane_count);
+        uint_fast32_t lane = 0;
+
+        while (position >= lane_weights[lane])
+        {
+            position -= lane_weights[lane];
+            ++lane;
+        }
+
+        return lane;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) stripe
+    {
+        stripe()
+            : pop_count(0)
+        {
+        }
+
+        std::atomic<uint_fast64_t> pop_count;
+    };
+
+    static constexpr uint_fast64_t get_total_weight(const uint_least32_t* const lane_weights,
+        const size_t lane_count)
+    {
+        return lane_count == 0 ? 0 : lane_weights[0] +
+            get_total_weight(lane_weights + 1, lane_count - 1);
+    }
+
+    static constexpr uint_least32_t get_min_weight(const uint_least32_t* const lane_weights,
+        const size_t lane_count)
+    {
+        return lane_count == 1 ? lane_weights[0] :
+            lane_weights[0] < get_min_weight(lane_weights + 1, lane_count - 1) ?
+            lane_weights[0] : get_min_weight(lane_weights + 1, lane_count - 1);
+    }
+
+    stripe stripes_[stripe_count];
+};
+
+/**
+ * lane_count rings of queue_size elements each, lane 0 having the highest
+ * priority. A shared bitmask tracks which lanes may hold elements, so a pop
+ * finds the lane it wants with a single load & a count of trailing zeros
+ * instead of polling every ring in turn.
+ *
+ * Producers only set their lane's bit when it's clear, so the mask's cache
+ * line stays shared while the lanes are busy. A consumer that finds a lane
+ * empty clears its bit, then checks the lane again in case a producer has
+ * just pushed to it. As with the rings, pop may fail while a producer that
+ * claimed a node hasn't published it yet.
+ */
+template <typename T, size_t lane_count, uint_least32_t queue_size,
+    typename priority_policy = mpmc_strict_priority,
+    typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class multi_priority_mpmc_queue final : private priority_policy
+{
+    static_assert(lane_count > 0, "Can't have a lane count <= 0!");
+    static_assert(lane_count <= 64, "Lanes are tracked in a 64 bit mask!");
+
+    typedef bounded_circular_mpmc_queue<T, queue_size, backoff_policy, slot_layout,
+        concurrency_mode> lane_type;
+
+public:
+    multi_priority_mpmc_queue()
+        : non_empty_mask_(0)
+    {
+    }
+
+    /**
+     * Push an element into a lane.
+     *
+     * @param lane The priority of the element, 0 being the highest.
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if that lane is full.
+     */
+    bool push(const size_t lane, const T& in_data)
+    {
+        return try_emplace(lane, in_data);
+    }
+
+    /**
+     * Push an element into a lane by moving it into the node.
+     *
+     * @param lane The priority of the element, 0 being the highest.
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if that lane is full.
+     */
+    bool push(const size_t lane, T&& in_data)
+    {
+        return try_emplace(lane, std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place at the back of a lane.
+     *
+     * @param lane The priority of the element, 0 being the highest.
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if that lane is full.
+     */
+    template <typename... Args>
+    bool try_emplace(const size_t lane, Args&&... args)
+    {
+        assert(lane < lane_count);
+
+        if (!lanes_[lane].try_emplace(std::forward<Args>(args)...))
+        {
+            return false;
+        }
+
+        const uint64_t lane_bit = uint64_t{1} << lane;
+
+        // Pairs with the fence in pop: either this load sees the bit a
+        // consumer just cleared, or that consumer sees this element.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if ((non_empty_mask_.load(std::memory_order_relaxed) & lane_bit) == 0)
+        {
+            non_empty_mask_.fetch_or(lane_bit, std::memory_order_release);
+        }
+
+        return true;
+    }
+
+    /**
+     * Pop an element from the lane picked by the priority policy.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if every lane is empty.
+     */
+    bool pop(T& out_data)
+    {
+        size_t lane = 0;
+
+        return pop(out_data, lane);
+    }
+
+    /**
+     * Pop an element from the lane picked by the priority policy.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @param out_lane The lane the element was popped from.
+     * @returns Returns false only if every lane is empty.
+     */
+    bool pop(T& out_data, size_t& out_lane)
+    {
+        const uint64_t later_lanes_mask = ~uint64_t{0} <<
+            priority_policy::template get_first_lane<lane_count>();
+        // Lanes already found empty by this pop, so a lane whose next element
+        // is claimed but not published yet doesn't hold up the others.
+        uint64_t tried_mask = 0;
+
+        while(true)
+        {
+            const uint64_t mask = non_empty_mask_.load(std::memory_order_acquire) & ~tried_mask;
+
+            if (mask == 0)
+            {
+                return false;
+            }
+
+            const uint_fast32_t lane = lowest_bit(
+                (mask & later_lanes_mask) != 0 ? mask & later_lanes_mask : mask);
+
+            if (lanes_[lane].pop(out_data))
+            {
+                out_lane = lane;
+                return true;
+            }
+
+            const uint64_t lane_bit = uint64_t{1} << lane;
+            tried_mask |= lane_bit;
+            non_empty_mask_.fetch_and(~lane_bit, std::memory_order_acq_rel);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!lanes_[lane].empty())
+            {
+                non_empty_mask_.fetch_or(lane_bit, std::memory_order_release);
+            }
+        }
+    }
+
+    /**
+     * Direct access to one lane, e.g. for its stats or approximate size.
+     * Pushing to or popping from it directly bypasses the mask, so only
+     * do so through this queue.
+     */
+    lane_type& get_lane(const size_t lane)
+    {
+        return lanes_[lane];
+    }
+
+    /**
+     * @returns The approximate number of elements over every lane, read
+     * from the ticket hints so polling it doesn't slow the lanes down.
+     */
+    size_t size_approx() const
+    {
+        size_t size = 0;
+
+        for (const lane_type& lane : lanes_)
+        {
+            size += lane.size_approx();
+        }
+
+        return size;
+    }
+
+    /**
+     * @returns Whether every lane looks empty, from the mask alone.
+     */
+    bool empty_approx() const
+    {
+        return non_empty_mask_.load(std::memory_order_relaxed) == 0;
+    }
+
+private:
+    static uint_fast32_t lowest_bit(const uint64_t mask)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<uint_fast32_t>(__builtin_ctzll(mask));
+#else
+        uint_fast32_t index = 0;
+
+        while ((mask & (uint64_t{1} << index)) == 0)
+        {
+            ++index;
+        }
+
+        return index;
+#endif
+    }
+
+    // Read by every pop & push, written only when a lane fills or drains.
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> non_empty_mask_;
+    lane_type lanes_[lane_count];
+
+private:
+    multi_priority_mpmc_queue(const multi_priority_mpmc_queue&) = delete;
+    multi_priority_mpmc_queue& operator=(const multi_priority_mpmc_queue&) = delete;
+};
+
+#endif
@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Request/Response Channel type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef RPC_CHANNEL_H
+#define RPC_CHANNEL_H
+
+#include "LocklessMPMCQueue.h"
+
+namespace mpmc_detail
+{
+    /**
+     * One call in flight: the request, the cell its reply is written into,
+     * and the completion word the caller waits on. It lives in a node of
+     * the channel's ring for the whole round trip.
+     */
+    template <typename request_type, typename response_type>
+    struct rpc_call
+    {
+        enum call_state : uint32_t
+        {
+            pending,
+            // The caller went to sleep, so completing needs a wake.
+            sleeping,
+            completed
+        };
+
+        rpc_call() noexcept
+            : ticket(0),
+            state(pending)
+        {
+        }
+
+        request_type request;
+        response_type response;
+        // Set by the server before completing, for the caller to release the node with.
+        ticket_type ticket;
+        std::atomic<uint32_t> state;
+    };
+}
+
+/**
+ * A request ring whose nodes each carry an inline reply cell, so a round
+ * trip needs neither a second queue nor a map to match replies to calls.
+ *
+ * A caller claims a node with try_call & fills in the request. A server
+ * takes it with try_receive, & respond() writes the reply into the same
+ * node & flags it complete, without releasing the node. The caller waits
+ * on its own node's flag, spinning, then yielding, then sleeping on a
+ * futex, reads the reply in place, & only then hands the node back to the
+ * callers of the next lap. The request & the reply share the node's cache
+ * lines, so there is no hand-off through a second ring.
+ *
+ * A call holds its node until the caller is done with the reply, so at most
+ * capacity() calls are in flight, & try_call fails once that many are. As
+ * with bounded_circular_mpmc_queue, that's channel_size rounded up to the
+ * next power of two.
+ */
+template <typename request_type, typename response_type, uint_least32_t channel_size,
+    typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class rpc_channel final
+{
+    static_assert(concurrency_mode::multi_producer || concurrency_mode::multi_consumer,
+        "Replies complete out of order, so a single caller & server won't do!");
+    static_assert(std::is_nothrow_default_constructible<request_type>::value &&
+        std::is_nothrow_move_assignable<request_type>::value,
+        "The request type must be nothrow default constructible & move assignable!");
+    static_assert(std::is_nothrow_default_constructible<response_type>::value &&
+        std::is_nothrow_move_assignable<response_type>::value,
+        "The response type must be nothrow default constructible & move assignable!");
+
+    typedef mpmc_detail::rpc_call<request_type, response_type> call_type;
+    typedef bounded_circular_mpmc_queue<call_type, channel_size, backoff_policy,
+        slot_layout, concurrency_mode> queue_type;
+
+    // How many times a waiting caller checks its reply, spinning then
+    // yielding, before sleeping.
+    static constexpr uint_fast32_t wait_spin_count = 256;
+    static constexpr uint_fast32_t wait_yield_count = 16;
+
+public:
+    rpc_channel() = default;
+
+    /**
+     * A call made by try_call, owning its node until it's released.
+     * The destructor waits for the reply first, since the node can't be
+     * handed back while a server may still write into it.
+     */
+    class pending_call
+    {
+    public:
+        pending_call(pending_call&& other) noexcept
+            : channel_(other.channel_),
+            call_(other.call_)
+        {
+            other.call_ = nullptr;
+        }
+
+        ~pending_call()
+        {
+            release();
+        }
+
+        /**
+         * @returns Whether the request was sent, false if the channel was full.
+         */
+        explicit operator bool() const
+        {
+            return call_ != nullptr;
+        }
+
+        /**
+         * @returns Whether the reply has arrived.
+         */
+        bool is_ready() const
+        {
+            return call_->state.load(std::memory_order_acquire) == call_type::completed;
+        }
+
+        /**
+         * Wait for the reply.
+         *
+         * @returns The reply, which lives in the node until release().
+         */
+        response_type& wait()
+        {
+            wait_until(std::chrono::steady_clock::time_point::max());
+            return call_->response;
+        }
+
+        /**
+         * Wait at most timeout for the reply.
+         *
+         * @returns Whether the reply arrived in time.
+         */
+        template <typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return wait_until(std::chrono::steady_clock::now() + timeout);
+        }
+
+        /**
+         * Wait until deadline at most for the reply.
+         *
+         * @returns Whether the reply arrived in time.
+         */
+        template <typename Clock, typename Duration>
+        bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline)
+        {
+            std::atomic<uint32_t>& state = call_->state;
+
+            for (uint_fast32_t i = 0; i < wait_spin_count; ++i)
+            {
+                if (is_ready())
+                {
+                    return true;
+                }
+
+                HARDWARE_PAUSE();
+            }
+
+            for (uint_fast32_t i = 0; i < wait_yield_count; ++i)
+            {
+                if (is_ready())
+                {
+                    return true;
+                }
+
+                std::this_thread::yield();
+            }
+
+            uint32_t expected = call_type::pending;
+
+            // Tell the server to wake us, unless it has just completed.
+            if (!state.compare_exchange_strong(expected, call_type::sleeping,
+                std::memory_order_acq_rel, std::memory_order_acquire) &&
+                expected == call_type::completed)
+            {
+                return true;
+            }
+
+            while (!is_ready())
+            {
+                const auto now = Clock::now();
+
+                if (now >= deadline)
+                {
+                    return false;
+                }
+
+                const std::chrono::nanoseconds timeout =
+                    deadline == std::chrono::time_point<Clock, Duration>::max() ?
+                    std::chrono::nanoseconds(-1) :
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+
+                mpmc_detail::wait_on_address(state, call_type::sleeping, timeout);
+            }
+
+            return true;
+        }
+
+        /**
+         * Wait for the reply if it hasn't arrived, then hand the node back.
+         * The reply can't be read after this. Does nothing if it has
+         * already been released, or nothing was sent.
+         */
+        void release()
+        {
+            if (call_ != nullptr)
+            {
+                wait();
+                channel_->queue_.release_detached(call_->ticket);
+                call_ = nullptr;
+            }
+        }
+
+    private:
+        friend class rpc_channel;
+
+        pending_call(rpc_channel* const channel, call_type* const call)
+            : channel_(channel),
+            call_(call)
+        {
+        }
+
+        pending_call(const pending_call&) = delete;
+        pending_call& operator=(const pending_call&) = delete;
+        pending_call& operator=(pending_call&&) = delete;
+
+        rpc_channel* channel_;
+        call_type* call_;
+    };
+
+    /**
+     * A request taken by try_receive, for a server to respond to.
+     * If it's destroyed without a respond(), it responds with a default
+     * constructed reply, so the caller is never left waiting.
+     */
+    class incoming_call
+    {
+    public:
+        incoming_call(incoming_call&& other) noexcept
+            : claim_(std::move(other.claim_))
+        {
+        }
+
+        ~incoming_call()
+        {
+            if (claim_)
+            {
+                respond(response_type());
+            }
+        }
+
+        /**
+         * @returns Whether a request was taken, false if the channel was empty.
+         */
+        explicit operator bool() const
+        {
+            return static_cast<bool>(claim_);
+        }
+
+        request_type& request() const
+        {
+            return claim_->request;
+        }
+
+        /**
+         * Write the reply into the caller's node & wake the caller.
+         * Nothing in the call may be touched after this.
+         */
+        void respond(response_type&& response)
+        {
+            call_type& call = *claim_;
+
+            call.response = std::move(response);
+            call.ticket = claim_.detach();
+
+            if (call.state.exchange(call_type::completed, std::memory_order_acq_rel) ==
+                call_type::sleeping)
+            {
+                // The caller may have released the node already, but the ring
+                // outlives it, so at worst this is a spurious wake.
+                mpmc_detail::wake_all_on_address(call.state);
+            }
+        }
+
+        void respond(const response_type& response)
+        {
+            respond(response_type(response));
+        }
+
+    private:
+        friend class rpc_channel;
+
+        explicit incoming_call(typename queue_type::consumer_claim&& claim)
+            : claim_(std::move(claim))
+        {
+        }
+
+        incoming_call(const incoming_call&) = delete;
+        incoming_call& operator=(const incoming_call&) = delete;
+        incoming_call& operator=(incoming_call&&) = delete;
+
+        typename queue_type::consumer_claim claim_;
+    };
+
+    /**
+     * Send a copy of a request.
+     *
+     * @param request The request, copied into the node.
+     * @returns The call to wait for the reply on, which converts to false
+     * if capacity() calls are already in flight.
+     */
+    pending_call try_call(const request_type& request)
+    {
+        return try_call_with(request);
+    }
+
+    /**
+     * Send a request by moving it into the node.
+     *
+     * @param request The request, only moved from if the call was sent.
+     * @returns The call to wait for the reply on, which converts to false
+     * if capacity() calls are already in flight.
+     */
+    pending_call try_call(request_type&& request)
+    {
+        return try_call_with(std::move(request));
+    }
+
+    /**
+     * Send a request, waiting for a free node if the channel is full, &
+     * wait for the reply.
+     *
+     * @returns The reply.
+     */
+    response_type call(request_type request)
+    {
+        uint_fast32_t failure_count = 0;
+
+        while(true)
+        {
+            pending_call pending = try_call(std::move(request));
+
+            if (pending)
+            {
+                response_type response = std::move(pending.wait());
+                return response;
+            }
+
+            // try_call only moves from the request once it has a node.
+            if (++failure_count < wait_spin_count)
+            {
+                HARDWARE_PAUSE();
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Take the next request, for a server.
+     *
+     * @returns The call to respond to, which converts to false if there
+     * was no request.
+     */
+    incoming_call try_receive()
+    {
+        return incoming_call(queue_.try_peek());
+    }
+
+    /**
+     * Take the next request & respond with what handler returns.
+     *
+     * @param handler Called as handler(request_type&), returning the reply.
+     * @returns Whether there was a request to handle.
+     */
+    template <typename handler_function>
+    bool serve_one(handler_function&& handler)
+    {
+        incoming_call incoming = try_receive();
+
+        if (!incoming)
+        {
+            return false;
+        }
+
+        incoming.respond(handler(incoming.request()));
+        return true;
+    }
+
+    /**
+     * @returns Roughly how many requests are waiting for a server, read
+     * from the ticket hints.
+     */
+    size_t size_approx() const
+    {
+        return queue_.size_approx();
+    }
+
+    /**
+     * @returns How many calls can be in flight at once, channel_size
+     * rounded up to the next power of two.
+     */
+    uint_fast32_t capacity() const
+    {
+        return queue_.capacity();
+    }
+
+private:
+    template <typename request_reference>
+    pending_call try_call_with(request_reference&& request)
+    {
+        auto claim = queue_.try_claim();
+
+        if (!claim)
+        {
+            return pending_call(this, nullptr);
+        }
+
+        call_type* const call = &*claim;
+        call->request = std::forward<request_reference>(request);
+        claim.commit();
+
+        return pending_call(this, call);
+    }
+
+    queue_type queue_;
+
+private:
+    rpc_channel(const rpc_channel&) = delete;
+    rpc_channel& operator=(const rpc_channel&) = delete;
+};
+
+#endif
@@ -0,0 +1,585 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Unbounded Segmented MPMC Queue type.
+ * Author: Primrose Taylor
+ */
+
+#ifndef SEGMENTED_MPMC_QUEUE_H
+#define SEGMENTED_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+namespace mpmc_detail
+{
+
+/**
+ * A fixed set of hazard pointer slots (Maged Michael's scheme).
+ * A thread takes a slot for the length of one operation through a
+ * hazard_guard, and publishes the pointer it is about to dereference in it.
+ * A retired object may only be reused once no slot holds its address.
+ * Threads start looking for a free slot at their own thread_index(), so
+ * each one usually ends up on the same uncontended slot every time.
+ * @cite https://www.cs.otago.ac.nz/cosc440/readings/hazard-pointers.pdf
+ */
+class hazard_pointer_domain
+{
+    struct slot;
+
+public:
+    static constexpr size_t slot_count = 128;
+
+    hazard_pointer_domain()
+    {
+        for (slot& current : slots_)
+        {
+            current.in_use.store(false, std::memory_order_relaxed);
+            current.pointer.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Holds one slot of the domain, and clears it on destruction.
+     */
+    class hazard_guard
+    {
+    public:
+        explicit hazard_guard(hazard_pointer_domain& domain)
+            : slot_(&domain.acquire_slot())
+        {
+        }
+
+        ~hazard_guard()
+        {
+            slot_->pointer.store(nullptr, std::memory_order_release);
+            slot_->in_use.store(false, std::memory_order_release);
+        }
+
+        /**
+         * Load source & publish it as hazardous, until the published value
+         * is still the current one. From then on the object can't be reused
+         * until this guard protects something else, or is destroyed.
+         *
+         * @param source The atomic pointer to load the object from.
+         * @returns The protected pointer.
+         */
+        template <typename pointer_type>
+        pointer_type* protect(const std::atomic<pointer_type*>& source)
+        {
+            pointer_type* pointer = source.load(std::memory_order_relaxed);
+
+            while(true)
+            {
+                slot_->pointer.store(pointer, std::memory_order_seq_cst);
+                pointer_type* const current = source.load(std::memory_order_seq_cst);
+
+                if (current == pointer)
+                {
+                    return pointer;
+                }
+
+                pointer = current;
+            }
+        }
+
+    private:
+        hazard_guard(const hazard_guard&) = delete;
+        hazard_guard& operator=(const hazard_guard&) = delete;
+
+        slot* slot_;
+    };
+
+    /**
+     * Copy every published hazard into out_hazards.
+     * The fence pairs with the seq_cst stores in protect: an object unlinked
+     * before the fence either shows up here, or fails protect's validation.
+     *
+     * @param out_hazards At least slot_count pointers, set to the hazards.
+     */
+    void collect_hazards(const void** out_hazards) const
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        for (size_t i = 0; i < slot_count; ++i)
+        {
+            out_hazards[i] = slots_[i].pointer.load(std::memory_order_acquire);
+        }
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) slot
+    {
+        std::atomic<bool> in_use;
+        std::atomic<const void*> pointer;
+    };
+
+    slot& acquire_slot()
+    {
+        size_t index = thread_index() % slot_count;
+
+        while(true)
+        {
+            for (size_t i = 0; i < slot_count; ++i, index = (index + 1) % slot_count)
+            {
+                slot& current = slots_[index];
+
+                if (!current.in_use.load(std::memory_order_relaxed) &&
+                    !current.in_use.exchange(true, std::memory_order_acquire))
+                {
+                    return current;
+                }
+            }
+
+            // More threads are mid-operation than there are slots.
+            std::this_thread::yield();
+        }
+    }
+
+    slot slots_[slot_count];
+};
+
+} // namespace mpmc_detail
+
+/**
+ * Lockless, Multi-Producer, Multi-Consumer, Unbounded Segmented Queue type.
+ * The queue is a linked list of fixed size segments, each built on the same
+ * circular_buffer_data as the ring queues, so segments honour the same slot
+ * layout & allocator policies. Pushing never fails: when the tail segment
+ * fills up, the producer links a fresh segment after it. Consumers drain the
+ * head segment, then move on to the next one.
+ *
+ * Each segment is only written once per use: producers claim tickets with a
+ * fetch_add, so they never retry, and consumers claim published nodes with
+ * a CAS as in the ring queues. Drained segments are retired & handed back to
+ * a bounded free-list once no hazard pointer refers to them, so a burst only
+ * costs allocations the first time round.
+ *
+ * As with the ring queues, a producer that is preempted between claiming
+ * a ticket & publishing it hides every element behind it until it resumes.
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename allocator = mpmc_aligned_allocator>
+class segmented_mpmc_queue final
+{
+    typedef mpmc_detail::circular_buffer_data<T, slot_layout, allocator> circular_buffer_data;
+    typedef typename circular_buffer_data::buffer_node buffer_node;
+    typedef mpmc_detail::ticket_type ticket_type;
+    typedef mpmc_detail::ticket_difference ticket_difference;
+    typedef mpmc_detail::hazard_pointer_domain::hazard_guard hazard_guard;
+
+    /**
+     * One link of the queue.
+     * A segment covers the tickets [begin_ticket, begin_ticket + capacity).
+     * Its nodes are only released by the consumers, so when a segment is
+     * reused for the next lap every node is already free for its ticket
+     * and nothing has to be reset but the tickets themselves.
+     */
+    struct segment
+    {
+        segment(const uint_least32_t requested_size, const allocator& in_allocator)
+            : producer_ticket(0),
+            consumer_ticket(0),
+            next(nullptr),
+            begin_ticket(0),
+            retired_next(nullptr),
+            buffer(requested_size, in_allocator)
+        {
+        }
+
+        uint_fast32_t capacity() const
+        {
+            return buffer.index_mask + 1;
+        }
+
+        alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> producer_ticket;
+        alignas(CACHE_LINE_SIZE) std::atomic<ticket_type> consumer_ticket;
+        // Read by every push & pop, but only written once per lap.
+        alignas(CACHE_LINE_SIZE) std::atomic<segment*> next;
+        ticket_type begin_ticket;
+        // Only used while the segment sits on the retired stack.
+        segment* retired_next;
+        circular_buffer_data buffer;
+    };
+
+public:
+    /**
+     * @param requested_segment_size The capacity of each segment, rounded up
+     * to the next power of two. Throws std::length_error above 2^31.
+     * @param max_free_segments The most drained segments kept around for
+     * reuse, rounded up to the next power of two. Drained segments past
+     * that are freed.
+     * @param in_allocator The allocator that provides the segments.
+     */
+    explicit segmented_mpmc_queue(const uint_least32_t requested_segment_size,
+        const uint_least32_t max_free_segments = 8,
+        const allocator& in_allocator = allocator())
+        : head_(nullptr),
+        tail_(nullptr),
+        retired_(nullptr),
+        segment_size_(requested_segment_size),
+        segment_capacity_(0),
+        segment_allocator_(in_allocator),
+        free_segments_(max_free_segments)
+    {
+        segment* const first = create_segment();
+
+        segment_capacity_ = first->capacity();
+        head_.store(first, std::memory_order_relaxed);
+        tail_.store(first, std::memory_order_relaxed);
+    }
+
+    ~segmented_mpmc_queue()
+    {
+        // Nothing can be in flight any more, so every segment from the head on
+        // holds constructed elements between its two tickets.
+        segment* current = head_.load(std::memory_order_acquire);
+
+        while (current != nullptr)
+        {
+            segment* const next = current->next.load(std::memory_order_acquire);
+            const ticket_type end_ticket = current->begin_ticket + current->capacity();
+            ticket_type producer_ticket = current->producer_ticket.load(std::memory_order_acquire);
+
+            if (static_cast<ticket_difference>(producer_ticket - end_ticket) > 0)
+            {
+                producer_ticket = end_ticket;
+            }
+
+            for (ticket_type ticket = current->consumer_ticket.load(std::memory_order_acquire);
+                ticket != producer_ticket; ++ticket)
+            {
+                current->buffer.get_node(ticket).data().~T();
+            }
+
+            destroy_segment(current);
+            current = next;
+        }
+
+        for (segment* retired = retired_.load(std::memory_order_acquire); retired != nullptr; )
+        {
+            segment* const next = retired->retired_next;
+            destroy_segment(retired);
+            retired = next;
+        }
+
+        segment* free_segment;
+
+        while (free_segments_.pop(free_segment))
+        {
+            destroy_segment(free_segment);
+        }
+    }
+
+    /**
+     * Push an element into the queue. Never fails, but throws std::bad_alloc
+     * if a new segment is needed and can't be allocated.
+     *
+     * @param in_data Reference to the variable containg the data to be pushed.
+     */
+    void push(const T& in_data)
+    {
+        emplace(in_data);
+    }
+
+    /**
+     * Push an element into the queue by moving it into the node.
+     *
+     * @param in_data The element to be moved into the queue.
+     */
+    void push(T&& in_data)
+    {
+        emplace(std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place at the back of the queue.
+     * If constructing T from args could throw, the element is constructed
+     * before a ticket is claimed and then moved into the node, since a
+     * claimed ticket can't be given back.
+     *
+     * @param args Arguments forwarded to the constructor of T.
+     */
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value,
+            "T must be nothrow move constructible!");
+
+        emplace_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T, Args&&...>::value>{},
+            std::forward<Args>(args)...);
+    }
+
+    /**
+     * Pop an element from the queue.
+     * The element is moved out of its node and destroyed in place.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if the queue is empty.
+     */
+    bool pop(T& out_data)
+    {
+        static_assert(std::is_nothrow_move_assignable<T>::value,
+            "T must be nothrow move assignable!");
+
+        hazard_guard guard(hazards_);
+        backoff_policy backoff;
+
+        while(true)
+        {
+            segment* const head = guard.protect(head_);
+            ticket_type ticket = head->consumer_ticket.load(std::memory_order_relaxed);
+            const ticket_type end_ticket = head->begin_ticket + head->capacity();
+
+            while (ticket != end_ticket)
+            {
+                buffer_node& node = head->buffer.get_node(ticket);
+                const ticket_difference difference = static_cast<ticket_difference>(
+                    node.sequence.load(std::memory_order_acquire) - (ticket + 1));
+
+                if (difference == 0)
+                {
+                    if (head->consumer_ticket.compare_exchange_weak(ticket, ticket + 1,
+                        std::memory_order_relaxed, std::memory_order_relaxed))
+                    {
+                        // Releasing the node leaves it free for the next lap,
+                        // once the segment is reused.
+                        node.get_data(out_data);
+                        node.sequence.store(ticket + head->capacity(), std::memory_order_release);
+
+                        return true;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    // empty check, nothing has been published for this ticket yet.
+                    return false;
+                }
+                else
+                {
+                    ticket = head->consumer_ticket.load(std::memory_order_relaxed);
+                }
+
+                backoff();
+            }
+
+            // The head segment is drained, move on to the next one if
+            // a producer has linked it yet.
+            segment* const next = head->next.load(std::memory_order_acquire);
+
+            if (next == nullptr)
+            {
+                return false;
+            }
+
+            // The tail can't be left pointing at a retired segment.
+            segment* tail = head;
+            tail_.compare_exchange_strong(tail, next, std::memory_order_release,
+                std::memory_order_relaxed);
+
+            segment* expected = head;
+
+            if (head_.compare_exchange_strong(expected, next, std::memory_order_seq_cst,
+                std::memory_order_relaxed))
+            {
+                retire_segment(head);
+            }
+        }
+    }
+
+    /**
+     * @returns How many elements each segment holds, the requested size
+     * rounded up to the next power of two.
+     */
+    uint_fast32_t segment_capacity() const
+    {
+        return segment_capacity_;
+    }
+
+private:
+    template <typename... Args>
+    void emplace_with(std::true_type /* nothrow constructible */, Args&&... args)
+    {
+        hazard_guard guard(hazards_);
+
+        while(true)
+        {
+            segment* const tail = guard.protect(tail_);
+            const ticket_type ticket = tail->producer_ticket.fetch_add(1, std::memory_order_relaxed);
+
+            if (ticket - tail->begin_ticket < tail->capacity())
+            {
+                // Set the data, then hand the node over to the consumer of this ticket.
+                buffer_node& node = tail->buffer.get_node(ticket);
+
+                node.set_data(std::forward<Args>(args)...);
+                node.sequence.store(ticket + 1, std::memory_order_release);
+
+                return;
+            }
+
+            // The tail segment is full, link a fresh one after it unless
+            // another producer already has, then help move the tail along.
+            segment* next = tail->next.load(std::memory_order_acquire);
+
+            if (next == nullptr)
+            {
+                segment* const fresh = acquire_segment();
+
+                if (tail->next.compare_exchange_strong(next, fresh, std::memory_order_release,
+                    std::memory_order_acquire))
+                {
+                    next = fresh;
+                }
+                else
+                {
+                    release_segment(fresh);
+                }
+            }
+
+            segment* expected = tail;
+            tail_.compare_exchange_strong(expected, next, std::memory_order_release,
+                std::memory_order_relaxed);
+        }
+    }
+
+    template <typename... Args>
+    void emplace_with(std::false_type /* nothrow constructible */, Args&&... args)
+    {
+        T element(std::forward<Args>(args)...);
+
+        emplace_with(std::true_type{}, std::move(element));
+    }
+
+    segment* create_segment()
+    {
+        void* const memory = segment_allocator_.allocate(sizeof(segment), alignof(segment));
+
+        try
+        {
+            return new (memory) segment(segment_size_, segment_allocator_);
+        }
+        catch (...)
+        {
+            segment_allocator_.deallocate(memory, sizeof(segment));
+            throw;
+        }
+    }
+
+    void destroy_segment(segment* const old_segment)
+    {
+        old_segment->~segment();
+        segment_allocator_.deallocate(old_segment, sizeof(segment));
+    }
+
+    /**
+     * @returns A segment ready to be linked, reused from the free-list if
+     * there is one.
+     */
+    segment* acquire_segment()
+    {
+        segment* reused;
+
+        return free_segments_.pop(reused) ? reused : create_segment();
+    }
+
+    /**
+     * Put a segment that nobody can reach any more on the free-list, or
+     * free it if the free-list is full.
+     */
+    void release_segment(segment* const unused)
+    {
+        if (!free_segments_.push(unused))
+        {
+            destroy_segment(unused);
+        }
+    }
+
+    /**
+     * Push a drained segment onto the retired stack, then try to reuse
+     * everything on it.
+     */
+    void retire_segment(segment* const drained)
+    {
+        push_retired(drained);
+        reclaim_retired();
+    }
+
+    /**
+     * The retired stack is only ever pushed onto, or emptied all at once,
+     * so it has no ABA problem.
+     */
+    void push_retired(segment* const drained)
+    {
+        segment* top = retired_.load(std::memory_order_relaxed);
+
+        do
+        {
+            drained->retired_next = top;
+        } while (!retired_.compare_exchange_weak(top, drained, std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+    /**
+     * Take the whole retired stack, and move every segment on it that no
+     * hazard pointer refers to onto the free-list, ready for its next lap.
+     * The rest go back onto the retired stack for a later attempt.
+     */
+    void reclaim_retired()
+    {
+        segment* retired = retired_.exchange(nullptr, std::memory_order_acquire);
+
+        if (retired == nullptr)
+        {
+            return;
+        }
+
+        const void* hazards[mpmc_detail::hazard_pointer_domain::slot_count];
+        hazards_.collect_hazards(hazards);
+
+        while (retired != nullptr)
+        {
+            segment* const next = retired->retired_next;
+            bool is_hazardous = false;
+
+            for (const void* hazard : hazards)
+            {
+                is_hazardous |= hazard == retired;
+            }
+
+            if (is_hazardous)
+            {
+                push_retired(retired);
+            }
+            else
+            {
+                const ticket_type begin_ticket = retired->begin_ticket + retired->capacity();
+
+                retired->begin_ticket = begin_ticket;
+                retired->producer_ticket.store(begin_ticket, std::memory_order_relaxed);
+                retired->consumer_ticket.store(begin_ticket, std::memory_order_relaxed);
+                retired->next.store(nullptr, std::memory_order_relaxed);
+                release_segment(retired);
+            }
+
+            retired = next;
+        }
+    }
+
+    // The head is only moved by consumers & the tail mostly by producers,
+    // so they live on their own cache lines.
+    alignas(CACHE_LINE_SIZE) std::atomic<segment*> head_;
+    alignas(CACHE_LINE_SIZE) std::atomic<segment*> tail_;
+    alignas(CACHE_LINE_SIZE) std::atomic<segment*> retired_;
+    const uint_least32_t segment_size_;
+    uint_fast32_t segment_capacity_;
+    allocator segment_allocator_;
+    dynamic_mpmc_queue<segment*> free_segments_;
+    mpmc_detail::hazard_pointer_domain hazards_;
+
+private:
+    segmented_mpmc_queue(const segmented_mpmc_queue&) = delete;
+    segmented_mpmc_queue& operator=(const segmented_mpmc_queue&) = delete;
+};
+
+#endif
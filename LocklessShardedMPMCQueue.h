@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Sharded MPMC Queue type, with work stealing.
+ * Author: Primrose Taylor
+ */
+
+#ifndef SHARDED_MPMC_QUEUE_H
+#define SHARDED_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
+
+/**
+ * Pick the home shard of a thread by its mpmc_detail::thread_index(), so
+ * every thread sticks to the same shard. This is the default.
+ */
+struct mpmc_thread_shard
+{
+    static size_t get_home_shard(const size_t shard_count)
+    {
+        return mpmc_detail::thread_index() % shard_count;
+    }
+};
+
+/**
+ * Pick the home shard of a thread by the CPU it's running on, so threads
+ * on the same core share a shard & its cache lines stay on that core.
+ * Falls back to mpmc_thread_shard where the CPU can't be read.
+ */
+struct mpmc_cpu_shard
+{
+    static size_t get_home_shard(const size_t shard_count)
+    {
+#if defined(_WIN32)
+        return static_cast<size_t>(GetCurrentProcessorNumber()) % shard_count;
+#elif defined(__linux__)
+        const int cpu = sched_getcpu();
+
+        if (cpu >= 0)
+        {
+            return static_cast<size_t>(cpu) % shard_count;
+        }
+#endif
+
+        return mpmc_thread_shard::get_home_shard(shard_count);
+    }
+};
+
+/**
+ * A set of shard_count rings, each with its own cursors, so threads that
+ * work on different shards never touch the same cache lines.
+ *
+ * push & pop go to the home shard picked by shard_selector. A push that
+ * finds its home shard full spills over into the next shards, and a pop
+ * that finds it empty steals from the other shards in turn, so nothing sits
+ * in one shard while another thread goes idle. Elements are only FIFO per
+ * shard.
+ *
+ * For a task pool, give each worker its own shard and use
+ * push_to(worker, task) & pop_from(worker, task): the owner's own work
+ * stays local, and thieves only show up when it runs dry. With
+ * mpmc_mode_spmc as the concurrency mode, each shard skips the producer CAS,
+ * but then only its owner may push to it: push_to doesn't spill over into
+ * other shards, and push() can't be used.
+ */
+template <typename T, size_t shard_count,
+    typename shard_selector = mpmc_thread_shard,
+    typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename allocator = mpmc_aligned_allocator,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class sharded_mpmc_queue final
+{
+    static_assert(shard_count > 0, "Can't have a shard count <= 0!");
+    static_assert(concurrency_mode::multi_consumer,
+        "Stealing needs shards that allow multiple consumers!");
+
+    typedef dynamic_mpmc_queue<T, backoff_policy, slot_layout, allocator,
+        concurrency_mode> shard_type;
+
+public:
+    /**
+     * @param requested_shard_size The capacity of each shard, rounded up to
+     * the next power of two. Throws std::length_error above 2^31.
+     * @param in_allocator The allocator that provides each shard's buffer.
+     */
+    explicit sharded_mpmc_queue(const uint_least32_t requested_shard_size,
+        const allocator& in_allocator = allocator())
+        : constructed_count_(0)
+    {
+        try
+        {
+            for (; constructed_count_ < shard_count; ++constructed_count_)
+            {
+                new (&shard_storage_[constructed_count_]) shard_type(
+                    requested_shard_size, in_allocator);
+            }
+        }
+        catch (...)
+        {
+            destroy_shards();
+            throw;
+        }
+    }
+
+    ~sharded_mpmc_queue()
+    {
+        destroy_shards();
+    }
+
+    /**
+     * Push an element into the home shard of the calling thread, or into
+     * the next shard with space if that one is full.
+     *
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if every shard is full.
+     */
+    bool push(const T& in_data)
+    {
+        return try_emplace(in_data);
+    }
+
+    /**
+     * Push an element by moving it into the home shard of the calling
+     * thread, or into the next shard with space if that one is full.
+     *
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if every shard is full.
+     */
+    bool push(T&& in_data)
+    {
+        return try_emplace(std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place in the home shard of the calling
+     * thread, or in the next shard with space if that one is full.
+     *
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if every shard is full.
+     */
+    template <typename... Args>
+    bool try_emplace(Args&&... args)
+    {
+        static_assert(concurrency_mode::multi_producer,
+            "Threads can share a home shard, so push needs multiple producers!");
+
+        return try_emplace_to(shard_selector::get_home_shard(shard_count),
+            std::forward<Args>(args)...);
+    }
+
+    /**
+     * Pop an element from the home shard of the calling thread, or steal
+     * one from the other shards if that one is empty.
+     *
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if every shard is empty.
+     */
+    bool pop(T& out_data)
+    {
+        return pop_from(shard_selector::get_home_shard(shard_count), out_data);
+    }
+
+    /**
+     * Push an element into the given shard, or into the next shard with
+     * space if that one is full. With a single producer per shard, only the
+     * given shard is tried.
+     *
+     * @param home_shard The shard to try first, must be below shard_count.
+     * @param in_data Reference to the variable containg the data to be pushed.
+     * @returns Returns false only if every shard it may use is full.
+     */
+    bool push_to(const size_t home_shard, const T& in_data)
+    {
+        return try_emplace_to(home_shard, in_data);
+    }
+
+    /**
+     * push_to, moving the element into the shard.
+     *
+     * @param home_shard The shard to try first, must be below shard_count.
+     * @param in_data The element to be moved into the queue.
+     * @returns Returns false only if every shard it may use is full.
+     */
+    bool push_to(const size_t home_shard, T&& in_data)
+    {
+        return try_emplace_to(home_shard, std::move(in_data));
+    }
+
+    /**
+     * Construct an element in place in the given shard, or in the next
+     * shard with space if that one is full. With a single producer per
+     * shard, only the given shard is tried.
+     *
+     * @param home_shard The shard to try first, must be below shard_count.
+     * @param args Arguments forwarded to the constructor of T.
+     * @returns Returns false only if every shard it may use is full.
+     */
+    template <typename... Args>
+    bool try_emplace_to(const size_t home_shard, Args&&... args)
+    {
+        return emplace_with(std::integral_constant<bool,
+            std::is_nothrow_constructible<T, Args&&...>::value>{},
+            home_shard, std::forward<Args>(args)...);
+    }
+
+    /**
+     * Pop an element from the given shard, or steal one from the next
+     * non-empty shard.
+     *
+     * @param home_shard The shard to try first, must be below shard_count.
+     * @param out_data Reference to the variable that will store the popped element.
+     * @returns Returns false only if every shard is empty.
+     */
+    bool pop_from(const size_t home_shard, T& out_data)
+    {
+        if (get_shard(home_shard).pop(out_data))
+        {
+            return true;
+        }
+
+        for (size_t i = 1; i < shard_count; ++i)
+        {
+            if (get_shard(home_shard + i).pop(out_data))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Direct access to one shard, e.g. for its bulk or blocking operations.
+     *
+     * @param index The shard, wrapped around shard_count.
+     */
+    shard_type& get_shard(const size_t index)
+    {
+        return *reinterpret_cast<shard_type*>(&shard_storage_[index % shard_count]);
+    }
+
+    const shard_type& get_shard(const size_t index) const
+    {
+        return *reinterpret_cast<const shard_type*>(&shard_storage_[index % shard_count]);
+    }
+
+    /**
+     * @returns The approximate number of elements over every shard, read
+     * from the ticket hints so polling it doesn't slow the shards down.
+     */
+    size_t size_approx() const
+    {
+        size_t size = 0;
+
+        for (size_t i = 0; i < shard_count; ++i)
+        {
+            size += get_shard(i).size_approx();
+        }
+
+        return size;
+    }
+
+    size_t capacity() const
+    {
+        return get_shard(0).capacity() * shard_count;
+    }
+
+private:
+    template <typename... Args>
+    bool emplace_with(std::true_type /* nothrow constructible */, const size_t home_shard,
+        Args&&... args)
+    {
+        const size_t spill_count = concurrency_mode::multi_producer ? shard_count : 1;
+
+        for (size_t i = 0; i < spill_count; ++i)
+        {
+            // A full shard constructs nothing, so args are still whole for the next.
+            if (get_shard(home_shard + i).try_emplace(std::forward<Args>(args)...))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template <typename... Args>
+    bool emplace_with(std::false_type /* nothrow constructible */, const size_t home_shard,
+        Args&&... args)
+    {
+        // A shard would construct it before finding out it's full, which
+        // would use up args, so it's constructed once up front instead.
+        T element(std::forward<Args>(args)...);
+
+        return emplace_with(std::true_type{}, home_shard, std::move(element));
+    }
+
+    void destroy_shards()
+    {
+        while (constructed_count_ > 0)
+        {
+            get_shard(--constructed_count_).~shard_type();
+        }
+    }
+
+    size_t constructed_count_;
+    typename std::aligned_storage<sizeof(shard_type), alignof(shard_type)>::type
+        shard_storage_[shard_count];
+
+private:
+    sharded_mpmc_queue(const sharded_mpmc_queue&) = delete;
+    sharded_mpmc_queue& operator=(const sharded_mpmc_queue&) = delete;
+};
+
+#endif
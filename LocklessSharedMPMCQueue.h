@@ -0,0 +1,435 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * C++14 Lockless Bounded Circular MPMC Queue type, shared between processes.
+ * Author: Primrose Taylor
+ */
+
+#ifndef SHARED_MPMC_QUEUE_H
+#define SHARED_MPMC_QUEUE_H
+
+#include "LocklessMPMCQueue.h"
+
+#if defined(_WIN32)
+    #error "shared_mpmc_queue needs POSIX shared memory (shm_open & mmap)."
+#endif
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Whether a shared_mpmc_queue sets up a new region, or attaches to one that
+ * another process has set up.
+ */
+enum class mpmc_shared_open
+{
+    create,
+    attach
+};
+
+/**
+ * What backs the region of a shared_mpmc_queue.
+ * posix_shm takes a shm_open name such as "/feed". file takes a path, and
+ * huge_page_file a path on a hugetlbfs mount, which rounds the region up
+ * to a whole number of 2MB pages.
+ */
+enum class mpmc_shared_backing
+{
+    posix_shm,
+    file,
+    huge_page_file
+};
+
+namespace mpmc_detail
+{
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "The shared queue needs lock-free, and so address-free, atomics!");
+
+/**
+ * Everything a shared_mpmc_queue keeps in its region besides the nodes.
+ * It only holds fixed width fields & offsets, never pointers, so each
+ * process can map the region at a different address. The magic is stored
+ * last by the creating process, once the rest of the region is set up.
+ */
+struct alignas(CACHE_LINE_SIZE) shared_ring_header
+{
+    // "MPMCSHM1"
+    static constexpr uint64_t expected_magic = 0x4D504D4353484D31ULL;
+    // 2 moved the cursors into ring_cursors & added the concurrency flags.
+    static constexpr uint32_t current_version = 2;
+
+    // Set in concurrency_flags.
+    static constexpr uint32_t multi_producer_flag = 1;
+    static constexpr uint32_t multi_consumer_flag = 2;
+
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t capacity;
+    // Attaching checks these against its own build of the queue.
+    uint32_t element_size;
+    uint32_t element_alignment;
+    uint32_t node_size;
+    uint32_t is_remapped;
+    uint32_t concurrency_flags;
+    uint64_t nodes_offset;
+    uint64_t region_size;
+    // The tickets, wait states & hints of the ring engine.
+    ring_cursors cursors;
+};
+
+/**
+ * A shm_open object or file, mapped shared. The creator of the region
+ * unlinks its name when it's done with it; processes that are still
+ * attached keep their mapping until they unmap it.
+ */
+class shared_memory_region
+{
+public:
+    /**
+     * Throws std::system_error if the region can't be opened or mapped,
+     * and std::runtime_error if an attaching process gives up waiting for
+     * the creator to size the region.
+     *
+     * @param size The size of a new region, ignored when attaching.
+     * @param timeout How long to wait for the creator when attaching.
+     */
+    shared_memory_region(const mpmc_shared_open open_mode, const char* const name,
+        const size_t size, const mpmc_shared_backing backing,
+        const std::chrono::nanoseconds timeout)
+        : address(nullptr),
+        size(0),
+        name_(name),
+        backing_(backing),
+        should_unlink_(false)
+    {
+        const bool is_creator = open_mode == mpmc_shared_open::create;
+        const int flags = O_RDWR | (is_creator ? O_CREAT | O_EXCL : 0);
+        const int fd = backing == mpmc_shared_backing::posix_shm ?
+            shm_open(name, flags, 0600) : open(name, flags, 0600);
+
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), name_);
+        }
+
+        try
+        {
+            if (is_creator)
+            {
+                should_unlink_ = true;
+
+                if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), name_);
+                }
+
+                this->size = size;
+            }
+            else
+            {
+                this->size = wait_for_size(fd, timeout);
+            }
+
+            void* const memory = mmap(nullptr, this->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+
+            if (memory == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::generic_category(), name_);
+            }
+
+            address = memory;
+            close(fd);
+        }
+        catch (...)
+        {
+            close(fd);
+            unlink_name();
+            throw;
+        }
+    }
+
+    ~shared_memory_region()
+    {
+        munmap(address, size);
+        unlink_name();
+    }
+
+    void* address;
+    size_t size;
+
+private:
+    /**
+     * The creator sizes the region right after creating it, so an empty
+     * region is one whose creator hasn't got that far yet.
+     */
+    size_t wait_for_size(const int fd, const std::chrono::nanoseconds timeout) const
+    {
+        const std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + timeout;
+
+        while(true)
+        {
+            struct stat file_status;
+
+            if (fstat(fd, &file_status) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), name_);
+            }
+
+            if (file_status.st_size >= static_cast<off_t>(sizeof(shared_ring_header)))
+            {
+                return static_cast<size_t>(file_status.st_size);
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                throw std::runtime_error("Timed out waiting for " + name_ + " to be created!");
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    void unlink_name()
+    {
+        if (should_unlink_)
+        {
+            if (backing_ == mpmc_shared_backing::posix_shm)
+            {
+                shm_unlink(name_.c_str());
+            }
+            else
+            {
+                unlink(name_.c_str());
+            }
+
+            should_unlink_ = false;
+        }
+    }
+
+    std::string name_;
+    mpmc_shared_backing backing_;
+    bool should_unlink_;
+
+private:
+    shared_memory_region(const shared_memory_region&) = delete;
+    shared_memory_region& operator=(const shared_memory_region&) = delete;
+};
+
+/**
+ * The mapped region of a shared_mpmc_queue & its header. A base of the
+ * queue, so the region is mapped & checked before the ring engine that
+ * runs over it is constructed.
+ */
+struct shared_queue_region
+{
+    /**
+     * @param get_header Called with the mapped region, returning its header.
+     */
+    template <typename header_function>
+    shared_queue_region(const mpmc_shared_open open_mode, const char* const name,
+        const size_t size, const mpmc_shared_backing backing,
+        const std::chrono::nanoseconds timeout, header_function&& get_header)
+        : region(open_mode, name, size, backing, timeout),
+        header(get_header(region))
+    {
+    }
+
+    shared_memory_region region;
+    shared_ring_header* header;
+};
+
+} // namespace mpmc_detail
+
+/**
+ * Lockless, Multi-Producer, Multi-Consumer, Bounded Circular Queue type,
+ * whose cursors & nodes live in a shared memory region, so producers and
+ * consumers can be in different processes.
+ *
+ * It's the same ring engine as the other queues, run over the cursors in
+ * the region's header & the nodes after it, so it has the same try_push,
+ * push_wait, close, claim & handle operations. The region starts with a
+ * shared_ring_header carrying a magic, a version & the shape of the nodes,
+ * and nodes are found through an offset from the start of the region, so
+ * every process can map it at its own address. Sleepers wait on
+ * process-shared futexes.
+ *
+ * T has to be trivially copyable, since elements are only ever copied
+ * through the region. Every process must use the same concurrency mode,
+ * which attaching checks. As with the other queues, a producer or consumer
+ * that dies between claiming a node & publishing/releasing it stalls the
+ * ring at that node.
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename concurrency_mode = mpmc_mode_mpmc>
+class shared_mpmc_queue final
+    : private mpmc_detail::shared_queue_region,
+    public mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy, slot_layout,
+        mpmc_aligned_allocator, concurrency_mode, mpmc_no_stats, mpmc_sleep_wait,
+        mpmc_detail::shared_ring_cursors>
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+        "T must be trivially copyable to be shared between processes!");
+
+    typedef mpmc_detail::basic_circular_mpmc_queue<T, backoff_policy, slot_layout,
+        mpmc_aligned_allocator, concurrency_mode, mpmc_no_stats, mpmc_sleep_wait,
+        mpmc_detail::shared_ring_cursors> ring_type;
+    typedef mpmc_detail::circular_buffer_data<T, slot_layout, mpmc_aligned_allocator>
+        circular_buffer_data;
+    typedef typename circular_buffer_data::buffer_node buffer_node;
+    typedef mpmc_detail::shared_queue_region shared_queue_region;
+    typedef mpmc_detail::shared_ring_header shared_ring_header;
+
+    static constexpr uint32_t concurrency_flags =
+        (concurrency_mode::multi_producer ? shared_ring_header::multi_producer_flag : 0) |
+        (concurrency_mode::multi_consumer ? shared_ring_header::multi_consumer_flag : 0);
+
+public:
+    /**
+     * Create a new region, or attach to one another process has created.
+     * Throws std::system_error if the region can't be opened or mapped, and
+     * std::runtime_error if an attached region was created with another
+     * element type, layout or version of the queue, or if it isn't ready
+     * within attach_timeout.
+     *
+     * @param open_mode Whether to create the region or attach to it.
+     * Creating fails if the name is already taken.
+     * @param name The shm_open name or the file path, depending on backing.
+     * @param requested_size The capacity of a new region, rounded up to the
+     * next power of two, ignored when attaching.
+     * @param backing What backs the region.
+     * @param attach_timeout How long to wait for the creator when attaching.
+     */
+    shared_mpmc_queue(const mpmc_shared_open open_mode, const char* const name,
+        const uint_least32_t requested_size = 0,
+        const mpmc_shared_backing backing = mpmc_shared_backing::posix_shm,
+        const std::chrono::nanoseconds attach_timeout = std::chrono::seconds(1))
+        : shared_queue_region(open_mode, name, get_region_size(requested_size, backing),
+            backing, attach_timeout,
+            [&](mpmc_detail::shared_memory_region& region)
+            {
+                return open_mode == mpmc_shared_open::create ?
+                    create_header(region, requested_size) :
+                    wait_for_header(region, attach_timeout);
+            }),
+        ring_type(mpmc_detail::shared_ring_cursors(&shared_queue_region::header->cursors),
+            shared_queue_region::header->capacity,
+            static_cast<char*>(shared_queue_region::region.address) +
+                shared_queue_region::header->nodes_offset,
+            open_mode == mpmc_shared_open::create)
+    {
+        if (open_mode == mpmc_shared_open::create)
+        {
+            shared_queue_region::header->magic.store(shared_ring_header::expected_magic,
+                std::memory_order_release);
+        }
+    }
+
+private:
+    /**
+     * The nodes start on the first cache line after the header.
+     */
+    static size_t get_nodes_offset()
+    {
+        const size_t alignment = alignof(buffer_node) > CACHE_LINE_SIZE ?
+            alignof(buffer_node) : CACHE_LINE_SIZE;
+
+        return (sizeof(shared_ring_header) + alignment - 1) & ~(alignment - 1);
+    }
+
+    static size_t get_region_size(const uint_least32_t requested_size,
+        const mpmc_shared_backing backing)
+    {
+        const size_t size = get_nodes_offset() +
+            circular_buffer_data::get_buffer_size(requested_size);
+
+        if (backing != mpmc_shared_backing::huge_page_file)
+        {
+            return size;
+        }
+
+        return (size + mpmc_huge_page_allocator::huge_page_size - 1) &
+            ~(mpmc_huge_page_allocator::huge_page_size - 1);
+    }
+
+    static shared_ring_header* create_header(mpmc_detail::shared_memory_region& region,
+        const uint_least32_t requested_size)
+    {
+        shared_ring_header* const header = new (region.address) shared_ring_header();
+
+        header->magic.store(0, std::memory_order_relaxed);
+        header->version = shared_ring_header::current_version;
+        header->capacity = static_cast<uint32_t>(
+            circular_buffer_data::get_buffer_size(requested_size) / sizeof(buffer_node));
+        header->element_size = sizeof(T);
+        header->element_alignment = alignof(T);
+        header->node_size = sizeof(buffer_node);
+        header->is_remapped = circular_buffer_data::node_rules::remap_index ? 1 : 0;
+        header->concurrency_flags = concurrency_flags;
+        header->nodes_offset = get_nodes_offset();
+        header->region_size = region.size;
+
+        return header;
+    }
+
+    /**
+     * Wait for the creator to store the magic, then check that the region
+     * was created by a compatible build of this queue.
+     */
+    static shared_ring_header* wait_for_header(mpmc_detail::shared_memory_region& region,
+        const std::chrono::nanoseconds timeout)
+    {
+        shared_ring_header* const header = static_cast<shared_ring_header*>(region.address);
+        const std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + timeout;
+
+        while (header->magic.load(std::memory_order_acquire) != shared_ring_header::expected_magic)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                throw std::runtime_error("Timed out waiting for the shared queue to be set up!");
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        const uint32_t capacity = header->capacity;
+
+        if (header->version != shared_ring_header::current_version)
+        {
+            throw std::runtime_error(
+                "The shared queue was created by a different version of the queue!");
+        }
+
+        if (header->element_size != sizeof(T) ||
+            header->element_alignment != alignof(T) ||
+            header->node_size != sizeof(buffer_node) ||
+            header->is_remapped != (circular_buffer_data::node_rules::remap_index ? 1U : 0U) ||
+            header->concurrency_flags != concurrency_flags ||
+            header->nodes_offset != get_nodes_offset() ||
+            capacity < 2 || (capacity & (capacity - 1)) != 0 ||
+            header->region_size > region.size ||
+            get_nodes_offset() + static_cast<uint64_t>(capacity) * sizeof(buffer_node) >
+                header->region_size)
+        {
+            throw std::runtime_error(
+                "The shared queue was created with a different element type, layout or mode!");
+        }
+
+        return header;
+    }
+
+private:
+    shared_mpmc_queue(const shared_mpmc_queue&) = delete;
+    shared_mpmc_queue& operator=(const shared_mpmc_queue&) = delete;
+};
+
+#endif
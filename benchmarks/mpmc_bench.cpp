@@ -0,0 +1,709 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * Throughput & latency benchmarks for the Lockless MPMC Queue types,
+ * with the same matrix run against a few well known reference queues.
+ *
+ * Every queue is benchmarked through an adapter that exposes a non-blocking
+ * try_push/try_pop pair, so all of them are measured with the same
+ * producer/consumer loops.
+ */
+
+#include "LocklessMPMCQueue.h"
+#include "LocklessNumaMPMCQueue.h"
+#include "LocklessShardedMPMCQueue.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#if defined(MPMC_BENCH_HAVE_BOOST)
+    #include <boost/lockfree/queue.hpp>
+#endif
+#if defined(MPMC_BENCH_HAVE_MOODYCAMEL)
+    #include "concurrentqueue.h"
+#endif
+#if defined(MPMC_BENCH_HAVE_RIGTORP)
+    #include <rigtorp/MPMCQueue.h>
+#endif
+
+namespace
+{
+
+/** The number of items moved through the queue per benchmark iteration. */
+constexpr size_t items_per_iteration = 1U << 18;
+
+/** The capacity used wherever the benchmark isn't sweeping capacities. */
+constexpr int64_t default_capacity = 1024;
+
+/**
+ * A trivially copyable element of exactly `size` bytes.
+ */
+template <size_t size>
+struct payload
+{
+    uint8_t bytes[size];
+};
+
+template <size_t size>
+payload<size> make_payload(const uint32_t value)
+{
+    payload<size> item;
+    memset(item.bytes, 0, size);
+    memcpy(item.bytes, &value, size < sizeof(value) ? size : sizeof(value));
+    return item;
+}
+
+/**
+ * Pin the calling thread to a CPU, wrapping around the available CPUs.
+ * Pinning is best effort, failures are ignored.
+ */
+void pin_current_thread(const size_t index)
+{
+    const unsigned cpu_count = std::max(1U, std::thread::hardware_concurrency());
+    const unsigned cpu = static_cast<unsigned>(index % cpu_count);
+
+#if defined(__linux__)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << (cpu % 64));
+#else
+    (void)cpu;
+#endif
+}
+
+/**
+ * @returns How many timestamp counter ticks make up one nanosecond, measured
+ * once against the steady clock.
+ */
+double ticks_per_nanosecond()
+{
+    static const double ratio = []()
+    {
+        const auto start_time = std::chrono::steady_clock::now();
+        const uint64_t start_ticks = mpmc_detail::read_tsc();
+
+        while (std::chrono::steady_clock::now() - start_time < std::chrono::milliseconds(50))
+        {
+        }
+
+        const uint64_t end_ticks = mpmc_detail::read_tsc();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time).count();
+
+        return elapsed > 0 ? static_cast<double>(end_ticks - start_ticks) / elapsed : 1.0;
+    }();
+
+    return ratio;
+}
+
+/**
+ * Back off after a failed push or pop. Spins for a while, then yields so
+ * oversubscribed runs still make progress.
+ */
+inline void relax(uint32_t& failure_count)
+{
+    if (++failure_count < 64)
+    {
+        HARDWARE_PAUSE();
+    }
+    else
+    {
+        std::this_thread::yield();
+    }
+}
+
+/**
+ * Adapter for dynamic_mpmc_queue, so the capacity can be swept at runtime.
+ */
+template <typename T, typename backoff_policy = mpmc_pause_backoff,
+    typename slot_layout = mpmc_auto_layout,
+    typename allocator = mpmc_aligned_allocator,
+    typename concurrency_mode = mpmc_mode_mpmc,
+    typename stats_policy = mpmc_no_stats>
+struct dynamic_queue_adapter
+{
+    typedef T value_type;
+
+    explicit dynamic_queue_adapter(const size_t capacity)
+        : queue(static_cast<uint_least32_t>(capacity))
+    {
+    }
+
+    bool try_push(const T& item) { return queue.push(item); }
+    bool try_pop(T& item) { return queue.pop(item); }
+
+    dynamic_mpmc_queue<T, backoff_policy, slot_layout, allocator, concurrency_mode,
+        stats_policy> queue;
+};
+
+/**
+ * Adapter for bounded_circular_mpmc_queue, the runtime capacity is ignored.
+ */
+template <typename T, uint_least32_t queue_size>
+struct bounded_queue_adapter
+{
+    typedef T value_type;
+
+    explicit bounded_queue_adapter(const size_t /* capacity */)
+    {
+    }
+
+    bool try_push(const T& item) { return queue.push(item); }
+    bool try_pop(T& item) { return queue.pop(item); }
+
+    bounded_circular_mpmc_queue<T, queue_size> queue;
+};
+
+/**
+ * Adapter for sharded_mpmc_queue, with the capacity split over the shards.
+ */
+template <typename T, size_t shard_count, typename shard_selector = mpmc_thread_shard>
+struct sharded_queue_adapter
+{
+    typedef T value_type;
+
+    explicit sharded_queue_adapter(const size_t capacity)
+        : queue(static_cast<uint_least32_t>(std::max<size_t>(capacity / shard_count, 2)))
+    {
+    }
+
+    bool try_push(const T& item) { return queue.push(item); }
+    bool try_pop(T& item) { return queue.pop(item); }
+
+    sharded_mpmc_queue<T, shard_count, shard_selector> queue;
+};
+
+/**
+ * Adapter for numa_mpmc_queue, with the capacity split over the nodes.
+ */
+template <typename T>
+struct numa_queue_adapter
+{
+    typedef T value_type;
+
+    explicit numa_queue_adapter(const size_t capacity)
+        : queue(static_cast<uint_least32_t>(std::max<size_t>(
+            capacity / mpmc_detail::numa_topology::get().get_node_count(), 2)))
+    {
+    }
+
+    bool try_push(const T& item) { return queue.push(item); }
+    bool try_pop(T& item) { return queue.pop(item); }
+
+    numa_mpmc_queue<T> queue;
+};
+
+#if defined(MPMC_BENCH_HAVE_BOOST)
+/**
+ * Adapter for boost::lockfree::queue, fixed sized so it never allocates.
+ * Boost can't hold more than 65535 nodes in that mode.
+ */
+template <typename T>
+struct boost_queue_adapter
+{
+    typedef T value_type;
+
+    explicit boost_queue_adapter(const size_t capacity)
+        : queue(std::min<size_t>(capacity, 65535))
+    {
+    }
+
+    bool try_push(const T& item) { return queue.bounded_push(item); }
+    bool try_pop(T& item) { return queue.pop(item); }
+
+    boost::lockfree::queue<T, boost::lockfree::fixed_sized<true>> queue;
+};
+#endif
+
+#if defined(MPMC_BENCH_HAVE_MOODYCAMEL)
+/**
+ * Adapter for moodycamel::ConcurrentQueue, try_enqueue never allocates
+ * past the initial capacity.
+ */
+template <typename T>
+struct moodycamel_queue_adapter
+{
+    typedef T value_type;
+
+    explicit moodycamel_queue_adapter(const size_t capacity)
+        : queue(capacity)
+    {
+    }
+
+    bool try_push(const T& item) { return queue.try_enqueue(item); }
+    bool try_pop(T& item) { return queue.try_dequeue(item); }
+
+    moodycamel::ConcurrentQueue<T> queue;
+};
+#endif
+
+#if defined(MPMC_BENCH_HAVE_RIGTORP)
+/**
+ * Adapter for rigtorp::MPMCQueue.
+ */
+template <typename T>
+struct rigtorp_queue_adapter
+{
+    typedef T value_type;
+
+    explicit rigtorp_queue_adapter(const size_t capacity)
+        : queue(capacity)
+    {
+    }
+
+    bool try_push(const T& item) { return queue.try_push(item); }
+    bool try_pop(T& item) { return queue.try_pop(item); }
+
+    rigtorp::MPMCQueue<T> queue;
+};
+#endif
+
+/**
+ * Report the contention counters of queues that keep statistics, averaged
+ * per iteration. Every other queue reports nothing.
+ */
+template <typename adapter>
+void report_contention(benchmark::State& /* state */, const adapter& /* queue */)
+{
+}
+
+template <typename T, typename backoff_policy, typename slot_layout, typename allocator,
+    typename concurrency_mode, size_t stripe_count, size_t sample_rate>
+void report_contention(benchmark::State& state,
+    const dynamic_queue_adapter<T, backoff_policy, slot_layout, allocator,
+        concurrency_mode, mpmc_striped_stats<stripe_count, sample_rate>>& adapter)
+{
+    const mpmc_stats_snapshot stats = adapter.queue.snapshot();
+    const auto per_iteration = [](const uint64_t value)
+    {
+        return benchmark::Counter(static_cast<double>(value), benchmark::Counter::kAvgIterations);
+    };
+
+    state.counters["push_cas_failures"] = per_iteration(stats.push_cas_failures);
+    state.counters["pop_cas_failures"] = per_iteration(stats.pop_cas_failures);
+    state.counters["full_rejections"] = per_iteration(stats.full_rejections);
+    state.counters["empty_rejections"] = per_iteration(stats.empty_rejections);
+    state.counters["high_water_mark"] = static_cast<double>(stats.high_water_mark);
+
+    if (sample_rate != 0)
+    {
+        state.counters["sojourn_p50_ticks"] = static_cast<double>(
+            stats.get_sojourn_percentile(50.0));
+        state.counters["sojourn_p99_ticks"] = static_cast<double>(
+            stats.get_sojourn_percentile(99.0));
+    }
+}
+
+/**
+ * Move items_per_iteration items from range(0) producers to range(1)
+ * consumers through a queue with a capacity of range(2). Only the transfer
+ * itself is timed, not starting & joining the threads.
+ */
+template <typename adapter>
+void bm_throughput(benchmark::State& state)
+{
+    typedef typename adapter::value_type value_type;
+
+    const size_t producer_count = static_cast<size_t>(state.range(0));
+    const size_t consumer_count = static_cast<size_t>(state.range(1));
+    const size_t items_per_producer = items_per_iteration / producer_count;
+    const size_t total_items = items_per_producer * producer_count;
+
+    adapter queue(static_cast<size_t>(state.range(2)));
+
+    for (auto _ : state)
+    {
+        std::atomic<size_t> ready_count(0);
+        std::atomic<bool> start(false);
+        std::atomic<size_t> consumed_count(0);
+        std::vector<std::thread> threads;
+        threads.reserve(producer_count + consumer_count);
+
+        for (size_t i = 0; i < producer_count; ++i)
+        {
+            threads.emplace_back([&, i]()
+            {
+                pin_current_thread(i);
+                ready_count.fetch_add(1);
+
+                while (!start.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+
+                for (size_t n = 0; n < items_per_producer; ++n)
+                {
+                    const value_type item = make_payload<sizeof(value_type)>(
+                        static_cast<uint32_t>(n));
+                    uint32_t failure_count = 0;
+
+                    while (!queue.try_push(item))
+                    {
+                        relax(failure_count);
+                    }
+                }
+            });
+        }
+
+        for (size_t i = 0; i < consumer_count; ++i)
+        {
+            threads.emplace_back([&, i]()
+            {
+                pin_current_thread(producer_count + i);
+                ready_count.fetch_add(1);
+
+                while (!start.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+
+                // Publish the count in batches so the shared counter isn't
+                // contended on every pop.
+                size_t local_count = 0;
+                uint32_t failure_count = 0;
+                value_type item;
+
+                while (consumed_count.load(std::memory_order_relaxed) < total_items)
+                {
+                    if (queue.try_pop(item))
+                    {
+                        benchmark::DoNotOptimize(item);
+                        failure_count = 0;
+
+                        if (++local_count == 64)
+                        {
+                            consumed_count.fetch_add(local_count, std::memory_order_relaxed);
+                            local_count = 0;
+                        }
+                    }
+                    else
+                    {
+                        if (local_count != 0)
+                        {
+                            consumed_count.fetch_add(local_count, std::memory_order_relaxed);
+                            local_count = 0;
+                        }
+                        relax(failure_count);
+                    }
+                }
+            });
+        }
+
+        while (ready_count.load() != producer_count + consumer_count)
+        {
+            std::this_thread::yield();
+        }
+
+        const auto start_time = std::chrono::steady_clock::now();
+        start.store(true, std::memory_order_release);
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        state.SetIterationTime(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count());
+    }
+
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * total_items));
+    state.counters["producers"] = static_cast<double>(producer_count);
+    state.counters["consumers"] = static_cast<double>(consumer_count);
+    report_contention(state, queue);
+}
+
+/**
+ * Ping-pong a single item between two pinned threads over a pair of
+ * queues with a capacity of range(0), timing each round trip with the
+ * timestamp counter. Reports the p50, p99 & p99.9 round trip in nanoseconds.
+ */
+template <typename adapter>
+void bm_round_trip(benchmark::State& state)
+{
+    typedef typename adapter::value_type value_type;
+
+    adapter ping(static_cast<size_t>(state.range(0)));
+    adapter pong(static_cast<size_t>(state.range(0)));
+    std::atomic<bool> stop(false);
+
+    std::thread echo_thread([&]()
+    {
+        pin_current_thread(1);
+
+        uint32_t failure_count = 0;
+        value_type item;
+
+        while (true)
+        {
+            if (ping.try_pop(item))
+            {
+                failure_count = 0;
+
+                while (!pong.try_push(item))
+                {
+                    relax(failure_count);
+                }
+
+                failure_count = 0;
+            }
+            else if (stop.load(std::memory_order_acquire))
+            {
+                return;
+            }
+            else
+            {
+                relax(failure_count);
+            }
+        }
+    });
+
+    pin_current_thread(0);
+
+    std::vector<uint64_t> samples;
+    samples.reserve(1U << 20);
+    const value_type outgoing = make_payload<sizeof(value_type)>(1);
+    value_type incoming;
+
+    for (auto _ : state)
+    {
+        uint32_t failure_count = 0;
+        const uint64_t start_ticks = mpmc_detail::read_tsc();
+
+        while (!ping.try_push(outgoing))
+        {
+            relax(failure_count);
+        }
+
+        failure_count = 0;
+
+        while (!pong.try_pop(incoming))
+        {
+            relax(failure_count);
+        }
+
+        samples.push_back(mpmc_detail::read_tsc() - start_ticks);
+        benchmark::DoNotOptimize(incoming);
+    }
+
+    stop.store(true, std::memory_order_release);
+    echo_thread.join();
+
+    if (samples.empty())
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    const double ticks_per_ns = ticks_per_nanosecond();
+    const auto percentile = [&](const double fraction)
+    {
+        const size_t index = std::min(samples.size() - 1,
+            static_cast<size_t>(fraction * static_cast<double>(samples.size())));
+        return static_cast<double>(samples[index]) / ticks_per_ns;
+    };
+
+    state.counters["p50_ns"] = percentile(0.50);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p99.9_ns"] = percentile(0.999);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+std::vector<int64_t> thread_counts()
+{
+    const int64_t cpu_count = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<int64_t> counts;
+
+    for (int64_t count = 1; count < cpu_count; count *= 2)
+    {
+        counts.push_back(count);
+    }
+
+    counts.push_back(cpu_count);
+    return counts;
+}
+
+/** Every producer & consumer count from 1..N, N being the CPU count. */
+void many_to_many(benchmark::internal::Benchmark* benchmark)
+{
+    for (const int64_t producers : thread_counts())
+    {
+        for (const int64_t consumers : thread_counts())
+        {
+            benchmark->Args({producers, consumers, default_capacity});
+        }
+    }
+}
+
+void many_to_one(benchmark::internal::Benchmark* benchmark)
+{
+    for (const int64_t producers : thread_counts())
+    {
+        benchmark->Args({producers, 1, default_capacity});
+    }
+}
+
+void one_to_many(benchmark::internal::Benchmark* benchmark)
+{
+    for (const int64_t consumers : thread_counts())
+    {
+        benchmark->Args({1, consumers, default_capacity});
+    }
+}
+
+void one_to_one(benchmark::internal::Benchmark* benchmark)
+{
+    benchmark->Args({1, 1, default_capacity});
+}
+
+/** A range of capacities, uncontended & with every CPU busy. */
+void capacity_sweep(benchmark::internal::Benchmark* benchmark)
+{
+    const int64_t half_cpu_count = std::max<int64_t>(1,
+        std::thread::hardware_concurrency() / 2);
+
+    for (const int64_t capacity : {16, 64, 1024, 16384, 65536})
+    {
+        benchmark->Args({1, 1, capacity});
+        benchmark->Args({half_cpu_count, half_cpu_count, capacity});
+    }
+}
+
+template <typename adapter>
+void register_queue(const std::string& name,
+    void (*thread_matrix)(benchmark::internal::Benchmark*))
+{
+    benchmark::RegisterBenchmark((name + "/throughput").c_str(), bm_throughput<adapter>)
+        ->Apply(thread_matrix)
+        ->ArgNames({"producers", "consumers", "capacity"})
+        ->UseManualTime()
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::RegisterBenchmark((name + "/round_trip").c_str(), bm_round_trip<adapter>)
+        ->Arg(default_capacity)
+        ->ArgName("capacity");
+}
+
+template <template <typename> class adapter>
+void register_reference_queue(const std::string& name)
+{
+    register_queue<adapter<payload<8>>>(name + "/payload:8", many_to_many);
+    register_queue<adapter<payload<64>>>(name + "/payload:64", many_to_many);
+}
+
+void register_benchmarks()
+{
+    // Payload sizes, with the default policies.
+    register_queue<dynamic_queue_adapter<payload<4>>>("mpmc/payload:4", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>>>("mpmc/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<16>>>("mpmc/payload:16", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<32>>>("mpmc/payload:32", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<64>>>("mpmc/payload:64", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<128>>>("mpmc/payload:128", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<256>>>("mpmc/payload:256", many_to_many);
+
+    // Capacities.
+    benchmark::RegisterBenchmark("mpmc/payload:8/capacity_sweep",
+        bm_throughput<dynamic_queue_adapter<payload<8>>>)
+        ->Apply(capacity_sweep)
+        ->ArgNames({"producers", "consumers", "capacity"})
+        ->UseManualTime()
+        ->Unit(benchmark::kMillisecond);
+
+    // Compile time vs runtime capacity.
+    register_queue<bounded_queue_adapter<payload<8>, default_capacity>>(
+        "bounded/payload:8", many_to_many);
+
+    // Slot layouts.
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff,
+        mpmc_packed_layout>>("mpmc/packed/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff,
+        mpmc_cache_line_layout>>("mpmc/cache_line/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff,
+        mpmc_remapped_layout>>("mpmc/remapped/payload:8", many_to_many);
+
+    // Backoff policies.
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_busy_spin_backoff>>(
+        "mpmc/busy_spin/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_yield_backoff>>(
+        "mpmc/yield/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_exponential_backoff<>>>(
+        "mpmc/exponential/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_then_yield_backoff<>>>(
+        "mpmc/pause_then_yield/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_jittered_backoff<>>>(
+        "mpmc/jittered/payload:8", many_to_many);
+
+    // Allocators.
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff,
+        mpmc_auto_layout, mpmc_huge_page_allocator>>("mpmc/huge_pages/payload:8", many_to_many);
+
+    // Concurrency modes, only with the thread counts they allow.
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_mpsc>>("mpsc/payload:8", many_to_one);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_spmc>>("spmc/payload:8", one_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_spsc>>("spsc/payload:8", one_to_one);
+    register_queue<dynamic_queue_adapter<payload<64>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_spsc>>("spsc/payload:64", one_to_one);
+
+    // Contention counters, with the cost of keeping them.
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_mpmc, mpmc_striped_stats<>>>(
+            "mpmc/stats/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_busy_spin_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_mpmc, mpmc_striped_stats<>>>(
+            "mpmc/busy_spin/stats/payload:8", many_to_many);
+    register_queue<dynamic_queue_adapter<payload<8>, mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_aligned_allocator, mpmc_mode_mpmc, mpmc_sojourn_stats<64>>>(
+            "mpmc/sojourn:64/payload:8", many_to_many);
+
+    // Sharding, against the single ring above.
+    register_queue<sharded_queue_adapter<payload<8>, 8>>("sharded:8/payload:8", many_to_many);
+    register_queue<sharded_queue_adapter<payload<8>, 8, mpmc_cpu_shard>>(
+        "sharded:8/cpu/payload:8", many_to_many);
+    register_queue<numa_queue_adapter<payload<8>>>("numa/payload:8", many_to_many);
+
+    // Reference queues.
+#if defined(MPMC_BENCH_HAVE_BOOST)
+    register_reference_queue<boost_queue_adapter>("boost_lockfree");
+#endif
+#if defined(MPMC_BENCH_HAVE_MOODYCAMEL)
+    register_reference_queue<moodycamel_queue_adapter>("moodycamel");
+#endif
+#if defined(MPMC_BENCH_HAVE_RIGTORP)
+    register_reference_queue<rigtorp_queue_adapter>("rigtorp");
+#endif
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    register_benchmarks();
+    benchmark::Initialize(&argc, argv);
+
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * Torture test for async_mpmc_queue, which needs C++20 coroutines.
+ * Producer & consumer coroutines are started on their own threads, then
+ * co_await push & pop on a tiny ring, so they keep suspending & get resumed
+ * on whichever thread serves them. Every item must be popped exactly once,
+ * in order per producer for each consumer, & close() must resume everyone.
+ *
+ * Usage: mpmc_async_stress [producers] [consumers] [items per producer]
+ */
+
+#include "LocklessAsyncMPMCQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct stress_config
+{
+    size_t producer_count;
+    size_t consumer_count;
+    size_t items_per_producer;
+};
+
+inline uint64_t make_item(const size_t producer, const size_t sequence)
+{
+    return (static_cast<uint64_t>(producer) << 32) | static_cast<uint64_t>(sequence);
+}
+
+/**
+ * A coroutine nobody waits on. It runs until it first suspends, & its
+ * frame is freed once it finishes.
+ */
+struct detached_task
+{
+    struct promise_type
+    {
+        detached_task get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * Print the PASS/FAIL line of one run, in the format mpmc_stress uses.
+ * A failing run prints its details straight after, on the same line.
+ * @returns passed.
+ */
+bool report(const bool passed, const char* const name, const size_t capacity,
+    const size_t producer_count, const size_t consumer_count, const char* const kind)
+{
+    printf("%-5s %-24s capacity %6u  %zux%zu  %-8s  %s",
+        passed ? "PASS" : "FAIL", name, static_cast<unsigned>(capacity),
+        producer_count, consumer_count, kind, passed ? "\n" : "");
+
+    return passed;
+}
+
+/**
+ * Wait for count to reach target, for at most a few seconds, so a lost
+ * wake fails the run instead of hanging it.
+ * @returns Whether it got there.
+ */
+bool wait_for_count(const std::atomic<size_t>& count, const size_t target)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+
+    while (count.load(std::memory_order_acquire) < target)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return false;
+        }
+
+        std::this_thread::yield();
+    }
+
+    return true;
+}
+
+typedef async_mpmc_queue<uint64_t, 4> stress_queue;
+
+detached_task produce(stress_queue& queue, const size_t producer, const size_t item_count,
+    std::atomic<size_t>& finished_count)
+{
+    for (size_t sequence = 0; sequence < item_count; ++sequence)
+    {
+        if (co_await queue.async_push(make_item(producer, sequence)) != mpmc_result::ok)
+        {
+            break;
+        }
+    }
+
+    finished_count.fetch_add(1, std::memory_order_release);
+}
+
+detached_task consume(stress_queue& queue, const stress_config& config,
+    std::atomic<uint8_t>* const seen_counts, std::atomic<size_t>& violation_count,
+    std::atomic<size_t>& finished_count)
+{
+    std::vector<int64_t> last_sequence(config.producer_count, -1);
+    uint64_t item;
+
+    while (co_await queue.async_pop(item) == mpmc_result::ok)
+    {
+        const size_t producer = static_cast<size_t>(item >> 32);
+        const size_t sequence = static_cast<size_t>(item & 0xFFFFFFFFU);
+
+        if (producer >= config.producer_count || sequence >= config.items_per_producer ||
+            static_cast<int64_t>(sequence) <= last_sequence[producer])
+        {
+            violation_count.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        last_sequence[producer] = static_cast<int64_t>(sequence);
+        seen_counts[producer * config.items_per_producer + sequence].fetch_add(1,
+            std::memory_order_relaxed);
+    }
+
+    finished_count.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * Start every coroutine on a thread of its own, let them hand the items
+ * over, then close the queue once the producers are done.
+ * @returns Whether every item was popped exactly once & in order.
+ */
+bool run_async_stress(const stress_config& config)
+{
+    const size_t total_count = config.producer_count * config.items_per_producer;
+    std::unique_ptr<std::atomic<uint8_t>[]> seen_counts(new std::atomic<uint8_t>[total_count]);
+    std::atomic<size_t> violation_count(0);
+    std::atomic<size_t> finished_producer_count(0);
+    std::atomic<size_t> finished_consumer_count(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < total_count; ++i)
+    {
+        seen_counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    stress_queue queue;
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            consume(queue, config, seen_counts.get(), violation_count, finished_consumer_count);
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            produce(queue, i, config.items_per_producer, finished_producer_count);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const bool produced = wait_for_count(finished_producer_count, config.producer_count);
+
+    queue.close();
+
+    const bool drained = produced &&
+        wait_for_count(finished_consumer_count, config.consumer_count);
+    size_t lost_count = 0;
+
+    for (size_t i = 0; i < total_count; ++i)
+    {
+        lost_count += seen_counts[i].load(std::memory_order_relaxed) == 1 ? 0 : 1;
+    }
+
+    const bool passed = drained && lost_count == 0 && violation_count == 0;
+
+    if (!report(passed, "async", queue.capacity(), config.producer_count,
+        config.consumer_count, "co_await"))
+    {
+        printf(" %s, lost or duplicated %zu, out of order %zu\n",
+            drained ? "drained" : "left suspended", lost_count, violation_count.load());
+    }
+
+    if (!drained)
+    {
+        // The coroutines left suspended still point at the locals, so don't return.
+        fflush(stdout);
+        std::_Exit(1);
+    }
+
+    return passed;
+}
+
+/**
+ * Suspend a few consumers on an empty queue one after another, then push
+ * one item at a time: each item must go to the longest waiting consumer.
+ * @returns Whether the waiters were served in the order they suspended.
+ */
+bool run_fifo_wake()
+{
+    constexpr size_t waiter_count = 3;
+
+    stress_queue queue;
+    uint64_t items[waiter_count] = {};
+    std::atomic<size_t> finished_count(0);
+
+    auto wait_once = [](stress_queue& in_queue, uint64_t& out_item,
+        std::atomic<size_t>& in_finished_count) -> detached_task
+    {
+        co_await in_queue.async_pop(out_item);
+        in_finished_count.fetch_add(1, std::memory_order_release);
+    };
+
+    for (size_t i = 0; i < waiter_count; ++i)
+    {
+        wait_once(queue, items[i], finished_count);
+    }
+
+    for (size_t i = 0; i < waiter_count; ++i)
+    {
+        queue.try_push(100 + i);
+    }
+
+    bool passed = finished_count.load(std::memory_order_acquire) == waiter_count;
+
+    for (size_t i = 0; i < waiter_count; ++i)
+    {
+        passed &= items[i] == 100 + i;
+    }
+
+    if (!report(passed, "async", queue.capacity(), 1, waiter_count, "fifo"))
+    {
+        printf(" woke %zu, got %llu, %llu & %llu\n", finished_count.load(),
+            static_cast<unsigned long long>(items[0]), static_cast<unsigned long long>(items[1]),
+            static_cast<unsigned long long>(items[2]));
+    }
+
+    return passed;
+}
+
+size_t parse_count(const int argc, char** argv, const int index, const size_t fallback)
+{
+    if (index >= argc)
+    {
+        return fallback;
+    }
+
+    const long value = strtol(argv[index], nullptr, 10);
+    return value > 0 ? static_cast<size_t>(value) : fallback;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t default_thread_count = std::max(2U, std::thread::hardware_concurrency());
+    const stress_config config = {
+        parse_count(argc, argv, 1, default_thread_count),
+        parse_count(argc, argv, 2, default_thread_count),
+        parse_count(argc, argv, 3, 100000)
+    };
+    bool passed = true;
+
+    passed &= run_fifo_wake();
+    passed &= run_async_stress(config);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,2060 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/**
+ * Torture test for the Lockless MPMC Queue types.
+ * Producers push items that encode their id & a sequence number, and the
+ * test checks that every item is popped exactly once, and that each
+ * consumer sees the items of any one producer in the order they were pushed.
+ * Small capacities are used so the tickets lap the buffer constantly.
+ * Build with MPMC_STRESS_TSAN=ON to run it under ThreadSanitizer.
+ *
+ * Usage: mpmc_stress [producers] [consumers] [items per producer]
+ */
+
+#include "LocklessBroadcastQueue.h"
+#include "LocklessConflatingMPMCQueue.h"
+#include "LocklessLossyMPMCQueue.h"
+#include "LocklessMPMCQueue.h"
+#include "LocklessNumaMPMCQueue.h"
+#include "LocklessObjectPool.h"
+#include "LocklessPriorityMPMCQueue.h"
+#include "LocklessRpcChannel.h"
+#include "LocklessSegmentedMPMCQueue.h"
+#include "LocklessShardedMPMCQueue.h"
+
+#if !defined(_WIN32)
+    #include "LocklessSharedMPMCQueue.h"
+    #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+enum class operation_kind
+{
+    single,
+    bulk,
+    blocking,
+    claim,
+    handle
+};
+
+const char* get_operation_name(const operation_kind kind)
+{
+    switch (kind)
+    {
+    case operation_kind::single:
+        return "single";
+    case operation_kind::bulk:
+        return "bulk";
+    case operation_kind::claim:
+        return "claim";
+    case operation_kind::handle:
+        return "handle";
+    default:
+        return "blocking";
+    }
+}
+
+/** The most items moved by one push_bulk/pop_bulk call. */
+constexpr size_t max_bulk_count = 16;
+
+struct stress_config
+{
+    size_t producer_count;
+    size_t consumer_count;
+    size_t items_per_producer;
+};
+
+inline uint64_t make_item(const size_t producer, const size_t sequence)
+{
+    return (static_cast<uint64_t>(producer) << 32) | static_cast<uint64_t>(sequence);
+}
+
+/**
+ * Yield every now & then, so a run still makes progress when there are
+ * more threads than cores.
+ */
+inline void relax(uint32_t& failure_count)
+{
+    if ((++failure_count & 63) == 0)
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        HARDWARE_PAUSE();
+    }
+}
+
+/**
+ * Counts how many times each item of a run was seen, so lost & duplicated
+ * items show up once every thread has joined.
+ */
+class seen_tracker
+{
+public:
+    explicit seen_tracker(const stress_config& config)
+        : config_(config),
+        counts_(new std::atomic<uint8_t>[get_total_count()])
+    {
+        for (size_t i = 0; i < get_total_count(); ++i)
+        {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @returns Whether item could have come from make_item in this run.
+     */
+    bool is_valid(const uint64_t item) const
+    {
+        return static_cast<size_t>(item >> 32) < config_.producer_count &&
+            static_cast<size_t>(item & 0xFFFFFFFFU) < config_.items_per_producer;
+    }
+
+    /**
+     * Count one more sighting of item, which must be valid.
+     * @returns How many times it had been seen before.
+     */
+    uint8_t add(const uint64_t item)
+    {
+        return get(item).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint8_t>& get(const uint64_t item)
+    {
+        return counts_[static_cast<size_t>(item >> 32) * config_.items_per_producer +
+            static_cast<size_t>(item & 0xFFFFFFFFU)];
+    }
+
+    /**
+     * @returns How many items weren't seen exactly expected_count times.
+     */
+    size_t count_mismatched(const uint8_t expected_count = 1) const
+    {
+        size_t mismatched_count = 0;
+
+        for (size_t i = 0; i < get_total_count(); ++i)
+        {
+            mismatched_count += counts_[i].load(std::memory_order_relaxed) ==
+                expected_count ? 0 : 1;
+        }
+
+        return mismatched_count;
+    }
+
+    /**
+     * @returns How many items were seen more than once.
+     */
+    size_t count_duplicated() const
+    {
+        size_t duplicate_count = 0;
+
+        for (size_t i = 0; i < get_total_count(); ++i)
+        {
+            duplicate_count += counts_[i].load(std::memory_order_relaxed) > 1 ? 1 : 0;
+        }
+
+        return duplicate_count;
+    }
+
+    size_t get_total_count() const
+    {
+        return config_.producer_count * config_.items_per_producer;
+    }
+
+private:
+    const stress_config config_;
+    std::unique_ptr<std::atomic<uint8_t>[]> counts_;
+};
+
+/**
+ * Print the PASS/FAIL line of one run. A failing run prints its details
+ * straight after, on the same line.
+ * @returns passed.
+ */
+bool report(const bool passed, const char* const name, const size_t capacity,
+    const size_t producer_count, const size_t consumer_count, const char* const kind)
+{
+    printf("%-5s %-24s capacity %6u  %zux%zu  %-8s  %s",
+        passed ? "PASS" : "FAIL", name, static_cast<unsigned>(capacity),
+        producer_count, consumer_count, kind, passed ? "\n" : "");
+
+    return passed;
+}
+
+/**
+ * Whether a queue keeps the items of each producer in order for each
+ * consumer. The sharded & NUMA queues don't once they spill over or steal.
+ */
+template <typename queue_type>
+struct keeps_producer_order : std::true_type
+{
+};
+
+/**
+ * Fill the next node, or run of nodes, in place through try_claim or
+ * try_claim_bulk, alternating between the two.
+ * @returns Whether anything was claimed.
+ */
+template <typename queue_type>
+bool produce_claimed(queue_type& queue, const size_t producer, const size_t item_count,
+    size_t& sequence)
+{
+    if (sequence % 2 == 0)
+    {
+        auto claim = queue.try_claim();
+
+        if (!claim)
+        {
+            return false;
+        }
+
+        *claim = make_item(producer, sequence++);
+        claim.commit();
+        return true;
+    }
+
+    auto batch = queue.try_claim_bulk(std::min(item_count - sequence,
+        1 + (sequence % max_bulk_count)));
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        batch[i] = make_item(producer, sequence++);
+    }
+
+    return !batch.empty();
+}
+
+/**
+ * Read a run of nodes in place through try_peek_bulk.
+ * @returns The number of items read.
+ */
+template <typename queue_type>
+size_t consume_claimed(queue_type& queue, uint64_t* items)
+{
+    auto batch = queue.try_peek_bulk(max_bulk_count);
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        items[i] = batch[i];
+    }
+
+    return batch.size();
+}
+
+template <typename queue_type>
+void produce(queue_type& queue, const size_t producer, const size_t item_count,
+    const operation_kind kind)
+{
+    uint64_t items[max_bulk_count];
+    uint32_t failure_count = 0;
+    size_t sequence = 0;
+    // Only used by operation_kind::handle. Its destructor flushes what's left.
+    auto handle = queue.template make_producer_handle<max_bulk_count>();
+
+    while (sequence < item_count)
+    {
+        switch (kind)
+        {
+        case operation_kind::single:
+            if (queue.push(make_item(producer, sequence)))
+            {
+                ++sequence;
+            }
+            else
+            {
+                relax(failure_count);
+            }
+            break;
+        case operation_kind::bulk:
+        {
+            // Vary the run length, so runs keep straddling the end of the buffer.
+            const size_t run_count = std::min(item_count - sequence,
+                1 + (sequence % max_bulk_count));
+
+            for (size_t i = 0; i < run_count; ++i)
+            {
+                items[i] = make_item(producer, sequence + i);
+            }
+
+            const size_t pushed_count = queue.push_bulk(items, run_count);
+
+            if (pushed_count == 0)
+            {
+                relax(failure_count);
+            }
+
+            sequence += pushed_count;
+            break;
+        }
+        case operation_kind::blocking:
+            queue.push_wait(make_item(producer, sequence));
+            ++sequence;
+            break;
+        case operation_kind::claim:
+            if (!produce_claimed(queue, producer, item_count, sequence))
+            {
+                relax(failure_count);
+            }
+            break;
+        case operation_kind::handle:
+            if (handle.push(make_item(producer, sequence)))
+            {
+                ++sequence;
+            }
+            else
+            {
+                relax(failure_count);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @returns The number of ordering violations this consumer saw.
+ */
+template <typename queue_type>
+size_t consume(queue_type& queue, const stress_config& config, const operation_kind kind,
+    std::atomic<size_t>& consumed_count, seen_tracker& seen)
+{
+    const size_t total_count = config.producer_count * config.items_per_producer;
+    std::vector<int64_t> last_sequence(config.producer_count, -1);
+    uint64_t items[max_bulk_count];
+    uint32_t failure_count = 0;
+    size_t violation_count = 0;
+    // Only used by operation_kind::handle. Everything it caches gets counted,
+    // so it's empty by the time the loop ends.
+    auto handle = queue.template make_consumer_handle<max_bulk_count>();
+
+    while (consumed_count.load(std::memory_order_relaxed) < total_count)
+    {
+        size_t popped_count = 0;
+
+        switch (kind)
+        {
+        case operation_kind::single:
+            popped_count = queue.pop(items[0]) ? 1 : 0;
+            break;
+        case operation_kind::bulk:
+            popped_count = queue.pop_bulk(items, max_bulk_count);
+            break;
+        case operation_kind::blocking:
+            // Time out now & then, to notice when the other consumers took the rest.
+            popped_count = queue.pop_wait_for(items[0], std::chrono::milliseconds(1)) ==
+                mpmc_result::ok ? 1 : 0;
+            break;
+        case operation_kind::claim:
+            popped_count = consume_claimed(queue, items);
+            break;
+        case operation_kind::handle:
+            popped_count = handle.pop(items[0]) ? 1 : 0;
+            break;
+        }
+
+        if (popped_count == 0)
+        {
+            relax(failure_count);
+            continue;
+        }
+
+        for (size_t i = 0; i < popped_count; ++i)
+        {
+            if (!seen.is_valid(items[i]))
+            {
+                ++violation_count;
+                continue;
+            }
+
+            const size_t producer = static_cast<size_t>(items[i] >> 32);
+            const size_t sequence = static_cast<size_t>(items[i] & 0xFFFFFFFFU);
+
+            if (keeps_producer_order<queue_type>::value &&
+                static_cast<int64_t>(sequence) <= last_sequence[producer])
+            {
+                ++violation_count;
+            }
+
+            last_sequence[producer] = static_cast<int64_t>(sequence);
+            seen.add(items[i]);
+        }
+
+        consumed_count.fetch_add(popped_count, std::memory_order_relaxed);
+    }
+
+    return violation_count;
+}
+
+/**
+ * Run one configuration.
+ * @returns Whether every item was delivered exactly once & in order.
+ */
+template <typename queue_type>
+bool run_stress(const char* name, const uint_least32_t capacity,
+    const stress_config& config, const operation_kind kind)
+{
+    seen_tracker seen(config);
+    std::atomic<size_t> consumed_count(0);
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    {
+        queue_type queue(capacity);
+
+        for (size_t i = 0; i < config.consumer_count; ++i)
+        {
+            threads.emplace_back([&]()
+            {
+                violation_count.fetch_add(consume(queue, config, kind, consumed_count, seen));
+            });
+        }
+
+        for (size_t i = 0; i < config.producer_count; ++i)
+        {
+            threads.emplace_back([&, i]()
+            {
+                produce(queue, i, config.items_per_producer, kind);
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Anything still in the queue was never delivered.
+        uint64_t left_over;
+
+        while (queue.pop(left_over))
+        {
+            violation_count.fetch_add(1);
+        }
+    }
+
+    const size_t duplicate_count = seen.count_duplicated();
+    const size_t lost_count = seen.count_mismatched() - duplicate_count;
+    const bool passed = lost_count == 0 && duplicate_count == 0 && violation_count == 0;
+
+    if (!report(passed, name, capacity, config.producer_count, config.consumer_count,
+        get_operation_name(kind)))
+    {
+        printf(" lost %zu, duplicated %zu, out of order or left over %zu\n",
+            lost_count, duplicate_count, violation_count.load());
+    }
+
+    return passed;
+}
+
+template <typename queue_type>
+bool run_all_kinds(const char* name, const uint_least32_t capacity, const stress_config& config)
+{
+    bool passed = true;
+
+    passed &= run_stress<queue_type>(name, capacity, config, operation_kind::single);
+    passed &= run_stress<queue_type>(name, capacity, config, operation_kind::bulk);
+    passed &= run_stress<queue_type>(name, capacity, config, operation_kind::blocking);
+    passed &= run_stress<queue_type>(name, capacity, config, operation_kind::claim);
+    passed &= run_stress<queue_type>(name, capacity, config, operation_kind::handle);
+
+    return passed;
+}
+
+/**
+ * Gives segmented_mpmc_queue the interface of the ring queues. The bulk &
+ * blocking operations fall back to single pushes & pops, since pushing
+ * never fails.
+ */
+class segmented_stress_queue
+{
+public:
+    explicit segmented_stress_queue(const uint_least32_t segment_size)
+        : queue(segment_size, 2)
+    {
+    }
+
+    bool push(const uint64_t item)
+    {
+        queue.push(item);
+        return true;
+    }
+
+    bool pop(uint64_t& item)
+    {
+        return queue.pop(item);
+    }
+
+    size_t push_bulk(const uint64_t* items, const size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            queue.push(items[i]);
+        }
+
+        return count;
+    }
+
+    size_t pop_bulk(uint64_t* items, const size_t max_count)
+    {
+        size_t count = 0;
+
+        while (count < max_count && queue.pop(items[count]))
+        {
+            ++count;
+        }
+
+        return count;
+    }
+
+    void push_wait(const uint64_t item)
+    {
+        queue.push(item);
+    }
+
+    template <typename Rep, typename Period>
+    mpmc_result pop_wait_for(uint64_t& item, const std::chrono::duration<Rep, Period>& /* timeout */)
+    {
+        return queue.pop(item) ? mpmc_result::ok : mpmc_result::timeout;
+    }
+
+    /** The segmented queue has no handles, so these push & pop directly. */
+    struct direct_handle
+    {
+        segmented_mpmc_queue<uint64_t>* queue;
+
+        bool push(const uint64_t item)
+        {
+            queue->push(item);
+            return true;
+        }
+
+        bool pop(uint64_t& item)
+        {
+            return queue->pop(item);
+        }
+    };
+
+    template <size_t batch_size>
+    direct_handle make_producer_handle()
+    {
+        return direct_handle{ &queue };
+    }
+
+    template <size_t batch_size>
+    direct_handle make_consumer_handle()
+    {
+        return direct_handle{ &queue };
+    }
+
+private:
+    segmented_mpmc_queue<uint64_t> queue;
+};
+
+/** The segmented queue has no claims, so these fall back to single pushes & pops. */
+bool produce_claimed(segmented_stress_queue& queue, const size_t producer,
+    const size_t /* item_count */, size_t& sequence)
+{
+    queue.push(make_item(producer, sequence++));
+    return true;
+}
+
+size_t consume_claimed(segmented_stress_queue& queue, uint64_t* items)
+{
+    return queue.pop(items[0]) ? 1 : 0;
+}
+
+/**
+ * Gives a queue that only has push & pop, such as the sharded & NUMA
+ * queues, the interface of the ring queues. The bulk & blocking operations
+ * fall back to retrying single pushes & pops.
+ */
+template <typename inner_type>
+class push_pop_stress_queue
+{
+public:
+    explicit push_pop_stress_queue(const uint_least32_t capacity)
+        : queue(capacity)
+    {
+    }
+
+    bool push(const uint64_t item)
+    {
+        return queue.push(item);
+    }
+
+    bool pop(uint64_t& item)
+    {
+        return queue.pop(item);
+    }
+
+    size_t push_bulk(const uint64_t* items, const size_t count)
+    {
+        size_t pushed_count = 0;
+
+        while (pushed_count < count && queue.push(items[pushed_count]))
+        {
+            ++pushed_count;
+        }
+
+        return pushed_count;
+    }
+
+    size_t pop_bulk(uint64_t* items, const size_t max_count)
+    {
+        size_t count = 0;
+
+        while (count < max_count && queue.pop(items[count]))
+        {
+            ++count;
+        }
+
+        return count;
+    }
+
+    void push_wait(const uint64_t item)
+    {
+        uint32_t failure_count = 0;
+
+        while (!queue.push(item))
+        {
+            relax(failure_count);
+        }
+    }
+
+    template <typename Rep, typename Period>
+    mpmc_result pop_wait_for(uint64_t& item, const std::chrono::duration<Rep, Period>& /* timeout */)
+    {
+        return queue.pop(item) ? mpmc_result::ok : mpmc_result::timeout;
+    }
+
+    /** There are no handles, so these push & pop directly. */
+    struct direct_handle
+    {
+        inner_type* queue;
+
+        bool push(const uint64_t item)
+        {
+            return queue->push(item);
+        }
+
+        bool pop(uint64_t& item)
+        {
+            return queue->pop(item);
+        }
+    };
+
+    template <size_t batch_size>
+    direct_handle make_producer_handle()
+    {
+        return direct_handle{ &queue };
+    }
+
+    template <size_t batch_size>
+    direct_handle make_consumer_handle()
+    {
+        return direct_handle{ &queue };
+    }
+
+private:
+    inner_type queue;
+};
+
+template <typename inner_type>
+struct keeps_producer_order<push_pop_stress_queue<inner_type>> : std::false_type
+{
+};
+
+/** There are no claims, so these fall back to single pushes & pops. */
+template <typename inner_type>
+bool produce_claimed(push_pop_stress_queue<inner_type>& queue, const size_t producer,
+    const size_t /* item_count */, size_t& sequence)
+{
+    if (!queue.push(make_item(producer, sequence)))
+    {
+        return false;
+    }
+
+    ++sequence;
+    return true;
+}
+
+template <typename inner_type>
+size_t consume_claimed(push_pop_stress_queue<inner_type>& queue, uint64_t* items)
+{
+    return queue.pop(items[0]) ? 1 : 0;
+}
+
+/** Fewer shards than threads, so threads share home shards as well. */
+typedef push_pop_stress_queue<sharded_mpmc_queue<uint64_t, 3>> sharded_stress_queue;
+typedef push_pop_stress_queue<numa_mpmc_queue<uint64_t>> numa_stress_queue;
+
+/**
+ * Three nodes laid out by hand, with node 2 nearer to nodes 0 & 1 than they
+ * are to each other, and every CPU on node 0, so the NUMA queue spills over
+ * & steals between rings on a machine with one node too.
+ */
+const mpmc_detail::numa_topology& get_three_node_topology()
+{
+    static const mpmc_detail::numa_topology topology({ -1, -1, -1 },
+        { { 10, 30, 20 }, { 30, 10, 20 }, { 20, 20, 10 } });
+
+    return topology;
+}
+
+/** A NUMA queue over the three nodes laid out by hand. */
+class three_node_numa_queue
+{
+public:
+    explicit three_node_numa_queue(const uint_least32_t node_size)
+        : queue(node_size, get_three_node_topology())
+    {
+    }
+
+    bool push(const uint64_t item)
+    {
+        return queue.push(item);
+    }
+
+    bool pop(uint64_t& item)
+    {
+        return queue.pop(item);
+    }
+
+private:
+    numa_mpmc_queue<uint64_t> queue;
+};
+
+typedef push_pop_stress_queue<three_node_numa_queue> three_node_stress_queue;
+
+#if !defined(_WIN32)
+/**
+ * @returns A shm_open name no other run of the test is using.
+ */
+std::string make_shared_name()
+{
+    static std::atomic<uint32_t> name_count(0);
+
+    return "/mpmc_stress_" + std::to_string(getpid()) + "_" +
+        std::to_string(name_count.fetch_add(1));
+}
+
+/**
+ * Gives a shared_mpmc_queue region the interface of the ring queues, with
+ * one queue creating it to push through & another attaching to it to pop
+ * through. Each maps the region at its own address, so anything kept in
+ * it that isn't an offset shows up.
+ */
+class shared_stress_queue
+{
+    typedef shared_mpmc_queue<uint64_t> queue_type;
+
+public:
+    explicit shared_stress_queue(const uint_least32_t capacity)
+        : name_(make_shared_name()),
+        creator_(mpmc_shared_open::create, name_.c_str(), capacity),
+        attacher_(mpmc_shared_open::attach, name_.c_str())
+    {
+    }
+
+    bool push(const uint64_t item)
+    {
+        return creator_.push(item);
+    }
+
+    bool pop(uint64_t& item)
+    {
+        return attacher_.pop(item);
+    }
+
+    mpmc_result try_push(const uint64_t item)
+    {
+        return creator_.try_push(item);
+    }
+
+    mpmc_result try_pop(uint64_t& item)
+    {
+        return attacher_.try_pop(item);
+    }
+
+    size_t push_bulk(const uint64_t* items, const size_t count)
+    {
+        return creator_.push_bulk(items, count);
+    }
+
+    size_t pop_bulk(uint64_t* items, const size_t max_count)
+    {
+        return attacher_.pop_bulk(items, max_count);
+    }
+
+    mpmc_result push_wait(const uint64_t item)
+    {
+        return creator_.push_wait(item);
+    }
+
+    mpmc_result pop_wait(uint64_t& item)
+    {
+        return attacher_.pop_wait(item);
+    }
+
+    template <typename Rep, typename Period>
+    mpmc_result pop_wait_for(uint64_t& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return attacher_.pop_wait_for(item, timeout);
+    }
+
+    auto try_claim()
+    {
+        return creator_.try_claim();
+    }
+
+    auto try_claim_bulk(const size_t max_count)
+    {
+        return creator_.try_claim_bulk(max_count);
+    }
+
+    auto try_peek_bulk(const size_t max_count)
+    {
+        return attacher_.try_peek_bulk(max_count);
+    }
+
+    template <size_t batch_size>
+    auto make_producer_handle()
+    {
+        return creator_.make_producer_handle<batch_size>();
+    }
+
+    template <size_t batch_size>
+    auto make_consumer_handle()
+    {
+        return attacher_.make_consumer_handle<batch_size>();
+    }
+
+    /** Closed through the attacher, so the creator has to see it through the region. */
+    void close()
+    {
+        attacher_.close();
+    }
+
+    bool empty() const
+    {
+        return creator_.empty();
+    }
+
+private:
+    std::string name_;
+    queue_type creator_;
+    queue_type attacher_;
+};
+
+/**
+ * @returns Whether attaching to name as a queue_type is refused.
+ */
+template <typename queue_type>
+bool is_attach_rejected(const std::string& name)
+{
+    try
+    {
+        queue_type queue(mpmc_shared_open::attach, name.c_str(), 0,
+            mpmc_shared_backing::posix_shm, std::chrono::milliseconds(5));
+        return false;
+    }
+    catch (const std::runtime_error&)
+    {
+        return true;
+    }
+}
+
+/**
+ * Create a region, then check that attaching is refused for another
+ * element size, and once its version or magic is overwritten, and that
+ * it's accepted again once they're put back.
+ * @returns Whether the run passed.
+ */
+bool run_shared_header_checks()
+{
+    typedef mpmc_detail::shared_ring_header shared_ring_header;
+
+    const std::string name = make_shared_name();
+    shared_mpmc_queue<uint64_t> creator(mpmc_shared_open::create, name.c_str(), 16);
+    // A raw view of the region, to tamper with its header.
+    mpmc_detail::shared_memory_region region(mpmc_shared_open::attach, name.c_str(), 0,
+        mpmc_shared_backing::posix_shm, std::chrono::seconds(1));
+    shared_ring_header& header = *static_cast<shared_ring_header*>(region.address);
+
+    const bool rejects_element_size = is_attach_rejected<shared_mpmc_queue<uint32_t>>(name);
+    const bool rejects_mode = is_attach_rejected<shared_mpmc_queue<uint64_t,
+        mpmc_pause_backoff, mpmc_auto_layout, mpmc_mode_spsc>>(name);
+
+    header.version = shared_ring_header::current_version + 1;
+    const bool rejects_version = is_attach_rejected<shared_mpmc_queue<uint64_t>>(name);
+    header.version = shared_ring_header::current_version;
+
+    header.magic.store(~shared_ring_header::expected_magic, std::memory_order_release);
+    const bool rejects_magic = is_attach_rejected<shared_mpmc_queue<uint64_t>>(name);
+    header.magic.store(shared_ring_header::expected_magic, std::memory_order_release);
+
+    const bool accepts_match = !is_attach_rejected<shared_mpmc_queue<uint64_t>>(name);
+    const bool passed = rejects_element_size && rejects_mode && rejects_version &&
+        rejects_magic && accepts_match;
+
+    if (!report(passed, "shared", creator.capacity(), 1, 1, "header"))
+    {
+        printf(" element size %s, mode %s, version %s, magic %s, match %s\n",
+            rejects_element_size ? "rejected" : "accepted", rejects_mode ? "rejected" : "accepted",
+            rejects_version ? "rejected" : "accepted", rejects_magic ? "rejected" : "accepted",
+            accepts_match ? "accepted" : "rejected");
+    }
+
+    return passed;
+}
+#endif
+
+/**
+ * Check the NUMA queue over the three nodes laid out by hand: pushes on
+ * node 0 spill over nearest node first, pops steal from the nearest node
+ * that isn't empty, and push_to & pop_from keep each node's ring FIFO.
+ * @returns Whether the run passed.
+ */
+bool run_numa_topology_checks()
+{
+    numa_mpmc_queue<uint64_t> queue(2, get_three_node_topology());
+    uint64_t item = 0;
+
+    // Node 0 fills up, then node 2 as it's nearest, then node 1.
+    bool spills_nearest = true;
+
+    for (uint64_t i = 0; i < 6; ++i)
+    {
+        spills_nearest &= queue.push(i);
+    }
+
+    spills_nearest &= !queue.push(6);
+
+    // Which items each node's ring should hold, by node index.
+    const uint64_t first_spilled[] = { 0, 4, 2 };
+
+    for (size_t node_index = 0; node_index < 3; ++node_index)
+    {
+        for (uint64_t i = 0; i < 2; ++i)
+        {
+            spills_nearest &= queue.pop_from(node_index, item) &&
+                item == first_spilled[node_index] + i;
+        }
+    }
+
+    // Node 0 is empty, so the pops steal from node 2 before node 1.
+    queue.push_to(1, 10);
+    queue.push_to(2, 20);
+    queue.push_to(1, 11);
+    queue.push_to(2, 21);
+
+    bool steals_nearest = true;
+    const uint64_t stolen_order[] = { 20, 21, 10, 11 };
+
+    for (const uint64_t expected : stolen_order)
+    {
+        steals_nearest &= queue.pop(item) && item == expected;
+    }
+
+    steals_nearest &= !queue.pop(item);
+
+    // Interleaved across nodes, each node's ring still pops in push order.
+    bool keeps_node_order = true;
+
+    for (uint64_t i = 0; i < 2; ++i)
+    {
+        for (size_t node_index = 0; node_index < 3; ++node_index)
+        {
+            keeps_node_order &= queue.push_to(node_index, node_index * 100 + i);
+        }
+    }
+
+    for (size_t node_index = 0; node_index < 3; ++node_index)
+    {
+        for (uint64_t i = 0; i < 2; ++i)
+        {
+            keeps_node_order &= queue.pop_from(node_index, item) && item == node_index * 100 + i;
+        }
+    }
+
+    const bool passed = queue.get_node_count() == 3 && spills_nearest && steals_nearest &&
+        keeps_node_order;
+
+    if (!report(passed, "numa/3 nodes", queue.capacity(), 1, 1, "topology"))
+    {
+        printf(" nodes %zu, spill %s, steal %s, node order %s\n", queue.get_node_count(),
+            spills_nearest ? "nearest first" : "wrong", steals_nearest ? "nearest first" : "wrong",
+            keeps_node_order ? "kept" : "broken");
+    }
+
+    return passed;
+}
+
+/**
+ * Run the broadcast queue with two independent subscribers & a third that
+ * depends on both. Every subscriber must see every item once & in order per
+ * producer, and the dependent one must only see items both others have read.
+ * @returns Whether it passed.
+ */
+bool run_broadcast_stress(const uint_least32_t capacity, const stress_config& config)
+{
+    typedef broadcast_mpmc_queue<uint64_t> queue_type;
+
+    seen_tracker seen(config);
+    const size_t total_count = seen.get_total_count();
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    queue_type queue(capacity);
+    const queue_type::subscriber first = queue.subscribe();
+    const queue_type::subscriber second = queue.subscribe();
+    const queue_type::subscriber dependent = queue.subscribe({ first, second });
+
+    const auto read_all = [&](const queue_type::subscriber reader, const bool is_dependent)
+    {
+        std::vector<int64_t> last_sequence(config.producer_count, -1);
+        uint32_t failure_count = 0;
+        size_t read_count = 0;
+        size_t local_violation_count = 0;
+
+        while (read_count < total_count)
+        {
+            const size_t polled_count = reader.poll([&](const uint64_t& item)
+            {
+                const size_t producer = static_cast<size_t>(item >> 32);
+                const size_t sequence = static_cast<size_t>(item & 0xFFFFFFFFU);
+
+                if (!seen.is_valid(item) ||
+                    static_cast<int64_t>(sequence) <= last_sequence[producer])
+                {
+                    ++local_violation_count;
+                    return;
+                }
+
+                last_sequence[producer] = static_cast<int64_t>(sequence);
+                std::atomic<uint8_t>& count = seen.get(item);
+
+                if (is_dependent)
+                {
+                    local_violation_count += count.load(std::memory_order_relaxed) == 2 ? 0 : 1;
+                }
+                else
+                {
+                    count.fetch_add(1, std::memory_order_relaxed);
+                }
+            }, max_bulk_count);
+
+            if (polled_count == 0)
+            {
+                relax(failure_count);
+            }
+
+            read_count += polled_count;
+        }
+
+        violation_count.fetch_add(local_violation_count);
+    };
+
+    threads.emplace_back(read_all, first, false);
+    threads.emplace_back(read_all, second, false);
+    threads.emplace_back(read_all, dependent, true);
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            uint32_t failure_count = 0;
+
+            for (size_t sequence = 0; sequence < config.items_per_producer; )
+            {
+                if (queue.push(make_item(i, sequence)))
+                {
+                    ++sequence;
+                }
+                else
+                {
+                    relax(failure_count);
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t lost_count = seen.count_mismatched(2);
+    const bool passed = lost_count == 0 && violation_count == 0;
+
+    if (!report(passed, "broadcast", capacity, config.producer_count, 3, "fan-out"))
+    {
+        printf(" lost or duplicated %zu, out of order or early %zu\n",
+            lost_count, violation_count.load());
+    }
+
+    return passed;
+}
+
+/**
+ * Close the queue while producers are still blocked pushing into it.
+ * Consumers pop until they see closed, so every push that returned ok must
+ * have been popped exactly once, & nothing may be pushed or popped after.
+ * @returns Whether it passed.
+ */
+template <typename queue_type>
+bool run_close_stress(const char* name, const uint_least32_t capacity,
+    const stress_config& config)
+{
+    seen_tracker seen(config);
+    const size_t total_count = seen.get_total_count();
+    std::atomic<size_t> pushed_count(0);
+    std::atomic<size_t> consumed_count(0);
+    std::vector<std::thread> threads;
+
+    queue_type queue(capacity);
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint64_t item;
+
+            while (queue.pop_wait(item) == mpmc_result::ok)
+            {
+                seen.add(item);
+                consumed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            for (size_t sequence = 0; sequence < config.items_per_producer; ++sequence)
+            {
+                if (queue.push_wait(make_item(i, sequence)) != mpmc_result::ok)
+                {
+                    break;
+                }
+
+                pushed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    // Close part way through, so some producers are still pushing.
+    while (consumed_count.load(std::memory_order_relaxed) < total_count / 2)
+    {
+        std::this_thread::yield();
+    }
+
+    queue.close();
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t duplicate_count = seen.count_duplicated();
+    uint64_t item = 0;
+    const bool stayed_closed = queue.try_push(item) == mpmc_result::closed &&
+        queue.try_pop(item) == mpmc_result::closed && queue.empty();
+    const bool passed = duplicate_count == 0 && stayed_closed &&
+        consumed_count.load() == pushed_count.load();
+
+    if (!report(passed, name, capacity, config.producer_count, config.consumer_count, "close"))
+    {
+        printf(" pushed %zu, popped %zu, duplicated %zu, %s\n", pushed_count.load(),
+            consumed_count.load(), duplicate_count, stayed_closed ? "closed" : "reopened");
+    }
+
+    return passed;
+}
+
+/**
+ * Pass objects from a small pool through a queue of pointers, with the
+ * consumers releasing what the producers acquired. Each object counts its
+ * owners, so handing one object to two threads at once shows up.
+ * @returns Whether it passed.
+ */
+bool run_pool_stress(const stress_config& config)
+{
+    struct pooled_item
+    {
+        explicit pooled_item(const uint64_t in_item)
+            : item(in_item),
+            owner_count(0)
+        {
+        }
+
+        uint64_t item;
+        std::atomic<uint32_t> owner_count;
+    };
+
+    // Fewer objects than the queue holds, so producers also wait on the pool.
+    mpmc_object_pool<pooled_item, 16> pool;
+    dynamic_mpmc_queue<pooled_item*> queue(64);
+    seen_tracker seen(config);
+    const size_t total_count = seen.get_total_count();
+    std::atomic<size_t> consumed_count(0);
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+            pooled_item* object;
+
+            while (consumed_count.load(std::memory_order_relaxed) < total_count)
+            {
+                if (!queue.pop(object))
+                {
+                    relax(failure_count);
+                    continue;
+                }
+
+                seen.add(object->item);
+
+                if (object->owner_count.fetch_sub(1, std::memory_order_relaxed) != 1)
+                {
+                    violation_count.fetch_add(1);
+                }
+
+                pool.release(object);
+                consumed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            uint32_t failure_count = 0;
+
+            for (size_t sequence = 0; sequence < config.items_per_producer; ++sequence)
+            {
+                pooled_item* object;
+
+                while ((object = pool.acquire(make_item(i, sequence))) == nullptr)
+                {
+                    relax(failure_count);
+                }
+
+                if (object->owner_count.fetch_add(1, std::memory_order_relaxed) != 0 ||
+                    !pool.owns(object))
+                {
+                    violation_count.fetch_add(1);
+                }
+
+                while (!queue.push(object))
+                {
+                    relax(failure_count);
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t lost_count = seen.count_mismatched();
+    const bool passed = lost_count == 0 && violation_count == 0;
+
+    if (!report(passed, "object_pool", pool.capacity(), config.producer_count,
+        config.consumer_count, "recycle"))
+    {
+        printf(" lost or duplicated %zu, shared %zu\n", lost_count, violation_count.load());
+    }
+
+    return passed;
+}
+
+/**
+ * Producers spread their items over the lanes of a small priority queue,
+ * so lanes keep filling & draining and their mask bits keep flipping.
+ * Once the producers are done, a failed pop must mean every lane is empty,
+ * so an element stranded behind a cleared bit shows up as lost.
+ * A single thread then checks that a weighted policy starts each lane's
+ * share of the pops from it while every lane is busy.
+ * @returns Whether the run passed.
+ */
+bool run_priority_stress(const stress_config& config)
+{
+    constexpr size_t lane_count = 4;
+    constexpr uint_least32_t lane_size = 8;
+    typedef multi_priority_mpmc_queue<uint64_t, lane_count, lane_size,
+        mpmc_weighted_priority<4, 2, 1, 1>> queue_type;
+
+    queue_type queue;
+    seen_tracker seen(config);
+    std::atomic<size_t> finished_producer_count(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+            uint64_t item;
+
+            while(true)
+            {
+                // Read first, so a failed pop after it saw every push.
+                const bool producers_done = finished_producer_count.load(
+                    std::memory_order_acquire) == config.producer_count;
+
+                if (queue.pop(item))
+                {
+                    seen.add(item);
+                }
+                else if (producers_done)
+                {
+                    break;
+                }
+                else
+                {
+                    relax(failure_count);
+                }
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            uint32_t failure_count = 0;
+
+            for (size_t sequence = 0; sequence < config.items_per_producer; ++sequence)
+            {
+                while (!queue.push((i + sequence) % lane_count, make_item(i, sequence)))
+                {
+                    relax(failure_count);
+                }
+            }
+
+            finished_producer_count.fetch_add(1, std::memory_order_release);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t lost_count = seen.count_mismatched();
+    const bool drained = lost_count == 0 && queue.empty_approx();
+
+    if (!report(drained, "priority/weighted", lane_count * lane_size, config.producer_count,
+        config.consumer_count, "single"))
+    {
+        printf(" lost or duplicated %zu, %s\n", lost_count,
+            queue.empty_approx() ? "empty" : "mask left set");
+    }
+
+    // Weights 4, 2, 1 & 1 over 8 pops, so 64 pops from full lanes take
+    // 32, 16, 8 & 8, wherever in its schedule the thread starts. The pops
+    // alternate with another queue's, which keeps a schedule of its own.
+    queue_type other_queue;
+    queue_type* const queues[] = { &queue, &other_queue };
+    size_t lane_pop_counts[2][lane_count] = {};
+
+    std::thread([&]()
+    {
+        for (queue_type* const current : queues)
+        {
+            for (size_t lane = 0; lane < lane_count; ++lane)
+            {
+                for (uint_least32_t i = 0; i < lane_size; ++i)
+                {
+                    current->push(lane, 0);
+                }
+            }
+        }
+
+        uint64_t item;
+        size_t lane;
+
+        for (size_t i = 0; i < 2 * 64; ++i)
+        {
+            // Refill the lane, so it never runs dry & passes its turn on.
+            if (queues[i % 2]->pop(item, lane))
+            {
+                ++lane_pop_counts[i % 2][lane];
+                queues[i % 2]->push(lane, item);
+            }
+        }
+    }).join();
+
+    bool weighted = true;
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        const size_t* const counts = lane_pop_counts[i];
+
+        weighted &= counts[0] == 32 && counts[1] == 16 && counts[2] == 8 && counts[3] == 8;
+    }
+
+    if (!report(weighted, "priority/weighted", lane_count * lane_size, 1, 1, "schedule"))
+    {
+        printf(" popped %zu, %zu, %zu & %zu, and %zu, %zu, %zu & %zu\n",
+            lane_pop_counts[0][0], lane_pop_counts[0][1], lane_pop_counts[0][2],
+            lane_pop_counts[0][3], lane_pop_counts[1][0], lane_pop_counts[1][1],
+            lane_pop_counts[1][2], lane_pop_counts[1][3]);
+    }
+
+    return drained && weighted;
+}
+
+/**
+ * Clients (the producers) call servers (the consumers) through a small
+ * channel, alternating between blocking calls & try_call, and check that
+ * every reply answers their own request. Every request must be served once.
+ * @returns Whether the run passed.
+ */
+bool run_rpc_stress(const stress_config& config)
+{
+    struct rpc_reply
+    {
+        uint64_t item = 0;
+        uint64_t answer = 0;
+    };
+
+    // Fewer nodes than clients, so calls also wait for replies to be collected.
+    rpc_channel<uint64_t, rpc_reply, 4> channel;
+    seen_tracker seen(config);
+    const size_t total_count = seen.get_total_count();
+    std::atomic<size_t> served_count(0);
+    std::atomic<size_t> mismatch_count(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+
+            while (served_count.load(std::memory_order_relaxed) < total_count)
+            {
+                const bool served = channel.serve_one([&](const uint64_t item)
+                {
+                    seen.add(item);
+
+                    rpc_reply reply;
+                    reply.item = item;
+                    reply.answer = ~item;
+                    return reply;
+                });
+
+                if (served)
+                {
+                    served_count.fetch_add(1, std::memory_order_relaxed);
+                }
+                else
+                {
+                    relax(failure_count);
+                }
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            uint32_t failure_count = 0;
+
+            for (size_t sequence = 0; sequence < config.items_per_producer; ++sequence)
+            {
+                const uint64_t item = make_item(i, sequence);
+                rpc_reply reply;
+
+                if ((sequence & 1) == 0)
+                {
+                    reply = channel.call(item);
+                }
+                else
+                {
+                    while(true)
+                    {
+                        auto pending = channel.try_call(item);
+
+                        if (pending)
+                        {
+                            reply = pending.wait();
+                            break;
+                        }
+
+                        relax(failure_count);
+                    }
+                }
+
+                if (reply.item != item || reply.answer != ~item)
+                {
+                    mismatch_count.fetch_add(1);
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t lost_count = seen.count_mismatched();
+    const bool passed = lost_count == 0 && mismatch_count == 0;
+
+    if (!report(passed, "rpc_channel", channel.capacity(), config.producer_count,
+        config.consumer_count, "call"))
+    {
+        printf(" lost or duplicated %zu, mismatched %zu\n", lost_count, mismatch_count.load());
+    }
+
+    return passed;
+}
+
+/**
+ * Fill a channel of strings with calls nobody serves yet, then make a
+ * blocking call that has to retry until a node frees up. The request must
+ * reach the server whole, however many times the call retried.
+ * @returns Whether the run passed.
+ */
+bool run_rpc_full_stress()
+{
+    rpc_channel<std::string, std::string, 2> channel;
+    const std::string real_request = "the-real-request";
+    std::atomic<size_t> served_count(0);
+
+    auto first = channel.try_call(std::string("first"));
+    auto second = channel.try_call(std::string("second"));
+    std::string rejected = "rejected";
+    const bool was_full = first && second && !channel.try_call(std::move(rejected)) &&
+        rejected == "rejected";
+
+    std::string reply;
+    std::thread caller([&]()
+    {
+        reply = channel.call(real_request);
+    });
+
+    // Let the caller fail against the full channel for a while.
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    std::thread server([&]()
+    {
+        uint32_t failure_count = 0;
+
+        while (served_count.load(std::memory_order_relaxed) < 3)
+        {
+            if (channel.serve_one([](const std::string& request)
+            {
+                return "echo:" + request;
+            }))
+            {
+                served_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                relax(failure_count);
+            }
+        }
+    });
+
+    const bool first_answered = first.wait() == "echo:first";
+    const bool second_answered = second.wait() == "echo:second";
+    first.release();
+    second.release();
+    caller.join();
+    server.join();
+
+    const bool passed = was_full && first_answered && second_answered &&
+        reply == "echo:" + real_request;
+
+    if (!report(passed, "rpc_channel/string", channel.capacity(), 1, 1, "full"))
+    {
+        printf(" %s, replied '%s'\n", was_full ? "was full" : "wasn't full", reply.c_str());
+    }
+
+    return passed;
+}
+
+/**
+ * Fill a channel whose size isn't a power of two with calls nobody serves
+ * yet. It must take exactly capacity() of them, the size rounded up.
+ * @returns Whether the run passed.
+ */
+bool run_rpc_capacity_check()
+{
+    typedef rpc_channel<uint64_t, uint64_t, 3> channel_type;
+
+    channel_type channel;
+    std::vector<channel_type::pending_call> calls;
+
+    calls.reserve(channel.capacity() + 1);
+
+    while (calls.size() <= channel.capacity())
+    {
+        channel_type::pending_call call = channel.try_call(calls.size());
+
+        if (!call)
+        {
+            break;
+        }
+
+        calls.push_back(std::move(call));
+    }
+
+    const size_t sent_count = calls.size();
+
+    for (size_t served_count = 0; served_count < sent_count;)
+    {
+        served_count += channel.serve_one([](const uint64_t request)
+        {
+            return request + 1;
+        }) ? 1 : 0;
+    }
+
+    bool answered = true;
+
+    for (size_t i = 0; i < sent_count; ++i)
+    {
+        answered &= calls[i].wait() == i + 1;
+        calls[i].release();
+    }
+
+    const bool passed = channel.capacity() == 4 && sent_count == channel.capacity() && answered;
+
+    if (!report(passed, "rpc_channel/3", channel.capacity(), 1, 1, "capacity"))
+    {
+        printf(" took %zu calls, %s\n", sent_count, answered ? "answered" : "misanswered");
+    }
+
+    return passed;
+}
+
+/**
+ * Producers push into a lossy ring far faster than it can hold, never
+ * waiting on the consumers. Every popped element must be whole & popped
+ * once, and once drained, every push must be either popped or counted as
+ * overwritten.
+ * @returns Whether the run passed.
+ */
+bool run_lossy_stress(const uint_least32_t capacity, const stress_config& config)
+{
+    struct lossy_item
+    {
+        uint64_t item;
+        uint64_t check;
+    };
+
+    lossy_mpmc_queue<lossy_item> queue(capacity);
+    seen_tracker seen(config);
+    const size_t total_count = seen.get_total_count();
+    std::atomic<size_t> finished_producer_count(0);
+    std::atomic<size_t> consumed_count(0);
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+            lossy_item element;
+
+            while(true)
+            {
+                if (!queue.pop(element))
+                {
+                    if (finished_producer_count.load(std::memory_order_acquire) ==
+                        config.producer_count && queue.size_approx() == 0)
+                    {
+                        break;
+                    }
+
+                    relax(failure_count);
+                    continue;
+                }
+
+                if (element.check != ~element.item || !seen.is_valid(element.item) ||
+                    seen.add(element.item) != 0)
+                {
+                    violation_count.fetch_add(1);
+                }
+
+                consumed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            for (size_t sequence = 0; sequence < config.items_per_producer; ++sequence)
+            {
+                const uint64_t item = make_item(i, sequence);
+                queue.push(lossy_item{ item, ~item });
+            }
+
+            finished_producer_count.fetch_add(1, std::memory_order_release);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const size_t accounted_count = consumed_count.load() +
+        static_cast<size_t>(queue.overwritten_count());
+    const bool passed = accounted_count == total_count && violation_count == 0;
+
+    if (!report(passed, "lossy", queue.capacity(), config.producer_count,
+        config.consumer_count, "single"))
+    {
+        printf(" accounted for %zu of %zu, torn or duplicated %zu\n", accounted_count,
+            total_count, violation_count.load());
+    }
+
+    return passed;
+}
+
+/**
+ * Each producer pushes a rising sequence to a slice of keys of its own, so
+ * most updates are conflated. Every popped value must be whole, and once
+ * drained, the last value pushed to every key must have been popped.
+ * @returns Whether the run passed.
+ */
+bool run_conflating_stress(const stress_config& config)
+{
+    struct conflating_item
+    {
+        uint64_t sequence;
+        uint64_t check;
+    };
+
+    constexpr size_t keys_per_producer = 32;
+    conflating_mpmc_queue<uint32_t, conflating_item, 1024> queue;
+    const size_t key_count = config.producer_count * keys_per_producer;
+    std::unique_ptr<std::vector<std::atomic<uint64_t>>> latest(
+        new std::vector<std::atomic<uint64_t>>(key_count));
+    std::atomic<size_t> finished_producer_count(0);
+    std::atomic<size_t> consumed_count(0);
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    if (key_count > queue.capacity())
+    {
+        printf("SKIP  %-24s more keys than capacity %u\n", "conflating",
+            static_cast<unsigned>(queue.capacity()));
+        return true;
+    }
+
+    for (std::atomic<uint64_t>& sequence : *latest)
+    {
+        sequence.store(0, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < config.consumer_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+            uint32_t key;
+            conflating_item element;
+
+            while(true)
+            {
+                if (!queue.pop(key, element))
+                {
+                    if (finished_producer_count.load(std::memory_order_acquire) ==
+                        config.producer_count && queue.size_approx() == 0)
+                    {
+                        break;
+                    }
+
+                    relax(failure_count);
+                    continue;
+                }
+
+                if (element.check != ~element.sequence || key >= key_count)
+                {
+                    violation_count.fetch_add(1);
+                    continue;
+                }
+
+                std::atomic<uint64_t>& key_latest = (*latest)[key];
+                uint64_t seen = key_latest.load(std::memory_order_relaxed);
+
+                while (seen < element.sequence && !key_latest.compare_exchange_weak(seen,
+                    element.sequence, std::memory_order_relaxed))
+                {
+                }
+
+                consumed_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < config.producer_count; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            for (size_t sequence = 1; sequence <= config.items_per_producer; ++sequence)
+            {
+                const uint32_t key = static_cast<uint32_t>(
+                    i * keys_per_producer + sequence % keys_per_producer);
+
+                if (!queue.push(key, conflating_item{ sequence, ~uint64_t{sequence} }))
+                {
+                    violation_count.fetch_add(1);
+                }
+            }
+
+            finished_producer_count.fetch_add(1, std::memory_order_release);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    size_t stale_count = 0;
+
+    for (size_t key = 0; key < key_count; ++key)
+    {
+        // The last sequence the key's producer gave it, 0 if it gave none.
+        const size_t offset = key % keys_per_producer;
+        const size_t last_sequence = config.items_per_producer < offset ? 0 :
+            config.items_per_producer - (config.items_per_producer - offset) % keys_per_producer;
+
+        stale_count += (*latest)[key].load(std::memory_order_relaxed) == last_sequence ? 0 : 1;
+    }
+
+    const bool passed = stale_count == 0 && violation_count == 0;
+
+    if (!report(passed, "conflating", queue.capacity(), config.producer_count,
+        config.consumer_count, "latest"))
+    {
+        printf(" stale %zu, torn or rejected %zu, popped %zu of %zu\n", stale_count,
+            violation_count.load(), consumed_count.load(),
+            config.producer_count * config.items_per_producer);
+    }
+
+    return passed;
+}
+
+#if MPMC_HAS_DOUBLE_WIDTH_CAS
+/**
+ * Every thread, producers & consumers alike, pops nodes off a small Treiber
+ * stack & pushes them straight back, the pattern that hits ABA when the
+ * head is a bare pointer: a thread that stalls between reading head &
+ * head->next can find the same head back on top with a different next.
+ * The tag makes that CAS fail. No node may be held by two threads at once,
+ * and every node must be back at the end.
+ * @returns Whether the run passed.
+ */
+bool run_tagged_stack_stress(const stress_config& config)
+{
+    struct stack_node
+    {
+        std::atomic<stack_node*> next;
+        std::atomic<uint32_t> owner_count;
+    };
+
+    constexpr size_t node_count = 8;
+    stack_node nodes[node_count];
+    mpmc_detail::atomic_tagged_pointer<stack_node> head;
+    std::atomic<size_t> violation_count(0);
+    std::vector<std::thread> threads;
+
+    const auto push_node = [&head](stack_node* const node)
+    {
+        auto top = head.load();
+
+        do
+        {
+            node->next.store(top.pointer, std::memory_order_relaxed);
+        } while (!head.compare_exchange(top, node));
+    };
+
+    for (stack_node& node : nodes)
+    {
+        node.owner_count.store(0, std::memory_order_relaxed);
+        push_node(&node);
+    }
+
+    const size_t thread_count = config.producer_count + config.consumer_count;
+
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            uint32_t failure_count = 0;
+
+            for (size_t operation = 0; operation < config.items_per_producer; ++operation)
+            {
+                auto top = head.load();
+
+                while (top.pointer != nullptr && !head.compare_exchange(top,
+                    top.pointer->next.load(std::memory_order_relaxed)))
+                {
+                }
+
+                if (top.pointer == nullptr)
+                {
+                    relax(failure_count);
+                    continue;
+                }
+
+                if (top.pointer->owner_count.fetch_add(1, std::memory_order_relaxed) != 0)
+                {
+                    violation_count.fetch_add(1);
+                }
+
+                top.pointer->owner_count.fetch_sub(1, std::memory_order_relaxed);
+                push_node(top.pointer);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    size_t returned_count = 0;
+
+    for (stack_node* node = head.load().pointer; node != nullptr && returned_count <= node_count;
+        node = node->next.load(std::memory_order_relaxed))
+    {
+        ++returned_count;
+    }
+
+    const bool passed = returned_count == node_count && violation_count == 0;
+
+    if (!report(passed, "tagged_stack", node_count, config.producer_count,
+        config.consumer_count, "dwcas"))
+    {
+        printf(" returned %zu of %zu, shared %zu\n", returned_count, node_count,
+            violation_count.load());
+    }
+
+    return passed;
+}
+#endif
+
+template <typename backoff_policy, typename slot_layout, typename concurrency_mode,
+    typename wait_policy = mpmc_sleep_wait>
+using stress_queue = dynamic_mpmc_queue<uint64_t, backoff_policy, slot_layout,
+    mpmc_aligned_allocator, concurrency_mode, mpmc_no_stats, wait_policy>;
+
+size_t parse_count(const int argc, char** argv, const int index, const size_t fallback)
+{
+    if (index >= argc)
+    {
+        return fallback;
+    }
+
+    const long value = strtol(argv[index], nullptr, 10);
+    return value > 0 ? static_cast<size_t>(value) : fallback;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t default_thread_count = std::max(2U, std::thread::hardware_concurrency());
+    const stress_config config = {
+        parse_count(argc, argv, 1, default_thread_count),
+        parse_count(argc, argv, 2, default_thread_count),
+        parse_count(argc, argv, 3, 100000)
+    };
+    const stress_config many_to_one = { config.producer_count, 1, config.items_per_producer };
+    const stress_config one_to_many = { 1, config.consumer_count, config.items_per_producer };
+    const stress_config one_to_one = { 1, 1, config.items_per_producer };
+    bool passed = true;
+
+    // Capacities of 2 & 4 make every producer lap the consumers constantly.
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpmc>>("mpmc", 2, config);
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpmc>>("mpmc", 64, config);
+    passed &= run_all_kinds<stress_queue<mpmc_exponential_backoff<>, mpmc_packed_layout,
+        mpmc_mode_mpmc>>("mpmc/packed/exponential", 4, config);
+    passed &= run_all_kinds<stress_queue<mpmc_yield_backoff, mpmc_remapped_layout,
+        mpmc_mode_mpmc>>("mpmc/remapped/yield", 256, config);
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpsc>>("mpsc", 4, many_to_one);
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_spmc>>("spmc", 4, one_to_many);
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_spsc>>("spsc", 2, one_to_one);
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_spsc>>("spsc", 1024, one_to_one);
+    // Without sleeping, the blocking operations keep yielding instead.
+    passed &= run_all_kinds<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpmc, mpmc_no_wait>>("mpmc/no wait", 4, config);
+    // Tiny segments, so segments are linked, retired & reused constantly.
+    passed &= run_stress<segmented_stress_queue>("segmented", 4, config, operation_kind::single);
+    passed &= run_stress<segmented_stress_queue>("segmented", 64, config, operation_kind::bulk);
+    // Tiny shards spill over & get stolen from constantly.
+    passed &= run_stress<sharded_stress_queue>("sharded", 2, config, operation_kind::single);
+    passed &= run_stress<sharded_stress_queue>("sharded", 64, config, operation_kind::bulk);
+    // One ring per node, or a single ring where sysfs only shows one node.
+    passed &= run_stress<numa_stress_queue>("numa", 2, config, operation_kind::single);
+    passed &= run_stress<numa_stress_queue>("numa", 64, config, operation_kind::bulk);
+    passed &= run_stress<three_node_stress_queue>("numa/3 nodes", 2, config,
+        operation_kind::single);
+    passed &= run_stress<three_node_stress_queue>("numa/3 nodes", 64, config,
+        operation_kind::bulk);
+    passed &= run_numa_topology_checks();
+#if !defined(_WIN32)
+    passed &= run_all_kinds<shared_stress_queue>("shared", 4, config);
+    passed &= run_close_stress<shared_stress_queue>("shared", 4, config);
+    passed &= run_shared_header_checks();
+#endif
+    passed &= run_broadcast_stress(4, config);
+    passed &= run_broadcast_stress(256, config);
+    passed &= run_close_stress<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpmc>>("mpmc", 4, config);
+    passed &= run_close_stress<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpsc>>("mpsc", 4, many_to_one);
+    passed &= run_close_stress<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_spmc>>("spmc", 4, one_to_many);
+    passed &= run_close_stress<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_spsc>>("spsc", 4, one_to_one);
+    passed &= run_close_stress<stress_queue<mpmc_pause_backoff, mpmc_auto_layout,
+        mpmc_mode_mpmc, mpmc_no_wait>>("mpmc/no wait", 4, config);
+    passed &= run_pool_stress(config);
+    passed &= run_priority_stress(config);
+    passed &= run_rpc_stress(config);
+    passed &= run_rpc_full_stress();
+    passed &= run_rpc_capacity_check();
+    passed &= run_lossy_stress(4, config);
+    passed &= run_lossy_stress(1024, config);
+    passed &= run_conflating_stress(config);
+#if MPMC_HAS_DOUBLE_WIDTH_CAS
+    passed &= run_tagged_stack_stress(config);
+#endif
+
+    return passed ? 0 : 1;
+}